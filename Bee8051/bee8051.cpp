@@ -1,399 +1,1221 @@
-/*
-    This file is part of Bee8051.
-    Copyright (C) 2022 BueniaDev.
-
-    Bee8051 is free software: you can redistribute it and/or modify
-    it under the terms of the GNU General Public License as published by
-    the Free Software Foundation, either version 3 of the License, or
-    (at your option) any later version.
-
-    Bee8051 is distributed in the hope that it will be useful,
-    but WITHOUT ANY WARRANTY; without even the implied warranty of
-    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-    GNU General Public License for more details.
-
-    You should have received a copy of the GNU General Public License
-    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
-*/
-
-#include "bee8051.h"
-using namespace bee8051;
-
-namespace bee8051
-{
-    Bee8051Interface::Bee8051Interface()
-    {
-
-    }
-
-    Bee8051Interface::~Bee8051Interface()
-    {
-
-    }
-
-    BeeMCS51::BeeMCS51(int prog_width, int data_width) : program_width(prog_width), data_bus_width(data_width)
-    {
-    }
-
-    BeeMCS51::~BeeMCS51()
-    {
-
-    }
-
-    void BeeMCS51::init()
-    {
-	pc = 0;
-	setPSW(0);
-	setAccum(0);
-	setSP(7);
-	setP0(0xFF);
-	setP1(0xFF);
-	setP2(0xFF);
-	setP3(0xFF);
-	int ram_size = (1 << data_bus_width);
-	internal_ram.resize(ram_size, 0);
-    }
-
-    void BeeMCS51::shutdown()
-    {
-	internal_ram.clear();
-    }
-
-    int BeeMCS51::runinstruction()
-    {
-	// TODO: Implement other components (i.e. IRQs, serial, timers, etc.)
-	uint8_t instr = readROM(pc++);
-
-	int inst_cycles = executeinstr(instr);
-
-	int cycles = (inst_cycles * 12);
-	return cycles;
-    }
-
-    void BeeMCS51::debugoutput(bool print_disassembly)
-    {
-	cout << "PC: " << hex << int(pc) << endl;
-	cout << "SP: " << hex << int(getSP()) << endl;
-	cout << "PSW: " << hex << int(getPSW()) << endl;
-	cout << "A: " << hex << int(getAccum()) << endl;
-	// cout << "B: " << hex << int(regb) << endl;
-	// cout << "DPTR: " << hex << int(regdptr) << endl;
-	// cout << "IE: " << hex << int(regie) << endl;
-	// cout << "IP: " << hex << int(regip) << endl;
-	/*
-	for (int i = 0; i < 4; i++)
-	{
-	    cout << "P" << dec << int(i) << ": " << hex << int(getPReg(i)) << endl;
-	}
-	*/
-
-	for (int i = 0; i < 8; i++)
-	{
-	    cout << "R" << dec << int(i) << ": " << hex << int(getReg(i)) << endl;
-	}
-
-	// cout << "RB: " << hex << int(regrb) << endl;
-	// cout << "TCON: " << hex << int(regtcon) << endl;
-	// cout << "TMOD: " << hex << int(tmod) << endl;
-	// cout << "TL0: " << hex << int(regtl0) << endl;
-	// cout << "TH0: " << hex << int(regth0) << endl;
-	// cout << "TL1: " << hex << int(regtl1) << endl;
-	// cout << "TH1: " << hex << int(regth1) << endl;
-
-	if (print_disassembly)
-	{
-	    stringstream ss;
-	    disassembleinstr(ss, pc);
-	    cout << "Current instruction: " << ss.str() << endl;
-	}
-
-	cout << endl;
-    }
-
-    int BeeMCS51::executeinstr(uint8_t instr)
-    {
-	int cycles = 1;
-
-	switch (instr)
-	{
-	    case 0x02:
-	    {
-		uint8_t high = readROM(pc++);
-		uint8_t low = readROM(pc++);
-		uint16_t addr = ((high << 8) | low);
-		pc = addr;
-		cycles = 2;
-	    }
-	    break; // ljmp code addr
-	    case 0x25:
-	    {
-		uint8_t addr = readROM(pc++);
-		uint8_t data = readIRAM(addr);
-
-		setAccum(add_accum(data));
-	    }
-	    break; // add a, data addr
-	    case 0x74:
-	    {
-		uint8_t data = readROM(pc++);
-		setAccum(data);
-	    }
-	    break; // mov a, #data
-	    case 0x75:
-	    {
-		uint8_t addr = readROM(pc++);
-		uint8_t data = readROM(pc++);
-		writeIRAM(addr, data);
-		cycles = 2;
-	    }
-	    break; // MOV data addr, #data
-	    case 0x78:
-	    case 0x79:
-	    case 0x7A:
-	    case 0x7B:
-	    case 0x7C:
-	    case 0x7D:
-	    case 0x7E:
-	    case 0x7F:
-	    {
-		uint8_t data = readROM(pc++);
-		int reg = (instr & 0x7);
-		setReg(reg, data);
-	    }
-	    break; // mov r0-r7, #data
-	    case 0x80:
-	    {
-		int8_t rel_addr = readROM(pc++);
-		pc += rel_addr;
-	    }
-	    break; // sjmp code addr
-	    case 0xC2:
-	    {
-		is_rwm = true;
-		uint8_t addr = readROM(pc++);
-		cout << "Setting bit of address of " << hex << int(addr) << endl;
-		writeBit(addr, false);
-		is_rwm = false;
-	    }
-	    break; // clrb bit addr
-	    case 0xD2:
-	    {
-		is_rwm = true;
-		uint8_t addr = readROM(pc++);
-		cout << "Setting bit of address of " << hex << int(addr) << endl;
-		writeBit(addr, true);
-		is_rwm = false;
-	    }
-	    break; // setb bit addr
-	    case 0xD8:
-	    case 0xD9:
-	    case 0xDA:
-	    case 0xDB:
-	    case 0xDC:
-	    case 0xDD:
-	    case 0xDE:
-	    case 0xDF:
-	    {
-		int8_t rel_addr = readROM(pc++);
-		int reg = (instr & 0x7);
-		setReg(reg, (getReg(reg) - 1));
-
-		if (getReg(reg) != 0)
-		{
-		    pc += rel_addr;
-		}
-
-		cycles = 2;
-	    }
-	    break; // djnz r0-r7, code addr
-	    case 0xF5:
-	    {
-		uint8_t addr = readROM(pc++);
-		writeIRAM(addr, getAccum());
-	    }
-	    break; // mov data addr, a
-	    case 0xF6:
-	    case 0xF7:
-	    {
-		int reg_val = getReg(instr & 0x1);
-		writeIRAMIndirect(reg_val, getAccum());
-	    }
-	    break; // mov @r0/@r1, a
-	    case 0xF8:
-	    case 0xF9:
-	    case 0xFA:
-	    case 0xFB:
-	    case 0xFC:
-	    case 0xFD:
-	    case 0xFE:
-	    case 0xFF:
-	    {
-		int reg = (instr & 0x7);
-		setReg(reg, getAccum());
-	    }
-	    break; // mov r0-r7, a
-	    default: unrecognizedinstr(instr); break;
-	}
-
-	calcParity();
-	return cycles;
-    }
-
-    void BeeMCS51::unrecognizedinstr(uint8_t instr)
-    {
-	cout << "Unrecognized instruction of " << hex << int(instr) << endl;
-	exit(1);
-    }
-
-    size_t BeeMCS51::disassembleinstr(ostream &stream, uint32_t pc)
-    {
-	uint32_t prev_pc = pc;
-	uint8_t instr = readROM(pc++);
-
-	switch (instr)
-	{
-	    case 0x02:
-	    {
-		uint8_t high = readROM(pc++);
-		uint8_t low = readROM(pc++);
-		uint16_t addr = ((high << 8) | low);
-		stream << "ljmp $" << hex << int(addr);
-	    }
-	    break;
-	    case 0x25:
-	    {
-		uint8_t addr = readROM(pc++);
-		stream << "add a, (" << hex << int(addr) << ")";
-	    }
-	    break;
-	    case 0x74:
-	    {
-		uint8_t data = readROM(pc++);
-		stream << "mov a, #$" << hex << int(data);
-	    }
-	    break;
-	    case 0x75:
-	    {
-		uint8_t addr = readROM(pc++);
-		uint8_t data = readROM(pc++);
-		stream << "mov " << get_sfr_names(addr) << ", #$" << hex << int(data);
-	    }
-	    break;
-	    case 0x78:
-	    case 0x79:
-	    case 0x7A:
-	    case 0x7B:
-	    case 0x7C:
-	    case 0x7D:
-	    case 0x7E:
-	    case 0x7F:
-	    {
-		uint8_t data = readROM(pc++);
-		stream << "mov r" << dec << int(instr & 0x7) << ", #$" << hex << int(data);
-	    }
-	    break;
-	    case 0x80:
-	    {
-		int8_t rel = readROM(pc++);
-		stream << "sjmp $" << hex << int(pc + rel);
-	    }
-	    break;
-	    case 0xC2:
-	    {
-		uint8_t addr = readROM(pc++);
-		stream << "clr " << get_bit_addr(addr);
-	    }
-	    break;
-	    case 0xD2:
-	    {
-		uint8_t addr = readROM(pc++);
-		stream << "setb " << get_bit_addr(addr);
-	    }
-	    break;
-	    case 0xD8:
-	    case 0xD9:
-	    case 0xDA:
-	    case 0xDB:
-	    case 0xDC:
-	    case 0xDD:
-	    case 0xDE:
-	    case 0xDF:
-	    {
-		int8_t rel = readROM(pc++);
-		stream << "djnz r" << dec << int(instr & 0x7) << ", $" << hex << int(pc + rel);
-	    }
-	    break;
-	    case 0xF5:
-	    {
-		uint8_t addr = readROM(pc++);
-		stream << "mov " << get_sfr_names(addr) << ", a";
-	    }
-	    break;
-	    case 0xF6:
-	    case 0xF7:
-	    {
-		int reg = (instr & 0x1);
-		stream << "mov @r" << dec << int(reg) << ", a";
-	    }
-	    break;
-	    case 0xF8:
-	    case 0xF9:
-	    case 0xFA:
-	    case 0xFB:
-	    case 0xFC:
-	    case 0xFD:
-	    case 0xFE:
-	    case 0xFF:
-	    {
-		stream << "mov r" << dec << int(instr & 0x7) << ", a";
-	    }
-	    break;
-	    default: stream << "unk"; break;
-	}
-
-	return (pc - prev_pc);
-    }
-
-    void BeeMCS51::setInterface(Bee8051Interface *cb)
-    {
-	inter = cb;
-    }
-
-    uint8_t BeeMCS51::readROM(uint16_t addr)
-    {
-	if (program_width != 0)
-	{
-	    int program_mask = ((1 << program_width) - 1);
-	    addr &= program_mask;
-	}
-
-	if (inter == NULL)
-	{
-	    return 0x00;
-	}
-
-	return inter->readROM(addr);
-    }
-
-    uint8_t BeeMCS51::portIn(int port)
-    {
-	port &= 3;
-
-	if (inter == NULL)
-	{
-	    return 0x00;
-	}
-
-	return inter->portIn(port);
-    }
-
-    void BeeMCS51::portOut(int port, uint8_t data)
-    {
-	port &= 3;
-
-	if (inter != NULL)
-	{
-	    inter->portOut(port, data);
-	}
-    }
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bee8051.h"
+#include "bee8051jit.h"
+#include "bee8051threaded.h"
+#include "bee8051timer.h"
+#include "bee8051serial.h"
+#include "bee8051state.h"
+#include <cstring>
+using namespace bee8051;
+
+namespace bee8051
+{
+    Bee8051Interface::Bee8051Interface()
+    {
+
+    }
+
+    Bee8051Interface::~Bee8051Interface()
+    {
+
+    }
+
+    uint8_t Bee8051Interface::readROM(uint16_t addr)
+    {
+        bee8051_trace(tracelevel::Error, "Reading ROM from address of %x, which the interface does not provide", addr);
+        return 0x00;
+    }
+
+    uint8_t Bee8051Interface::portIn(int port)
+    {
+        bee8051_trace(tracelevel::Warning, "Reading value from port of %d, which the interface does not provide", (port & 3));
+        return 0xFF;
+    }
+
+    void Bee8051Interface::portOut(int port, uint8_t data)
+    {
+        bee8051_trace(tracelevel::Warning, "Writing value of %x to port of %d, which the interface does not provide", data, (port & 3));
+    }
+
+    void Bee8051Interface::tracemsg(tracelevel level, const char *format, ...)
+    {
+        if ((core == NULL) || (core->trace_sink == NULL))
+        {
+            return;
+        }
+
+        char msg[256];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(msg, sizeof(msg), format, args);
+        va_end(args);
+        core->trace_sink->trace(level, msg);
+    }
+
+    BeeMCS51::BeeMCS51(int prog_width, int data_width) : program_width(prog_width), data_bus_width(data_width)
+    {
+        assert((data_bus_width >= 0) && (data_bus_width <= 8));
+
+        if (program_width != 0)
+        {
+            program_mask = ((1 << program_width) - 1);
+        }
+
+        ram_size = (1 << data_bus_width);
+
+        for (size_t opcode = 0; opcode < handlers.size(); opcode++)
+        {
+            handlers[opcode] = opcodetable()[opcode].handler;
+        }
+
+        for (auto &input : port_inputs)
+        {
+            input.store(-1);
+        }
+
+        timers = make_unique<Bee8051Timers>(*this);
+        serial = make_unique<Bee8051Serial>(*this);
+        resetHost();
+    }
+
+    BeeMCS51::~BeeMCS51()
+    {
+
+    }
+
+    void BeeMCS51::init()
+    {
+        for (size_t addr = 0; addr < name_table.size(); addr++)
+        {
+            // Addresses without a name come back as the address itself
+            string name = get_sfr_names(uint16_t(addr));
+            name_table[addr][0] = '\0';
+
+            if (!name.empty() && (name[0] != '$'))
+            {
+                setname(int(addr), name.c_str(), name.size());
+            }
+        }
+
+        sfr_table.fill(mcs51sfr());
+        registerSFR(0x81); // sp
+        registerSFR(0xE0); // acc
+
+        registerSFR(0xD0, [&](uint8_t) -> uint8_t
+        {
+            return getPSW();
+        },
+        [&](uint8_t, uint8_t data)
+        {
+            is_flags_pending = false;
+            reg_bank = (data & 0x18);
+        }); // psw
+
+        registerSFR(0xA8, NULL, [&](uint8_t, uint8_t)
+        {
+            irq_block_time = getcycles();
+            updateirq();
+        }); // ie
+
+        registerSFR(0xB8, NULL, [&](uint8_t, uint8_t)
+        {
+            irq_block_time = getcycles();
+            updateirq();
+        }); // ip
+
+        for (int port = 0; port < 4; port++)
+        {
+            registerSFR((0x80 + (port * 0x10)), [&, port](uint8_t) -> uint8_t
+            {
+                return readport(port);
+            },
+            [&, port](uint8_t, uint8_t data)
+            {
+                writeport(port, data);
+            }); // p0-p3
+
+            sfr_table[port * 0x10].is_port = true;
+        }
+
+        port_latches.fill(0xFF);
+
+        pc = 0;
+        setPSW(0);
+        setAccum(0);
+        setSP(7);
+        setP0(0xFF);
+        setP1(0xFF);
+        setP2(0xFF);
+        setP3(0xFF);
+        instr_cache.assign((program_mask + 1), mcs51instr());
+
+        slice_end = 0;
+        slice_budget = 0;
+        event_times.fill(INT64_MAX);
+        next_event_time = INT64_MAX;
+
+        writeRAM(0x1A8, 0);
+        writeRAM(0x1B8, 0);
+        irq_active.fill(false);
+        int_pins.fill(true);
+        irq_block_time = -1;
+        is_faulted = false;
+        timers->init();
+        serial->init();
+        updateirq();
+    }
+
+    void BeeMCS51::shutdown()
+    {
+        internal_mem.fill(0);
+        instr_cache.clear();
+    }
+
+    int BeeMCS51::runinstruction()
+    {
+        return runsingle<0>();
+    }
+
+    int64_t BeeMCS51::run(int64_t cycles)
+    {
+        return runloop<0>(cycles);
+    }
+
+    int64_t BeeMCS51::runUntilPC(int64_t cycles, uint16_t addr)
+    {
+        addr &= program_mask;
+
+        return runUntil(cycles, [&]() -> bool
+        {
+            return ((pc & program_mask) == addr);
+        });
+    }
+
+    void BeeMCS51::stop()
+    {
+        is_stop_requested = true;
+    }
+
+    bool BeeMCS51::isFaulted()
+    {
+        return is_faulted;
+    }
+
+    uint16_t BeeMCS51::getPC()
+    {
+        return pc;
+    }
+
+    void BeeMCS51::setPC(uint16_t addr)
+    {
+        pc = addr;
+    }
+
+    int64_t BeeMCS51::getCycles()
+    {
+        return getcycles();
+    }
+
+    uint8_t BeeMCS51::readMemory(uint16_t addr)
+    {
+        addr &= 0x1FF;
+
+        if (addr == 0x1D0)
+        {
+            syncFlags();
+        }
+
+        return internal_mem[addr];
+    }
+
+    void BeeMCS51::writeMemory(uint16_t addr, uint8_t data)
+    {
+        addr &= 0x1FF;
+        internal_mem[addr] = data;
+
+        if (addr == 0x1D0)
+        {
+            is_flags_pending = false;
+            reg_bank = (data & 0x18);
+        }
+    }
+
+    void BeeMCS51::pulseTimerInput(int timer, int pulses)
+    {
+        timers->pulse(timer, pulses);
+    }
+
+    void BeeMCS51::setIntPin(int line, bool is_high)
+    {
+        if ((line < 0) || (line > 1))
+        {
+            return;
+        }
+
+        timers->sync();
+        bool is_falling = (int_pins[line] && !is_high);
+        int_pins[line] = is_high;
+
+        // Edge-triggered requests latch in IEx, level-triggered ones
+        // follow the pin and are picked up by updateirq()
+        if (testbit(readRAM(0x188), (line * 2)) && is_falling)
+        {
+            writeRAM(0x188, setbit(readRAM(0x188), ((line * 2) + 1)));
+        }
+
+        timers->update();
+        updateirq();
+    }
+
+    void BeeMCS51::setPortNotify(bool is_changes_only)
+    {
+        is_port_changes_only = is_changes_only;
+    }
+
+    void BeeMCS51::setPortInput(int port, uint8_t data)
+    {
+        port_inputs[port & 3].store(data, memory_order_relaxed);
+    }
+
+    void BeeMCS51::releasePortInput(int port)
+    {
+        port_inputs[port & 3].store(-1, memory_order_relaxed);
+    }
+
+    size_t BeeMCS51::readSerial(uint8_t *data, size_t size)
+    {
+        return serial->read(data, size);
+    }
+
+    size_t BeeMCS51::writeSerial(const uint8_t *data, size_t size)
+    {
+        return serial->write(data, size);
+    }
+
+    void BeeMCS51::setSerialBufferSize(size_t size)
+    {
+        serial->setbuffersize(size);
+    }
+
+    size_t BeeMCS51::getStateSize()
+    {
+        Bee8051StateWriter writer(NULL, 0);
+        savestate(writer);
+        return writer.size();
+    }
+
+    size_t BeeMCS51::saveState(uint8_t *buffer, size_t size)
+    {
+        Bee8051StateWriter writer(buffer, size);
+        savestate(writer);
+        return writer.isValid() ? writer.size() : 0;
+    }
+
+    bool BeeMCS51::loadState(const uint8_t *buffer, size_t size)
+    {
+        if ((buffer == NULL) || (size < getStateSize()))
+        {
+            return false;
+        }
+
+        // Check the header before anything gets overwritten
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        int prog_width = 0;
+        int data_width = 0;
+        Bee8051StateReader header(buffer, size);
+        header.get(magic);
+        header.get(version);
+        header.get(prog_width);
+        header.get(data_width);
+
+        if ((magic != state_magic) || (version != state_version) || (prog_width != program_width) || (data_width != data_bus_width))
+        {
+            return false;
+        }
+
+        Bee8051StateReader reader(buffer, size);
+        loadstate(reader);
+        return reader.isValid();
+    }
+
+    void BeeMCS51::savestate(Bee8051StateWriter &writer)
+    {
+        writer.put(state_magic);
+        writer.put(state_version);
+        writer.put(program_width);
+        writer.put(data_bus_width);
+
+        writer.put(pc);
+        writer.put(is_rwm);
+        writer.put(is_faulted);
+        writer.put(reg_bank);
+        writer.put(internal_mem);
+        writer.put(is_flags_pending);
+        writer.put(flags_accum);
+        writer.put(flags_data);
+        writer.put(flags_carry);
+        writer.put(port_latches);
+
+        writer.put(getcycles());
+        writer.put(event_times);
+        writer.put(next_event_time);
+
+        writer.put(is_irq_pending);
+        writer.put(irq_requests);
+        writer.put(irq_active);
+        writer.put(int_pins);
+        writer.put(irq_block_time);
+
+        timers->savestate(writer);
+        serial->savestate(writer);
+    }
+
+    void BeeMCS51::loadstate(Bee8051StateReader &reader)
+    {
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        int prog_width = 0;
+        int data_width = 0;
+        reader.get(magic);
+        reader.get(version);
+        reader.get(prog_width);
+        reader.get(data_width);
+
+        reader.get(pc);
+        reader.get(is_rwm);
+        reader.get(is_faulted);
+        reader.get(reg_bank);
+        reader.get(internal_mem);
+        reader.get(is_flags_pending);
+        reader.get(flags_accum);
+        reader.get(flags_data);
+        reader.get(flags_carry);
+        reader.get(port_latches);
+
+        // Snapshots are only taken between slices, so the whole clock
+        // lives in slice_end
+        reader.get(slice_end);
+        slice_budget = 0;
+        is_slice_cut = false;
+        reader.get(event_times);
+        reader.get(next_event_time);
+
+        reader.get(is_irq_pending);
+        reader.get(irq_requests);
+        reader.get(irq_active);
+        reader.get(int_pins);
+        reader.get(irq_block_time);
+
+        timers->loadstate(reader);
+        serial->loadstate(reader);
+    }
+
+    void BeeMCS51::beginslice(int64_t end_cycles)
+    {
+        int64_t cycles = getcycles();
+        slice_end = min(end_cycles, next_event_time);
+
+        // An interrupt is only pending here if it is blocked, and can be
+        // serviced once one more instruction has run
+        if (is_irq_pending)
+        {
+            slice_end = min(slice_end, (cycles + 1));
+        }
+
+        slice_budget = (slice_end - cycles);
+        is_slice_cut = false;
+    }
+
+    // Ends the current slice after the instruction in progress
+    void BeeMCS51::cutslice()
+    {
+        int64_t cycles = getcycles();
+
+        if (cycles < slice_end)
+        {
+            slice_budget -= (slice_end - cycles);
+            slice_end = cycles;
+            is_slice_cut = true;
+        }
+    }
+
+    void BeeMCS51::endslice()
+    {
+        slice_end = getcycles();
+        slice_budget = 0;
+
+        if (next_event_time <= slice_end)
+        {
+            runevents();
+        }
+    }
+
+    // Safe to call while a slice is running; if the event is due before
+    // the slice ends, the slice is cut short so that it stops in time
+    void BeeMCS51::scheduleevent(int id, int64_t time)
+    {
+        event_times[id] = time;
+        next_event_time = min(next_event_time, time);
+
+        if (time < slice_end)
+        {
+            slice_budget -= (slice_end - time);
+            slice_end = time;
+            is_slice_cut = true;
+        }
+    }
+
+    void BeeMCS51::cancelevent(int id)
+    {
+        event_times[id] = INT64_MAX;
+    }
+
+    void BeeMCS51::runevents()
+    {
+        int64_t cycles = getcycles();
+
+        while (next_event_time <= cycles)
+        {
+            next_event_time = INT64_MAX;
+
+            for (int id = 0; id < EventCount; id++)
+            {
+                if (event_times[id] > cycles)
+                {
+                    continue;
+                }
+
+                event_times[id] = INT64_MAX;
+
+                switch (id)
+                {
+                    case EventTimer0:
+                    case EventTimer1: timers->event(); break;
+                    case EventSerialTx:
+                    case EventSerialRx: serial->event(id); break;
+                    default: break;
+                }
+            }
+
+            for (auto time : event_times)
+            {
+                next_event_time = min(next_event_time, time);
+            }
+        }
+    }
+
+    void BeeMCS51::updateirq()
+    {
+        uint8_t tcon = readRAM(0x188);
+
+        // Level-triggered external requests follow the INTx pins
+        for (int line = 0; line < 2; line++)
+        {
+            if (!testbit(tcon, (line * 2)))
+            {
+                tcon = changebit(tcon, ((line * 2) + 1), !int_pins[line]);
+            }
+        }
+
+        writeRAM(0x188, tcon);
+        uint8_t scon = readRAM(0x198);
+
+        // Requests in polling order, which is also their order in IE and IP
+        uint8_t requests = 0;
+        requests = changebit(requests, 0, testbit(tcon, 1)); // ie0
+        requests = changebit(requests, 1, testbit(tcon, 5)); // tf0
+        requests = changebit(requests, 2, testbit(tcon, 3)); // ie1
+        requests = changebit(requests, 3, testbit(tcon, 7)); // tf1
+        requests = changebit(requests, 4, ((scon & 0x3) != 0)); // ri/ti
+
+        uint8_t ie = readRAM(0x1A8);
+        irq_requests = (testbit(ie, 7)) ? (requests & ie & 0x1F) : 0;
+
+        // Only a high priority request can preempt a low priority handler,
+        // and nothing preempts a high priority one
+        if (irq_active[1])
+        {
+            irq_requests = 0;
+        }
+        else if (irq_active[0])
+        {
+            irq_requests &= readRAM(0x1B8);
+        }
+
+        is_irq_pending = (irq_requests != 0);
+
+        if (is_irq_pending)
+        {
+            cutslice();
+        }
+    }
+
+    // Services the highest priority request with a hardware LCALL to its
+    // vector; only called from between slices, once isirqdue() is true
+    void BeeMCS51::vectorirq()
+    {
+        uint8_t ip = readRAM(0x1B8);
+        uint8_t high_requests = (irq_requests & ip);
+        uint8_t requests = (high_requests != 0) ? high_requests : irq_requests;
+
+        int source = 0;
+
+        while (!testbit(requests, source))
+        {
+            source++;
+        }
+
+        irq_active[testbit(ip, source) ? 1 : 0] = true;
+        bee8051_trace(tracelevel::Debug, "Servicing interrupt %d", source);
+
+        switch (source)
+        {
+            case 0:
+            case 2:
+            {
+                // Only edge-triggered requests are cleared by hardware
+                uint8_t tcon = readRAM(0x188);
+
+                if (testbit(tcon, source))
+                {
+                    writeRAM(0x188, resetbit(tcon, (source + 1)));
+                }
+            }
+            break;
+            case 1: timers->acknowledge(0); break;
+            case 3: timers->acknowledge(1); break;
+            default: break;
+        }
+
+        uint8_t sp = getSP();
+        writeIRAMIndirect(++sp, (pc & 0xFF));
+        writeIRAMIndirect(++sp, (pc >> 8));
+        setSP(sp);
+        pc = (0x03 + (source * 8));
+
+        slice_end += 24;
+        runevents();
+        updateirq();
+    }
+
+    void BeeMCS51::debugoutput(bool print_disassembly)
+    {
+        cout << "PC: " << hex << int(pc) << endl;
+        cout << "SP: " << hex << int(getSP()) << endl;
+        cout << "PSW: " << hex << int(getPSW()) << endl;
+        cout << "A: " << hex << int(getAccum()) << endl;
+        // cout << "B: " << hex << int(regb) << endl;
+        // cout << "DPTR: " << hex << int(regdptr) << endl;
+        // cout << "IE: " << hex << int(regie) << endl;
+        // cout << "IP: " << hex << int(regip) << endl;
+        /*
+        for (int i = 0; i < 4; i++)
+        {
+            cout << "P" << dec << int(i) << ": " << hex << int(getPReg(i)) << endl;
+        }
+        */
+
+        for (int i = 0; i < 8; i++)
+        {
+            cout << "R" << dec << int(i) << ": " << hex << int(getReg(i)) << endl;
+        }
+
+        // cout << "RB: " << hex << int(regrb) << endl;
+        // cout << "TCON: " << hex << int(regtcon) << endl;
+        // cout << "TMOD: " << hex << int(tmod) << endl;
+        // cout << "TL0: " << hex << int(regtl0) << endl;
+        // cout << "TH0: " << hex << int(regth0) << endl;
+        // cout << "TL1: " << hex << int(regtl1) << endl;
+        // cout << "TH1: " << hex << int(regth1) << endl;
+
+        if (print_disassembly)
+        {
+            char buffer[64];
+            disassembleinstr(buffer, sizeof(buffer), pc);
+            cout << "Current instruction: " << buffer << endl;
+        }
+
+        cout << endl;
+    }
+
+    const array<BeeMCS51::mcs51opcode, 256> &BeeMCS51::opcodetable()
+    {
+        static const array<mcs51opcode, 256> table = []()
+        {
+            array<mcs51opcode, 256> ops;
+            ops.fill({1, 1, &BeeMCS51::op_unknown, "unk"});
+
+            ops[0x02] = {3, 2, &BeeMCS51::op_ljmp, "ljmp $%l"};
+            ops[0x32] = {1, 2, &BeeMCS51::op_reti<>, "reti"};
+            ops[0x25] = {2, 1, &BeeMCS51::op_add_dir<>, "add a, (%x)"};
+            ops[0x74] = {2, 1, &BeeMCS51::op_mov_a_imm, "mov a, #$%x"};
+            ops[0x75] = {3, 2, &BeeMCS51::op_mov_dir_imm<>, "mov %d, #$%x"};
+            ops[0x80] = {2, 2, &BeeMCS51::op_sjmp, "sjmp $%j"};
+            ops[0xC2] = {2, 1, &BeeMCS51::op_clr_bit<>, "clr %b"};
+            ops[0xD2] = {2, 1, &BeeMCS51::op_setb_bit<>, "setb %b"};
+            ops[0xF5] = {2, 1, &BeeMCS51::op_mov_dir_a<>, "mov %d, a"};
+            ops[0xF6] = {1, 1, &BeeMCS51::op_mov_ind_a<>, "mov @r%i, a"};
+            ops[0xF7] = {1, 1, &BeeMCS51::op_mov_ind_a<>, "mov @r%i, a"};
+
+            for (int reg = 0; reg < 8; reg++)
+            {
+                ops[0x78 | reg] = {2, 1, &BeeMCS51::op_mov_rn_imm, "mov r%r, #$%x"};
+                ops[0xD8 | reg] = {2, 2, &BeeMCS51::op_djnz_rn, "djnz r%r, $%j"};
+                ops[0xF8 | reg] = {1, 1, &BeeMCS51::op_mov_rn_a, "mov r%r, a"};
+            }
+
+            return ops;
+        }();
+
+        return table;
+    }
+
+    // Loops whose only effect is to burn cycles, or to count down a
+    // register: sjmp $, ljmp $ and djnz rn, $
+    bool BeeMCS51::isidleloop(uint16_t addr, const mcs51instr &instr)
+    {
+        switch (instr.opcode)
+        {
+            case 0x02: return (((instr.operands[0] << 8) | instr.operands[1]) == addr);
+            case 0x80: return (instr.operands[0] == 0xFE);
+            default: break;
+        }
+
+        return (((instr.opcode & 0xF8) == 0xD8) && (instr.operands[0] == 0xFE));
+    }
+
+    void BeeMCS51::skipidle(const mcs51instr &instr)
+    {
+        int64_t instr_cycles = (instr.cycles * 12);
+        int64_t count = max<int64_t>(1, ((slice_budget + instr_cycles - 1) / instr_cycles));
+
+        if (instr.opcode == 0x02)
+        {
+            // Decoded entries are shared between mirrored addresses,
+            // so this is only a loop at the address it was decoded at
+            uint16_t target = ((instr.operands[0] << 8) | instr.operands[1]);
+
+            if (target != pc)
+            {
+                pc = target;
+                count = 1;
+            }
+        }
+        else if ((instr.opcode & 0xF8) == 0xD8)
+        {
+            int reg = (instr.opcode & 0x7);
+            int remaining = (getReg(reg) == 0) ? 256 : getReg(reg);
+
+            if (count >= remaining)
+            {
+                count = remaining;
+                pc += instr.length;
+            }
+
+            setReg(reg, uint8_t(getReg(reg) - count));
+        }
+
+        slice_budget -= (count * instr_cycles);
+    }
+
+    void BeeMCS51::invalidateROM()
+    {
+        for (auto &instr : instr_cache)
+        {
+            instr.is_decoded = false;
+        }
+
+        flushtranslations();
+    }
+
+    void BeeMCS51::invalidateROM(uint16_t addr, size_t size)
+    {
+        if (instr_cache.empty())
+        {
+            return;
+        }
+
+        // Instructions are up to 3 bytes long, so those starting
+        // just before the modified range may overlap it as well
+        uint16_t start = (addr - 2);
+        size_t length = min((size + 2), instr_cache.size());
+
+        for (size_t i = 0; i < length; i++)
+        {
+            instr_cache[(start + i) & program_mask].is_decoded = false;
+        }
+
+        flushtranslations();
+    }
+
+    void BeeMCS51::setInstrCache(bool is_enabled)
+    {
+        is_cache_enabled = is_enabled;
+        invalidateROM();
+    }
+
+    bool BeeMCS51::setExecMode(execmode mode)
+    {
+        switch (mode)
+        {
+            case execmode::Threaded:
+            {
+                if (!threaded)
+                {
+                    threaded = make_unique<Bee8051Threaded>(*this);
+                }
+            }
+            break;
+            case execmode::JIT:
+            {
+                if (!jit)
+                {
+                    jit = make_unique<Bee8051JIT>(*this);
+                }
+
+                if (!jit->isAvailable())
+                {
+                    return false;
+                }
+            }
+            break;
+            default: break;
+        }
+
+        exec_mode = mode;
+        return true;
+    }
+
+    execmode BeeMCS51::getExecMode()
+    {
+        return exec_mode;
+    }
+
+    void BeeMCS51::runtranslated()
+    {
+        if (exec_mode == execmode::JIT)
+        {
+            jit->run();
+        }
+        else
+        {
+            threaded->run();
+        }
+    }
+
+    void BeeMCS51::flushtranslations()
+    {
+        if (jit)
+        {
+            jit->flush();
+        }
+
+        if (threaded)
+        {
+            threaded->flush();
+        }
+    }
+
+    void BeeMCS51::op_unknown(const mcs51instr &instr)
+    {
+        pc -= instr.length;
+        unrecognizedinstr(instr.opcode);
+    }
+
+    // ljmp code addr
+    void BeeMCS51::op_ljmp(const mcs51instr &instr)
+    {
+        uint16_t addr = ((instr.operands[0] << 8) | instr.operands[1]);
+        pc = addr;
+    }
+
+    // mov a, #data
+    void BeeMCS51::op_mov_a_imm(const mcs51instr &instr)
+    {
+        setAccum(instr.operands[0]);
+    }
+
+    // mov r0-r7, #data
+    void BeeMCS51::op_mov_rn_imm(const mcs51instr &instr)
+    {
+        setReg((instr.opcode & 0x7), instr.operands[0]);
+    }
+
+    // sjmp code addr
+    void BeeMCS51::op_sjmp(const mcs51instr &instr)
+    {
+        pc += int8_t(instr.operands[0]);
+    }
+
+    // djnz r0-r7, code addr
+    void BeeMCS51::op_djnz_rn(const mcs51instr &instr)
+    {
+        int reg = (instr.opcode & 0x7);
+        uint8_t data = (getReg(reg) - 1);
+        setReg(reg, data);
+
+        if (data != 0)
+        {
+            pc += int8_t(instr.operands[0]);
+        }
+    }
+
+    // mov r0-r7, a
+    void BeeMCS51::op_mov_rn_a(const mcs51instr &instr)
+    {
+        setReg((instr.opcode & 0x7), getAccum());
+    }
+
+    // Interrupt bookkeeping for reti, once the return address is popped
+    void BeeMCS51::finishreti()
+    {
+        if (irq_active[1])
+        {
+            irq_active[1] = false;
+        }
+        else
+        {
+            irq_active[0] = false;
+        }
+
+        irq_block_time = getcycles();
+        updateirq();
+    }
+
+    void BeeMCS51::unrecognizedinstr(uint8_t instr)
+    {
+        bee8051_trace(tracelevel::Error, "Unrecognized instruction of %x", instr);
+        is_faulted = true;
+        stop();
+    }
+
+    // Appends to a fixed buffer, dropping whatever does not fit, and
+    // terminates it once done
+    class disasmbuffer
+    {
+        public:
+            disasmbuffer(char *buffer, size_t size) : data(buffer), capacity(size)
+            {
+
+            }
+
+            ~disasmbuffer()
+            {
+                if (capacity != 0)
+                {
+                    data[count] = '\0';
+                }
+            }
+
+            void put(char ch)
+            {
+                if ((count + 1) < capacity)
+                {
+                    data[count++] = ch;
+                }
+            }
+
+            void put(const char *text)
+            {
+                while (*text != '\0')
+                {
+                    put(*text++);
+                }
+            }
+
+            void puthex(uint32_t value)
+            {
+                char digits[8];
+                int length = 0;
+
+                do
+                {
+                    digits[length++] = "0123456789abcdef"[value & 0xF];
+                    value >>= 4;
+                } while (value != 0);
+
+                while (length > 0)
+                {
+                    put(digits[--length]);
+                }
+            }
+
+            void putdec(uint32_t value)
+            {
+                char digits[10];
+                int length = 0;
+
+                do
+                {
+                    digits[length++] = char('0' + (value % 10));
+                    value /= 10;
+                } while (value != 0);
+
+                while (length > 0)
+                {
+                    put(digits[--length]);
+                }
+            }
+
+        private:
+            char *data = NULL;
+            size_t capacity = 0;
+            size_t count = 0;
+    };
+
+    size_t BeeMCS51::disassembleinstr(char *buffer, size_t size, uint32_t pc)
+    {
+        uint8_t opcode = readROM(pc);
+        array<uint8_t, 2> operands = {{0, 0}};
+
+        for (int i = 1; i < opcodetable()[opcode].length; i++)
+        {
+            operands[i - 1] = readROM(pc + i);
+        }
+
+        return formatinstr(buffer, size, uint16_t(pc), opcode, operands.data());
+    }
+
+    size_t BeeMCS51::disassembleinstr(ostream &stream, uint32_t pc)
+    {
+        char buffer[64];
+        size_t length = disassembleinstr(buffer, sizeof(buffer), pc);
+        stream << buffer;
+        return length;
+    }
+
+    size_t BeeMCS51::formatinstr(char *buffer, size_t size, uint16_t pc, uint8_t opcode, const uint8_t *operands)
+    {
+        const mcs51opcode &info = opcodetable()[opcode];
+        disasmbuffer text(buffer, size);
+        int operand = 0;
+
+        for (const char *format = info.format; *format != '\0'; format++)
+        {
+            if ((format[0] != '%') || (format[1] == '\0'))
+            {
+                text.put(*format);
+                continue;
+            }
+
+            switch (*++format)
+            {
+                case 'x': text.puthex(operands[operand++]); break;
+                case 'r': text.putdec(opcode & 0x7); break;
+                case 'i': text.putdec(opcode & 0x1); break;
+                case 'l':
+                {
+                    text.puthex((operands[operand] << 8) | operands[operand + 1]);
+                    operand += 2;
+                }
+                break;
+                case 'j':
+                {
+                    int8_t rel = int8_t(operands[operand++]);
+                    text.puthex(uint16_t(pc + info.length + rel));
+                }
+                break;
+                case 'd':
+                {
+                    uint8_t addr = operands[operand++];
+
+                    if (name_table[addr][0] != '\0')
+                    {
+                        text.put(name_table[addr].data());
+                    }
+                    else
+                    {
+                        text.put('$');
+                        text.puthex(addr);
+                    }
+                }
+                break;
+                case 'b':
+                {
+                    // Bits below 0x80 live in IRAM from 0x20 up, and the
+                    // rest in the SFRs at multiples of 8
+                    uint8_t addr = operands[operand++];
+                    uint8_t byte_addr = (addr < 0x80) ? ((addr >> 3) | 0x20) : (addr & 0xF8);
+
+                    if ((addr >= 0x80) && (name_table[0x100 | addr][0] != '\0'))
+                    {
+                        text.put(name_table[0x100 | addr].data());
+                        break;
+                    }
+
+                    if ((addr >= 0x80) && (name_table[byte_addr][0] != '\0'))
+                    {
+                        text.put(name_table[byte_addr].data());
+                    }
+                    else
+                    {
+                        text.put('$');
+                        text.puthex(byte_addr);
+                    }
+
+                    text.put('.');
+                    text.putdec(addr & 0x7);
+                }
+                break;
+                default: text.put(*format); break;
+            }
+        }
+
+        return info.length;
+    }
+
+    void BeeMCS51::setname(int addr, const char *name, size_t length)
+    {
+        if ((addr < 0) || (addr >= int(name_table.size())))
+        {
+            return;
+        }
+
+        auto &entry = name_table[addr];
+        length = min(length, (entry.size() - 1));
+        memcpy(entry.data(), name, length);
+        entry[length] = '\0';
+    }
+
+    void BeeMCS51::setInterface(Bee8051Interface *cb)
+    {
+        resetHost();
+        host.iface = cb;
+
+        if (cb != NULL)
+        {
+            cb->core = this;
+        }
+    }
+
+    void BeeMCS51::resetHost()
+    {
+        if ((host.iface != NULL) && (host.iface->core == this))
+        {
+            host.iface->core = NULL;
+        }
+
+        host.iface = NULL;
+        host.context = NULL;
+        host.tag = NULL;
+
+        host.read_rom = [](void*, uint16_t) -> uint8_t
+        {
+            return 0x00;
+        };
+
+        host.port_in = [](void*, int) -> uint8_t
+        {
+            return 0x00;
+        };
+
+        host.port_out = [](void*, int, uint8_t)
+        {
+            return;
+        };
+
+        host.port_changed = [](void*, int, uint8_t, int64_t)
+        {
+            return;
+        };
+
+        sethosthandlers<void>();
+        invalidateROM();
+    }
+
+    void BeeMCS51::setTraceSink(Bee8051TraceSink *sink)
+    {
+        trace_sink = sink;
+    }
+
+    void BeeMCS51::attachROM(const uint8_t *data, size_t size)
+    {
+        rom_buffer = data;
+        rom_size = (data != NULL) ? size : 0;
+        invalidateROM();
+    }
+
+    void BeeMCS51::detachROM()
+    {
+        attachROM(NULL, 0);
+    }
+
+    void BeeMCS51::registerSFR(uint8_t addr, sfrreadfunc read_func, sfrwritefunc write_func)
+    {
+        if (addr < 0x80)
+        {
+            return;
+        }
+
+        mcs51sfr &sfr = sfr_table[addr & 0x7F];
+        sfr.is_used = true;
+        sfr.is_plain = (!read_func && !write_func);
+        sfr.is_port = false;
+        sfr.read_func = read_func;
+        sfr.write_func = write_func;
+
+        flushtranslations();
+    }
+
+    void BeeMCS51::unregisterSFR(uint8_t addr)
+    {
+        if (addr < 0x80)
+        {
+            return;
+        }
+
+        sfr_table[addr & 0x7F] = mcs51sfr();
+
+        flushtranslations();
+    }
+
+    uint8_t BeeMCS51::readSFRHandler(uint8_t addr)
+    {
+        const mcs51sfr &sfr = sfr_table[addr & 0x7F];
+
+        if (sfr.read_func)
+        {
+            return sfr.read_func(addr);
+        }
+
+        if (!sfr.is_used)
+        {
+            bee8051_trace(tracelevel::Warning, "Invalid/unimplemented read from SFR address of %x", addr);
+            return 0xFF;
+        }
+
+        return readRAM(addr | 0x100);
+    }
+
+    void BeeMCS51::writeSFRHandler(uint8_t addr, uint8_t data)
+    {
+        const mcs51sfr &sfr = sfr_table[addr & 0x7F];
+
+        if (sfr.write_func)
+        {
+            sfr.write_func(addr, data);
+        }
+        else if (!sfr.is_used)
+        {
+            bee8051_trace(tracelevel::Warning, "Invalid/unimplemented write to SFR address of %x", addr);
+        }
+    }
 };
\ No newline at end of file
@@ -1,560 +1,1500 @@
-/*
-    This file is part of Bee8051.
-    Copyright (C) 2022 BueniaDev.
-
-    Bee8051 is free software: you can redistribute it and/or modify
-    it under the terms of the GNU General Public License as published by
-    the Free Software Foundation, either version 3 of the License, or
-    (at your option) any later version.
-
-    Bee8051 is distributed in the hope that it will be useful,
-    but WITHOUT ANY WARRANTY; without even the implied warranty of
-    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-    GNU General Public License for more details.
-
-    You should have received a copy of the GNU General Public License
-    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
-*/
-
-#ifndef BEE8051_H
-#define BEE8051_H
-
-#include <iostream>
-#include <sstream>
-#include <cstdint>
-#include <vector>
-#include <array>
-#include <cassert>
-#include <unordered_map>
-using namespace std;
-
-namespace bee8051
-{
-    class Bee8051Interface
-    {
-	public:
-	    Bee8051Interface();
-	    ~Bee8051Interface();
-
-	    virtual uint8_t readROM(uint16_t addr)
-	    {
-		cout << "Reading ROM from address of " << hex << int(addr) << endl;
-		exit(0);
-		return 0;
-	    }
-
-	    virtual uint8_t portIn(int port)
-	    {
-		port &= 3;
-		cout << "Reading value from port of " << dec << int(port) << endl;
-		exit(0);
-		return 0;
-	    }
-
-	    virtual void portOut(int port, uint8_t data)
-	    {
-		port &= 3;
-		cout << "Writing value of " << hex << int(data) << " to port of " << dec << int(port) << endl;
-		exit(0);
-	    }
-    };
-
-    class BeeMCS51
-    {
-	public:
-	    BeeMCS51(int prog_width, int data_width);
-	    ~BeeMCS51();
-
-	    virtual void init();
-	    virtual void shutdown();
-
-	    int runinstruction();
-
-	    void debugoutput(bool print_disassembly = true);
-	    size_t disassembleinstr(ostream &stream, uint32_t pc);
-
-	    void setInterface(Bee8051Interface *cb);
-
-	protected:
-	    virtual string get_sfr_names(uint16_t addr)
-	    {
-		stringstream ss;
-		auto i = mem_names.find(addr);
-
-		if (i == mem_names.end())
-		{
-		    ss << "$" << hex << int(addr);
-		}
-		else
-		{
-		    ss << i->second;
-		}
-
-		return ss.str();
-	    }
-
-	    string get_bit_addr(uint8_t addr)
-	    {
-		stringstream ss;
-		if (addr < 0x80)
-		{
-		    ss << "$" << hex << int((addr >> 3) | 0x20) << "." << dec << int(addr & 0x7);
-		}
-		else
-		{
-		    auto i = mem_names.find((addr | 0x100));
-
-		    if (i == mem_names.end())
-		    {
-			i = mem_names.find((addr & 0xF8));
-
-			if (i == mem_names.end())
-			{
-			    ss << "$" << hex << int((addr & 0xF8)) << "." << dec << int(addr & 0x7);
-			}
-			else
-			{
-			    ss << i->second << "." << dec << int((addr & 0x7));
-			}
-		    }
-		    else
-		    {
-			ss << i->second;
-		    }
-		}
-
-		return ss.str();
-	    }
-
-	    struct meminfo
-	    {
-		int addr = 0;
-		string name = "";
-	    };
-
-	    void add_names(vector<meminfo> info)
-	    {
-		for (size_t i = 0; info[i].addr >= 0; i++)
-		{
-		    mem_names[info[i].addr] = info[i].name;
-		}
-	    }
-
-	    template<typename ...Names>
-	    void add_names(vector<meminfo> info, Names &&... names)
-	    {
-		add_names(names...);
-		add_names(info);
-	    }
-
-	    vector<meminfo> default_names = 
-	    {
-		{0x81, "sp"},
-		{0x1B6, "wr"},
-		{0x1B7, "rd"},
-		{-1, ""},
-	    };
-
-	private:
-	    template<typename T>
-	    bool testbit(T reg, int bit)
-	    {
-		return ((reg >> bit) & 1) ? true : false;
-	    }
-
-	    template<typename T>
-	    T setbit(T reg, int bit)
-	    {
-		return (reg | (1 << bit));
-	    }
-
-	    template<typename T>
-	    T resetbit(T reg, int bit)
-	    {
-		return (reg & ~(1 << bit));
-	    }
-
-	    template<typename T>
-	    T changebit(T reg, int bit, bool is_set)
-	    {
-		if (is_set)
-		{
-		    return setbit(reg, bit);
-		}
-		else
-		{
-		    return resetbit(reg, bit);
-		}
-	    }
-
-	    Bee8051Interface *inter = NULL;
-
-	    int program_width = 0;
-	    int data_bus_width = 0;
-
-	    uint8_t readROM(uint16_t addr);
-	    uint8_t portIn(int port);
-	    void portOut(int port, uint8_t data);
-
-	    int executeinstr(uint8_t instr);
-
-	    void unrecognizedinstr(uint8_t instr);
-
-	    vector<uint8_t> internal_ram;
-	    array<uint8_t, 0x100> sfr_ram;
-
-	    uint8_t getReg(int reg)
-	    {
-		reg &= 7;
-		int addr = ((getPSW() & 0x18) | reg);
-		return readRAM(addr);
-	    }
-
-	    void setReg(int reg, uint8_t data)
-	    {
-		reg &= 7;
-		int addr = ((getPSW() & 0x18) | reg);
-		writeRAM(addr, data);
-	    }
-
-	    uint8_t getAccum()
-	    {
-		return readSFR(0xE0);
-	    }
-
-	    void setAccum(uint8_t data)
-	    {
-		writeSFR(0xE0, data);
-	    }
-
-	    uint8_t getPSW()
-	    {
-		return readSFR(0xD0);
-	    }
-
-	    void setPSW(uint8_t data)
-	    {
-		writeSFR(0xD0, data);
-	    }
-
-	    uint8_t getSP()
-	    {
-		return readSFR(0x81);
-	    }
-
-	    void setSP(uint8_t data)
-	    {
-		writeSFR(0x81, data);
-	    }
-
-	    uint8_t getP0()
-	    {
-		return readRAM(0x180);
-	    }
-
-	    void setP0(uint8_t data)
-	    {
-		writeSFR(0x80, data);
-	    }
-
-	    uint8_t getP1()
-	    {
-		return readRAM(0x190);
-	    }
-
-	    void setP1(uint8_t data)
-	    {
-		writeSFR(0x90, data);
-	    }
-
-	    uint8_t getP2()
-	    {
-		return readRAM(0x1A0);
-	    }
-
-	    void setP2(uint8_t data)
-	    {
-		writeSFR(0xA0, data);
-	    }
-
-	    uint8_t getP3()
-	    {
-		return readRAM(0x1B0);
-	    }
-
-	    void setP3(uint8_t data)
-	    {
-		writeSFR(0xB0, data);
-	    }
-
-	    void changePSWBit(int bit, bool is_set)
-	    {
-		setPSW(changebit(getPSW(), bit, is_set));
-	    }
-
-	    void setParity(bool is_set)
-	    {
-		changePSWBit(0, is_set);
-	    }
-
-	    void setCarry(bool is_set)
-	    {
-		changePSWBit(7, is_set);
-	    }
-
-	    void setHalf(bool is_set)
-	    {
-		changePSWBit(6, is_set);
-	    }
-
-	    void setOverflow(bool is_set)
-	    {
-		changePSWBit(2, is_set);
-	    }
-
-	    void calcParity()
-	    {
-		uint8_t parity = 0;
-		uint8_t accum = getAccum();
-
-		for (int i = 0; i < 8; i++)
-		{
-		    parity ^= testbit(accum, 0);
-		    accum >>= 1;
-		}
-
-		setParity(testbit(parity, 0));
-	    }
-
-	    uint8_t readRAM(uint16_t addr)
-	    {
-		uint8_t data = 0;
-
-		int ram_addr = (1 << data_bus_width);
-
-		if (addr < ram_addr)
-		{
-		    data = internal_ram.at(addr);
-		}
-		else if ((addr >= 0x100) && (addr < 0x200))
-		{
-		    data = sfr_ram.at(addr & 0xFF);
-		}
-
-		return data;
-	    }
-
-	    void writeRAM(uint16_t addr, uint8_t data)
-	    {
-		int ram_addr = (1 << data_bus_width);
-
-		if (addr < ram_addr)
-		{
-		    internal_ram.at(addr) = data;
-		}
-		else if ((addr >= 0x100) && (addr < 0x200))
-		{
-		    sfr_ram.at(addr & 0xFF) = data;
-		}
-	    }
-
-	    uint8_t readIRAM(uint8_t addr)
-	    {
-		uint8_t data = 0;
-		if (addr < 0x80)
-		{
-		    data = readRAM(addr);
-		}
-		else
-		{
-		    data = readSFR(addr);
-		}
-
-		return data;
-	    }
-
-	    void writeIRAM(uint8_t addr, uint8_t data)
-	    {
-		if (addr < 0x80)
-		{
-		    writeRAM(addr, data);
-		}
-		else
-		{
-		    writeSFR(addr, data);
-		}
-	    }
-
-	    uint8_t readIRAMIndirect(uint8_t addr)
-	    {
-		uint8_t data = 0xFF;
-		int ram_addr = (1 << data_bus_width);
-
-		if (addr < ram_addr)
-		{
-		    data = readRAM(addr);
-		}
-
-		return data;
-	    }
-
-	    void writeIRAMIndirect(uint8_t addr, uint8_t data)
-	    {
-		int ram_addr = (1 << data_bus_width);
-
-		if (addr < ram_addr)
-		{
-		    writeRAM(addr, data);
-		}
-	    }
-
-	    uint8_t readSFR(uint8_t addr)
-	    {
-		uint8_t data = 0xFF;
-
-		switch (addr)
-		{
-		    case 0xB0:
-		    {
-			uint8_t port3_val = readRAM(0x1B0);
-
-			if (is_rwm)
-			{
-			    data = port3_val;
-			}
-			else
-			{
-			    data = (port3_val & portIn(3));
-			}
-		    }
-		    break;
-		    case 0x81:
-		    case 0x88:
-		    case 0xD0:
-		    case 0xE0:
-		    {
-			data = readRAM(addr | 0x100);
-		    }
-		    break;
-		    default:
-		    {
-			cout << "Invalid/unimplemented read from SFR address of " << hex << int(addr) << endl;
-		    }
-		    break;
-		}
-
-		return data;
-	    }
-
-	    void writeSFR(uint8_t addr, uint8_t data)
-	    {
-		if (addr < 0x80)
-		{
-		    return;
-		}
-
-		switch (addr)
-		{
-		    case 0xB0: portOut(3, data); break;
-		    case 0x81:
-		    case 0x88: break;
-		    case 0xD0:
-		    case 0xE0: break;
-		    default:
-		    {
-			cout << "Invalid/unimplemented write to SFR address of " << hex << int(addr) << endl;
-		    }
-		    break;
-		}
-
-		writeRAM((addr | 0x100), data);
-	    }
-
-	    void writeBit(uint8_t addr, bool is_set)
-	    {
-		bool is_sfr = (addr >= 0x80);
-
-		int distance = (is_sfr) ? 8 : 1;
-		int offs = (is_sfr) ? 0x80 : 0x20;
-		int word = ((addr & 0x78) >> 3) * distance + offs;
-		int bit_pos = (addr & 0x7);
-
-		cout << "Reading bit at address of " << hex << int(word) << endl;
-		uint8_t result = readIRAM(word);
-		result = changebit(result, bit_pos, is_set);
-		writeIRAM(word, result);
-	    }
-
-	    uint8_t add_internal(uint8_t accum, uint8_t data, bool is_carry = false)
-	    {
-		uint16_t result = (accum + data + is_carry);
-		uint16_t carry_reg = (accum ^ data ^ result);
-
-		bool is_cf = testbit(carry_reg, 8);
-		bool is_ov = (testbit(carry_reg, 7) != is_cf);
-		bool is_ac = testbit(carry_reg, 4);
-
-		setCarry(is_cf);
-		setHalf(is_ac);
-		setOverflow(is_ov);
-		return uint8_t(result);
-	    }
-
-	    uint8_t add_accum(uint8_t data)
-	    {
-		return add_internal(getAccum(), data);
-	    }
-
-	    uint16_t pc = 0;
-	    bool is_rwm = false;
-
-	    unordered_map<uint16_t, string> mem_names;
-    };
-
-    class Bee8051 : public BeeMCS51
-    {
-	public:
-	    Bee8051() : BeeMCS51(12, 7)
-	    {
-
-	    }
-
-	    virtual void init()
-	    {
-		BeeMCS51::init();
-		add_names(default_names);
-		cout << "Bee8051::Initialized" << endl;
-	    }
-
-	    virtual void shutdown()
-	    {
-		BeeMCS51::shutdown();
-		cout << "Bee8051::Shutting down..." << endl;
-	    }
-    };
-
-    class Bee8751 : public BeeMCS51
-    {
-	public:
-	    Bee8751() : BeeMCS51(12, 7)
-	    {
-
-	    }
-
-	    void init()
-	    {
-		BeeMCS51::init();
-		add_names(default_names);
-		cout << "Bee8751::Initialized" << endl;
-	    }
-
-	    void shutdown()
-	    {
-		BeeMCS51::shutdown();
-		cout << "Bee8751::Shutting down..." << endl;
-	    }
-    };
-};
-
-
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_H
+#define BEE8051_H
+
+#include <iostream>
+#include <sstream>
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <cassert>
+#include <algorithm>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <type_traits>
+#include <cstdarg>
+#include <cstdio>
+using namespace std;
+
+// Highest trace level compiled into the core; calls to bee8051_trace()
+// above it compile to nothing (0 = errors only, 3 = everything)
+#ifndef BEE8051_TRACE_LEVEL
+#define BEE8051_TRACE_LEVEL 2
+#endif
+
+#define bee8051_trace(level, ...) \
+    do \
+    { \
+        if constexpr (int(level) <= BEE8051_TRACE_LEVEL) \
+        { \
+            tracemsg(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+namespace bee8051
+{
+    enum class tracelevel : int
+    {
+        Error = 0,
+        Warning = 1,
+        Info = 2,
+        Debug = 3,
+    };
+
+    class Bee8051TraceSink
+    {
+        public:
+            virtual ~Bee8051TraceSink()
+            {
+
+            }
+
+            virtual void trace(tracelevel level, const char *msg) = 0;
+    };
+
+    // Writes every message at or below max_level to a stream
+    class Bee8051StreamTrace : public Bee8051TraceSink
+    {
+        public:
+            Bee8051StreamTrace(ostream &stream, tracelevel level = tracelevel::Debug) : out(stream), max_level(level)
+            {
+
+            }
+
+            void trace(tracelevel level, const char *msg)
+            {
+                if (level <= max_level)
+                {
+                    out << msg << '\n';
+                }
+            }
+
+        private:
+            ostream &out;
+            tracelevel max_level;
+    };
+
+    class BeeMCS51;
+
+    // The defaults report through the trace sink of the core the interface
+    // is set on, and carry on with a neutral value: ROM reads as 0, ports
+    // read as 0xFF, and port writes go nowhere
+    class Bee8051Interface
+    {
+        public:
+            Bee8051Interface();
+            ~Bee8051Interface();
+
+            virtual uint8_t readROM(uint16_t addr);
+            virtual uint8_t portIn(int port);
+            virtual void portOut(int port, uint8_t data);
+
+            // Called instead of portOut() with setPortNotify(true), only
+            // when a write changes the port, along with the time of the write
+            virtual void portChanged(int port, uint8_t data, int64_t cycles)
+            {
+                (void)cycles;
+                portOut(port, data);
+            }
+
+        private:
+            // Set by BeeMCS51::setInterface()
+            friend class BeeMCS51;
+            BeeMCS51 *core = NULL;
+
+            void tracemsg(tracelevel level, const char *format, ...)
+#if defined(__GNUC__) || defined(__clang__)
+            __attribute__((format(printf, 3, 4)))
+#endif
+            ;
+    };
+
+    // Whether a host passed to bindHost() has its own portChanged()
+    template<class Host, class = void>
+    struct hasportchanged : false_type
+    {
+
+    };
+
+    template<class Host>
+    struct hasportchanged<Host, void_t<decltype(declval<Host&>().portChanged(0, uint8_t(0), int64_t(0)))>> : true_type
+    {
+
+    };
+
+    class Bee8051JIT;
+    class Bee8051Threaded;
+    class Bee8051Timers;
+    class Bee8051Serial;
+    class Bee8051StateWriter;
+    class Bee8051StateReader;
+    struct mcs51instr;
+
+    using mcs51handler = void (BeeMCS51::*)(const mcs51instr&);
+
+    // How run() executes code; the translated modes fall back to the
+    // interpreter for anything they do not handle
+    enum class execmode
+    {
+        Interpreter,
+        Threaded,
+        JIT,
+    };
+
+    // Instruction as decoded from ROM, cached per address
+    struct mcs51instr
+    {
+        uint8_t opcode = 0;
+        array<uint8_t, 2> operands = {{0, 0}};
+        int length = 1;
+        int cycles = 1;
+        mcs51handler handler = NULL;
+        bool is_decoded = false;
+        bool is_idle = false;
+    };
+
+    class BeeMCS51
+    {
+        public:
+            BeeMCS51(int prog_width, int data_width);
+            virtual ~BeeMCS51();
+
+            virtual void init();
+            virtual void shutdown();
+
+            virtual int runinstruction();
+
+            // Runs until at least the given number of clock cycles have
+            // elapsed and returns the actual number consumed, overshoot included
+            virtual int64_t run(int64_t cycles);
+
+            // Same as run(), but with the fetch and port paths instantiated
+            // for Host, so that its readROM, portIn and portOut are called
+            // directly rather than through function pointers; cb is bound
+            // with bindHost() first if it is not the current host
+            template<class Host>
+            int64_t run(Host &cb, int64_t cycles)
+            {
+                usehost(cb);
+                return runloop<0, Host>(cycles);
+            }
+            int64_t runUntilPC(int64_t cycles, uint16_t addr);
+
+            // Stops early once pred() returns true after an instruction
+            template<typename Pred>
+            int64_t runUntil(int64_t cycles, Pred pred)
+            {
+                return rununtilloop<0>(cycles, pred);
+            }
+
+            // Makes the current run() call return after the instruction
+            // in progress, e.g. from within a port callback
+            void stop();
+
+            // Set when the core hits an opcode it does not implement, or,
+            // with BEE8051_CHECK_BOUNDS, accesses IRAM out of bounds; the
+            // core halts (with the PC on the instruction, for a bad opcode),
+            // and run() does nothing until the next init()
+            bool isFaulted();
+            uint16_t getPC();
+
+            // Moves the PC between runs, e.g. to a program's entry point
+            // after init()
+            void setPC(uint16_t addr);
+
+            // Clock cycles run since init()
+            int64_t getCycles();
+
+            // Direct access to IRAM (0x00-0xFF) and SFR storage (0x180-0x1FF
+            // for SFR 0x80-0xFF), as laid out in Bee8051Lockstep, for
+            // debuggers and tests; no SFR hooks run, but PSW reads back
+            // with its flags up to date, and writing it switches banks
+            uint8_t readMemory(uint16_t addr);
+            void writeMemory(uint16_t addr, uint8_t data);
+
+            // Feeds falling edges on the T0/T1 inputs to a timer in counter mode
+            void pulseTimerInput(int timer, int pulses = 1);
+
+            // Drives the INT0/INT1 inputs, which are active low; they raise
+            // external interrupts and gate timers with GATE set in TMOD
+            void setIntPin(int line, bool is_high);
+
+            // Only notifies the host of writes that change a port, through
+            // portChanged(), rather than calling portOut() on every write
+            void setPortNotify(bool is_changes_only);
+
+            // Publishes the state of a port's input pins, which reads of the
+            // port then use instead of calling portIn(); safe to call from
+            // another thread while run() is executing
+            void setPortInput(int port, uint8_t data);
+            void releasePortInput(int port);
+
+            // Drains bytes sent by the serial port, and queues bytes for it
+            // to receive, returning how many were transferred; both are
+            // safe to call from another thread while run() is executing
+            size_t readSerial(uint8_t *data, size_t size);
+            size_t writeSerial(const uint8_t *data, size_t size);
+
+            // Sets how many bytes each serial buffer holds (1 KiB unless
+            // set), rounded up to a power of two, and empties both; hosts
+            // that drain rarely at high baud rates may need more. Must not
+            // be called while run() or a serial transfer is in progress
+            void setSerialBufferSize(size_t size);
+
+            // Saves the whole machine state (CPU, IRAM and SFRs, timers,
+            // serial port and pending events) into a caller-provided buffer
+            // of at least getStateSize() bytes, without allocating, and
+            // returns the bytes written, or 0 if the buffer is too small.
+            // Snapshots are native-endian and tagged with a version, and
+            // only load into a core of the same ROM and IRAM widths. ROM,
+            // host bindings, registered SFR hooks and the bytes queued in
+            // the serial buffers are not part of the state. Must not be
+            // called from within run()
+            size_t getStateSize();
+            size_t saveState(uint8_t *buffer, size_t size);
+            bool loadState(const uint8_t *buffer, size_t size);
+
+            void debugoutput(bool print_disassembly = true);
+
+            // Formats the instruction at pc into a caller-provided buffer,
+            // always terminating it and cutting the text short if the buffer
+            // is too small, and returns the length of the instruction. Uses
+            // the same opcode table as the executor, and does not allocate
+            size_t disassembleinstr(char *buffer, size_t size, uint32_t pc);
+            size_t disassembleinstr(ostream &stream, uint32_t pc);
+
+            // Binds a host that the core calls through the Bee8051Interface
+            // vtable
+            void setInterface(Bee8051Interface *cb);
+
+            // Binds a host without going through the Bee8051Interface vtable:
+            // Host needs readROM, portIn and portOut members with the same
+            // signatures, and does not have to derive from anything, while
+            // portChanged is optional and falls back to portOut. The handlers
+            // of instructions that access ports directly are instantiated for
+            // Host and call it without indirection, while the rest of the core
+            // calls it through thunks, which run(Host&, cycles) also avoids
+            // on the fetch path
+            template<class Host>
+            void bindHost(Host *cb)
+            {
+                if (cb == NULL)
+                {
+                    resetHost();
+                    return;
+                }
+
+                resetHost();
+                host.context = cb;
+                host.tag = hosttag<Host>();
+
+                host.read_rom = [](void *context, uint16_t addr) -> uint8_t
+                {
+                    return static_cast<Host*>(context)->readROM(addr);
+                };
+
+                host.port_in = [](void *context, int port) -> uint8_t
+                {
+                    return static_cast<Host*>(context)->portIn(port);
+                };
+
+                host.port_out = [](void *context, int port, uint8_t data)
+                {
+                    static_cast<Host*>(context)->portOut(port, data);
+                };
+
+                host.port_changed = [](void *context, int port, uint8_t data, int64_t cycles)
+                {
+                    if constexpr (hasportchanged<Host>::value)
+                    {
+                        static_cast<Host*>(context)->portChanged(port, data, cycles);
+                    }
+                    else
+                    {
+                        (void)cycles;
+                        static_cast<Host*>(context)->portOut(port, data);
+                    }
+                };
+
+                sethosthandlers<Host>();
+                invalidateROM();
+            }
+
+            // Diagnostics are discarded unless a sink is set
+            void setTraceSink(Bee8051TraceSink *sink);
+
+            // Reads program memory directly from a host buffer, which must
+            // outlive the core; addresses past the end of the buffer still
+            // go through Bee8051Interface::readROM
+            void attachROM(const uint8_t *data, size_t size);
+            void detachROM();
+
+            // Must be called whenever the contents of program memory change
+            void invalidateROM();
+            void invalidateROM(uint16_t addr, size_t size);
+            void setInstrCache(bool is_enabled);
+
+            // Takes effect from the next run() call; returns false, leaving
+            // the mode unchanged, if it is not available in this build
+            bool setExecMode(execmode mode);
+            execmode getExecMode();
+
+            using sfrreadfunc = function<uint8_t(uint8_t)>;
+            using sfrwritefunc = function<void(uint8_t, uint8_t)>;
+
+            // Hooks reads and/or writes of the SFR at addr; writes are always
+            // stored in the SFR before the write hook runs, and an SFR with no
+            // hooks at all is plain storage. init() resets every SFR to the
+            // core defaults, so variants and hosts should register after it
+            void registerSFR(uint8_t addr, sfrreadfunc read_func = NULL, sfrwritefunc write_func = NULL);
+            void unregisterSFR(uint8_t addr);
+
+        protected:
+            // Runs in slices that end at the next scheduled event, so
+            // peripherals only get to run when something is due
+            template<uint16_t fixed_mask, class Host = void>
+            int64_t runloop(int64_t cycles)
+            {
+                is_stop_requested = is_faulted;
+                int64_t start_cycles = getcycles();
+                int64_t end_cycles = (start_cycles + cycles);
+
+                while ((getcycles() < end_cycles) && !is_stop_requested)
+                {
+                    if (isirqdue())
+                    {
+                        vectorirq();
+                        continue;
+                    }
+
+                    beginslice(end_cycles);
+
+                    if ((exec_mode != execmode::Interpreter) && is_cache_enabled)
+                    {
+                        runtranslated();
+                    }
+                    else
+                    {
+                        while ((slice_budget > 0) && !is_stop_requested)
+                        {
+                            runinstr<fixed_mask, Host>();
+                        }
+                    }
+
+                    endslice();
+                }
+
+                return (getcycles() - start_cycles);
+            }
+
+            template<uint16_t fixed_mask, typename Pred>
+            int64_t rununtilloop(int64_t cycles, Pred pred)
+            {
+                is_stop_requested = is_faulted;
+                int64_t start_cycles = getcycles();
+                int64_t end_cycles = (start_cycles + cycles);
+                bool is_matched = false;
+
+                while ((getcycles() < end_cycles) && !is_stop_requested && !is_matched)
+                {
+                    if (isirqdue())
+                    {
+                        vectorirq();
+                        is_matched = pred();
+                        continue;
+                    }
+
+                    beginslice(end_cycles);
+
+                    while ((slice_budget > 0) && !is_stop_requested)
+                    {
+                        stepinstr<fixed_mask>();
+
+                        if (pred())
+                        {
+                            is_matched = true;
+                            break;
+                        }
+                    }
+
+                    endslice();
+                }
+
+                return (getcycles() - start_cycles);
+            }
+
+            template<uint16_t fixed_mask>
+            int runsingle()
+            {
+                if (is_faulted)
+                {
+                    return 0;
+                }
+
+                if (isirqdue())
+                {
+                    int64_t prev_cycles = getcycles();
+                    vectorirq();
+                    return int(getcycles() - prev_cycles);
+                }
+
+                // Between slices the budget is always zero, so the instruction
+                // can run straight away as a slice of its own
+                int cycles = stepinstr<fixed_mask>();
+                endslice();
+                return cycles;
+            }
+
+            // Binds cb for run(Host&, cycles), unless it already is the host
+            template<class Host>
+            void usehost(Host &cb)
+            {
+                if ((host.context != static_cast<void*>(&cb)) || (host.tag != hosttag<Host>()))
+                {
+                    bindHost(&cb);
+                }
+            }
+
+            // Lets variants with a known IRAM size fold it into the
+            // indirect accesses, by installing handlers built for that size
+            template<int fixed_ram>
+            void setfixedram()
+            {
+                static_assert(((fixed_ram > 0) && (fixed_ram <= 0x100)), "IRAM size must be between 1 and 256 bytes");
+                handlers[0x32] = &BeeMCS51::op_reti<fixed_ram>;
+                handlers[0xF6] = &BeeMCS51::op_mov_ind_a<fixed_ram>;
+                handlers[0xF7] = &BeeMCS51::op_mov_ind_a<fixed_ram>;
+                invalidateROM();
+            }
+
+            void tracemsg(tracelevel level, const char *format, ...)
+#if defined(__GNUC__) || defined(__clang__)
+            __attribute__((format(printf, 3, 4)))
+#endif
+            {
+                if (trace_sink == NULL)
+                {
+                    return;
+                }
+
+                char msg[256];
+                va_list args;
+                va_start(args, format);
+                vsnprintf(msg, sizeof(msg), format, args);
+                va_end(args);
+                trace_sink->trace(level, msg);
+            }
+
+            // Name of a direct address (0x00-0xFF), or of a bit address
+            // (0x100-0x1FF, only used from 0x180 up) in the disassembly, or
+            // the address in hex for none; init() copies the names into
+            // name_table, so that variants can override this to name their
+            // own SFRs and bits
+            virtual string get_sfr_names(uint16_t addr)
+            {
+                stringstream ss;
+
+                if ((addr >= name_table.size()) || (name_table[addr][0] == '\0'))
+                {
+                    ss << "$" << hex << int(addr);
+                }
+                else
+                {
+                    ss << name_table[addr].data();
+                }
+
+                return ss.str();
+            }
+
+            string get_bit_addr(uint8_t addr)
+            {
+                stringstream ss;
+
+                if (addr < 0x80)
+                {
+                    ss << "$" << hex << int((addr >> 3) | 0x20) << "." << dec << int(addr & 0x7);
+                }
+                else if (name_table[0x100 | addr][0] != '\0')
+                {
+                    ss << name_table[0x100 | addr].data();
+                }
+                else if (name_table[addr & 0xF8][0] != '\0')
+                {
+                    ss << name_table[addr & 0xF8].data() << "." << dec << int(addr & 0x7);
+                }
+                else
+                {
+                    ss << "$" << hex << int(addr & 0xF8) << "." << dec << int(addr & 0x7);
+                }
+
+                return ss.str();
+            }
+
+            struct meminfo
+            {
+                int addr = 0;
+                string name = "";
+            };
+
+            void add_names(vector<meminfo> info)
+            {
+                for (size_t i = 0; info[i].addr >= 0; i++)
+                {
+                    setname(info[i].addr, info[i].name.c_str(), info[i].name.size());
+                }
+            }
+
+            template<typename ...Names>
+            void add_names(vector<meminfo> info, Names &&... names)
+            {
+                add_names(names...);
+                add_names(info);
+            }
+
+            vector<meminfo> default_names = 
+            {
+                {0x81, "sp"},
+                {0x1B6, "wr"},
+                {0x1B7, "rd"},
+                {-1, ""},
+            };
+
+        private:
+            friend class Bee8051Interface;
+            friend class Bee8051JIT;
+            friend class Bee8051Threaded;
+            friend class Bee8051Lockstep;
+            friend class Bee8051Image;
+
+            execmode exec_mode = execmode::Interpreter;
+            unique_ptr<Bee8051JIT> jit;
+            unique_ptr<Bee8051Threaded> threaded;
+
+            void runtranslated();
+            void flushtranslations();
+
+            template<typename T>
+            bool testbit(T reg, int bit)
+            {
+                return ((reg >> bit) & 1) ? true : false;
+            }
+
+            template<typename T>
+            T setbit(T reg, int bit)
+            {
+                return (reg | (1 << bit));
+            }
+
+            template<typename T>
+            T resetbit(T reg, int bit)
+            {
+                return (reg & ~(1 << bit));
+            }
+
+            template<typename T>
+            T changebit(T reg, int bit, bool is_set)
+            {
+                if (is_set)
+                {
+                    return setbit(reg, bit);
+                }
+                else
+                {
+                    return resetbit(reg, bit);
+                }
+            }
+
+            // A host bound with setInterface() is called through iface, and
+            // one bound with bindHost() through the thunks, with tag telling
+            // which Host type context points to
+            struct mcs51host
+            {
+                Bee8051Interface *iface = NULL;
+                void *context = NULL;
+                const void *tag = NULL;
+                uint8_t (*read_rom)(void*, uint16_t) = NULL;
+                uint8_t (*port_in)(void*, int) = NULL;
+                void (*port_out)(void*, int, uint8_t) = NULL;
+                void (*port_changed)(void*, int, uint8_t, int64_t) = NULL;
+            };
+
+            mcs51host host;
+
+            void resetHost();
+
+            template<class Host>
+            static const void *hosttag()
+            {
+                static const char tag = 0;
+                return &tag;
+            }
+
+            // Installs the handlers of the instructions that can access a
+            // port directly, instantiated for Host, or the generic ones
+            template<class Host>
+            void sethosthandlers()
+            {
+                handlers[0x25] = &BeeMCS51::op_add_dir<Host>;
+                handlers[0x75] = &BeeMCS51::op_mov_dir_imm<Host>;
+                handlers[0xC2] = &BeeMCS51::op_clr_bit<Host>;
+                handlers[0xD2] = &BeeMCS51::op_setb_bit<Host>;
+                handlers[0xF5] = &BeeMCS51::op_mov_dir_a<Host>;
+            }
+            Bee8051TraceSink *trace_sink = NULL;
+
+            int program_width = 0;
+            int data_bus_width = 0;
+            uint16_t program_mask = 0xFFFF;
+
+            const uint8_t *rom_buffer = NULL;
+            size_t rom_size = 0;
+
+            // With Host void, these call whichever host is bound; otherwise
+            // the bound host must be a Host, which they call directly
+            template<class Host = void>
+            uint8_t readROM(uint16_t addr)
+            {
+                addr &= program_mask;
+
+                if (addr < rom_size)
+                {
+                    return rom_buffer[addr];
+                }
+
+                if constexpr (is_void<Host>::value)
+                {
+                    if (host.iface != NULL)
+                    {
+                        return host.iface->readROM(addr);
+                    }
+
+                    return host.read_rom(host.context, addr);
+                }
+                else
+                {
+                    return static_cast<Host*>(host.context)->readROM(addr);
+                }
+            }
+
+            template<class Host = void>
+            uint8_t portIn(int port)
+            {
+                if constexpr (is_void<Host>::value)
+                {
+                    if (host.iface != NULL)
+                    {
+                        return host.iface->portIn(port & 3);
+                    }
+
+                    return host.port_in(host.context, (port & 3));
+                }
+                else
+                {
+                    return static_cast<Host*>(host.context)->portIn(port & 3);
+                }
+            }
+
+            template<class Host = void>
+            void portOut(int port, uint8_t data)
+            {
+                if constexpr (is_void<Host>::value)
+                {
+                    if (host.iface != NULL)
+                    {
+                        host.iface->portOut((port & 3), data);
+                        return;
+                    }
+
+                    host.port_out(host.context, (port & 3), data);
+                }
+                else
+                {
+                    static_cast<Host*>(host.context)->portOut((port & 3), data);
+                }
+            }
+
+            template<class Host = void>
+            void portChanged(int port, uint8_t data, int64_t cycles)
+            {
+                if constexpr (is_void<Host>::value)
+                {
+                    if (host.iface != NULL)
+                    {
+                        host.iface->portChanged(port, data, cycles);
+                        return;
+                    }
+
+                    host.port_changed(host.context, port, data, cycles);
+                }
+                else if constexpr (hasportchanged<Host>::value)
+                {
+                    static_cast<Host*>(host.context)->portChanged(port, data, cycles);
+                }
+                else
+                {
+                    (void)cycles;
+                    static_cast<Host*>(host.context)->portOut(port, data);
+                }
+            }
+
+            bool is_port_changes_only = false;
+
+            // Last value written to each port, kept up to date whether or
+            // not notification is changes-only, so that turning it on
+            // mid-run compares against the right value; and the input pins
+            // published by the host, or -1 to call portIn()
+            array<uint8_t, 4> port_latches = {{0xFF, 0xFF, 0xFF, 0xFF}};
+            array<atomic<int>, 4> port_inputs;
+
+            // Reads see the latch ANDed with the pins, except in read-modify-write
+            // instructions, which only see the latch
+            template<class Host = void>
+            uint8_t readport(int port)
+            {
+                uint8_t latch = readRAM(0x180 + (port * 0x10));
+
+                if (is_rwm)
+                {
+                    return latch;
+                }
+
+                int input = port_inputs[port].load(memory_order_relaxed);
+                return (latch & ((input >= 0) ? uint8_t(input) : portIn<Host>(port)));
+            }
+
+            template<class Host = void>
+            void writeport(int port, uint8_t data)
+            {
+                bool is_changed = (port_latches[port] != data);
+                port_latches[port] = data;
+
+                if (!is_port_changes_only)
+                {
+                    portOut<Host>(port, data);
+                }
+                else if (is_changed)
+                {
+                    portChanged<Host>(port, data, getcycles());
+                }
+            }
+
+            // The format is the disassembly, with operands consumed in
+            // encoding order: %x is a byte in hex, %d a direct address,
+            // %b a bit address, %j a relative jump target and %l a 16-bit
+            // address, while %r and %i are the register in the opcode
+            struct mcs51opcode
+            {
+                int length = 1;
+                int cycles = 1;
+                mcs51handler handler = NULL;
+                const char *format = "unk";
+            };
+
+            static const array<mcs51opcode, 256> &opcodetable();
+
+            // Handlers the decoder puts in the instruction cache; those of
+            // opcodetable(), except where a variant has specialized them
+            array<mcs51handler, 256> handlers;
+
+            vector<mcs51instr> instr_cache;
+            mcs51instr uncached_instr;
+            bool is_cache_enabled = true;
+
+            // A non-zero fixed_mask replaces the runtime program mask,
+            // letting variants with a known ROM size fold it into the fetch
+            template<uint16_t fixed_mask = 0, class Host = void>
+            const mcs51instr &fetchinstr(uint16_t addr)
+            {
+                if (!is_cache_enabled)
+                {
+                    decodeinstr<Host>(addr, uncached_instr);
+                    return uncached_instr;
+                }
+
+                uint16_t mask = (fixed_mask != 0) ? fixed_mask : program_mask;
+                mcs51instr &instr = instr_cache[addr & mask];
+
+                if (!instr.is_decoded)
+                {
+                    decodeinstr<Host>(addr, instr);
+                }
+
+                return instr;
+            }
+
+            template<class Host = void>
+            void decodeinstr(uint16_t addr, mcs51instr &instr)
+            {
+                uint8_t opcode = readROM<Host>(addr);
+                const mcs51opcode &info = opcodetable()[opcode];
+
+                instr.opcode = opcode;
+                instr.length = info.length;
+                instr.cycles = info.cycles;
+                instr.handler = handlers[opcode];
+
+                for (int i = 1; i < info.length; i++)
+                {
+                    instr.operands[i - 1] = readROM<Host>(addr + i);
+                }
+
+                instr.is_idle = isidleloop(addr, instr);
+                instr.is_decoded = true;
+            }
+
+            bool is_stop_requested = false;
+            bool is_faulted = false;
+
+            // Instructions are charged before their handler runs, so
+            // peripherals see the time at the end of the instruction
+            template<uint16_t fixed_mask = 0>
+            int stepinstr()
+            {
+                const mcs51instr &instr = fetchinstr<fixed_mask>(pc);
+                pc += instr.length;
+                slice_budget -= (instr.cycles * 12);
+                (this->*instr.handler)(instr);
+                return (instr.cycles * 12);
+            }
+
+            // Like stepinstr(), but runs a whole idle loop at once, for as
+            // many iterations as would start within the current slice
+            template<uint16_t fixed_mask = 0, class Host = void>
+            void runinstr()
+            {
+                const mcs51instr &instr = fetchinstr<fixed_mask, Host>(pc);
+
+                if (instr.is_idle)
+                {
+                    skipidle(instr);
+                    return;
+                }
+
+                pc += instr.length;
+                slice_budget -= (instr.cycles * 12);
+                (this->*instr.handler)(instr);
+            }
+
+            bool isidleloop(uint16_t addr, const mcs51instr &instr);
+            void skipidle(const mcs51instr &instr);
+
+            // The current run slice ends at slice_end, with slice_budget
+            // cycles of it left, so the time is always their difference,
+            // even while translated code is counting down the budget
+            int64_t slice_end = 0;
+            int64_t slice_budget = 0;
+            bool is_slice_cut = false;
+
+            int64_t getcycles() const
+            {
+                return (slice_end - slice_budget);
+            }
+
+            void beginslice(int64_t end_cycles);
+            void endslice();
+
+            enum mcs51event : int
+            {
+                EventTimer0 = 0,
+                EventTimer1,
+                EventSerialTx,
+                EventSerialRx,
+                EventCount,
+            };
+
+            // Absolute time each event is due at, or INT64_MAX when it is not
+            // scheduled; run() only stops for the earliest one
+            array<int64_t, EventCount> event_times;
+            int64_t next_event_time = INT64_MAX;
+
+            void scheduleevent(int id, int64_t time);
+            void cancelevent(int id);
+            void runevents();
+
+            friend class Bee8051Timers;
+            unique_ptr<Bee8051Timers> timers;
+
+            friend class Bee8051Serial;
+            unique_ptr<Bee8051Serial> serial;
+
+            static constexpr uint32_t state_magic = 0x53313542; // "B51S"
+            static constexpr uint32_t state_version = 3;
+
+            void savestate(Bee8051StateWriter &writer);
+            void loadstate(Bee8051StateReader &reader);
+
+            void cutslice();
+
+            // Set whenever an enabled interrupt request could preempt the
+            // one in service; only recomputed by updateirq() when IE, IP,
+            // TCON, SCON or a request changes, and it cuts the current slice
+            // so that the run loop gets to vector at the next instruction
+            bool is_irq_pending = false;
+            uint8_t irq_requests = 0;
+            array<bool, 2> irq_active = {{false, false}};
+            array<bool, 2> int_pins = {{true, true}};
+
+            // No interrupt is serviced right after RETI or a write to IE
+            // or IP, so this holds the time such an instruction ended at
+            int64_t irq_block_time = -1;
+
+            void updateirq();
+            void vectorirq();
+
+            bool isirqdue()
+            {
+                return (is_irq_pending && (irq_block_time != getcycles()));
+            }
+
+            void unrecognizedinstr(uint8_t instr);
+
+            void op_unknown(const mcs51instr &instr);
+            void op_ljmp(const mcs51instr &instr);
+            // add a, data addr
+            template<class Host = void>
+            void op_add_dir(const mcs51instr &instr)
+            {
+                uint8_t data = readIRAM<Host>(instr.operands[0]);
+                setAccum(add_accum(data));
+            }
+
+            void op_mov_a_imm(const mcs51instr &instr);
+            // mov data addr, #data
+            template<class Host = void>
+            void op_mov_dir_imm(const mcs51instr &instr)
+            {
+                writeIRAM<Host>(instr.operands[0], instr.operands[1]);
+            }
+
+            void op_mov_rn_imm(const mcs51instr &instr);
+            void op_sjmp(const mcs51instr &instr);
+            // clr bit addr
+            template<class Host = void>
+            void op_clr_bit(const mcs51instr &instr)
+            {
+                is_rwm = true;
+                uint8_t addr = instr.operands[0];
+                bee8051_trace(tracelevel::Debug, "Setting bit of address of %x", addr);
+                writeBit<Host>(addr, false);
+                is_rwm = false;
+            }
+
+            // setb bit addr
+            template<class Host = void>
+            void op_setb_bit(const mcs51instr &instr)
+            {
+                is_rwm = true;
+                uint8_t addr = instr.operands[0];
+                bee8051_trace(tracelevel::Debug, "Setting bit of address of %x", addr);
+                writeBit<Host>(addr, true);
+                is_rwm = false;
+            }
+
+            void op_djnz_rn(const mcs51instr &instr);
+            // mov data addr, a
+            template<class Host = void>
+            void op_mov_dir_a(const mcs51instr &instr)
+            {
+                writeIRAM<Host>(instr.operands[0], getAccum());
+            }
+
+            // mov @r0/@r1, a
+            template<int fixed_ram = 0>
+            void op_mov_ind_a(const mcs51instr &instr)
+            {
+                int reg_val = getReg(instr.opcode & 0x1);
+                writeIRAMIndirect<fixed_ram>(reg_val, getAccum());
+            }
+
+            void op_mov_rn_a(const mcs51instr &instr);
+            // reti
+            template<int fixed_ram = 0>
+            void op_reti(const mcs51instr&)
+            {
+                uint8_t sp = getSP();
+                uint8_t high = readIRAMIndirect<fixed_ram>(sp--);
+                uint8_t low = readIRAMIndirect<fixed_ram>(sp--);
+                setSP(sp);
+                pc = ((high << 8) | low);
+                finishreti();
+            }
+
+            void finishreti();
+
+            // Internal RAM lives at 0x000-0x0FF and the SFRs at 0x100-0x1FF
+            // of a single block, indexed without bounds checks unless the
+            // library is built with BEE8051_CHECK_BOUNDS
+            alignas(64) array<uint8_t, 0x200> internal_mem = {};
+            int ram_size = 0;
+
+            bool isValidRAM(uint16_t addr)
+            {
+                return ((addr < ram_size) || ((addr >= 0x100) && (addr < 0x200)));
+            }
+
+            // Unlike assert(), this stays in release builds: an access
+            // outside the IRAM is logged and faults the core
+            void checkRAM(uint16_t addr)
+            {
+                if (!isValidRAM(addr))
+                {
+                    bee8051_trace(tracelevel::Error, "Internal memory access out of bounds at %x", addr);
+                    is_faulted = true;
+                    stop();
+                }
+            }
+
+            // Base address of the active register bank,
+            // updated whenever RS0/RS1 in PSW are written
+            uint8_t reg_bank = 0;
+
+            uint8_t getReg(int reg)
+            {
+                return internal_mem[reg_bank | (reg & 7)];
+            }
+
+            void setReg(int reg, uint8_t data)
+            {
+                internal_mem[reg_bank | (reg & 7)] = data;
+            }
+
+            uint8_t getAccum()
+            {
+                return readSFR(0xE0);
+            }
+
+            void setAccum(uint8_t data)
+            {
+                writeSFR(0xE0, data);
+            }
+
+            uint8_t getPSW()
+            {
+                syncFlags();
+                return readRAM(0x1D0);
+            }
+
+            void setPSW(uint8_t data)
+            {
+                writeSFR(0xD0, data);
+            }
+
+            uint8_t getSP()
+            {
+                return readSFR(0x81);
+            }
+
+            void setSP(uint8_t data)
+            {
+                writeSFR(0x81, data);
+            }
+
+            uint8_t getP0()
+            {
+                return readRAM(0x180);
+            }
+
+            void setP0(uint8_t data)
+            {
+                writeSFR(0x80, data);
+            }
+
+            uint8_t getP1()
+            {
+                return readRAM(0x190);
+            }
+
+            void setP1(uint8_t data)
+            {
+                writeSFR(0x90, data);
+            }
+
+            uint8_t getP2()
+            {
+                return readRAM(0x1A0);
+            }
+
+            void setP2(uint8_t data)
+            {
+                writeSFR(0xA0, data);
+            }
+
+            uint8_t getP3()
+            {
+                return readRAM(0x1B0);
+            }
+
+            void setP3(uint8_t data)
+            {
+                writeSFR(0xB0, data);
+            }
+
+            void changePSWBit(int bit, bool is_set)
+            {
+                setPSW(changebit(getPSW(), bit, is_set));
+            }
+
+            void setCarry(bool is_set)
+            {
+                changePSWBit(7, is_set);
+            }
+
+            void setHalf(bool is_set)
+            {
+                changePSWBit(6, is_set);
+            }
+
+            void setOverflow(bool is_set)
+            {
+                changePSWBit(2, is_set);
+            }
+
+            bool calcParity(uint8_t data)
+            {
+                data ^= (data >> 4);
+                data ^= (data >> 2);
+                data ^= (data >> 1);
+                return testbit(data, 0);
+            }
+
+            // The flags are only computed from the operands of the last ALU
+            // operation once PSW is actually read, since most instructions
+            // never consume the flags they produce
+            bool is_flags_pending = false;
+            uint8_t flags_accum = 0;
+            uint8_t flags_data = 0;
+            bool flags_carry = false;
+
+            void syncFlags()
+            {
+                uint8_t psw = readRAM(0x1D0);
+
+                if (is_flags_pending)
+                {
+                    uint16_t result = (flags_accum + flags_data + flags_carry);
+                    uint16_t carry_reg = (flags_accum ^ flags_data ^ result);
+
+                    bool is_cf = testbit(carry_reg, 8);
+                    bool is_ov = (testbit(carry_reg, 7) != is_cf);
+                    bool is_ac = testbit(carry_reg, 4);
+
+                    psw = changebit(psw, 7, is_cf);
+                    psw = changebit(psw, 6, is_ac);
+                    psw = changebit(psw, 2, is_ov);
+                    is_flags_pending = false;
+                }
+
+                psw = changebit(psw, 0, calcParity(getAccum()));
+                writeRAM(0x1D0, psw);
+            }
+
+            uint8_t readRAM(uint16_t addr)
+            {
+#ifdef BEE8051_CHECK_BOUNDS
+                checkRAM(addr);
+#endif
+                return internal_mem[addr & 0x1FF];
+            }
+
+            void writeRAM(uint16_t addr, uint8_t data)
+            {
+#ifdef BEE8051_CHECK_BOUNDS
+                checkRAM(addr);
+#endif
+                internal_mem[addr & 0x1FF] = data;
+            }
+
+            template<class Host = void>
+            uint8_t readIRAM(uint8_t addr)
+            {
+                uint8_t data = 0;
+                if (addr < 0x80)
+                {
+                    data = readRAM(addr);
+                }
+                else
+                {
+                    data = readSFR<Host>(addr);
+                }
+
+                return data;
+            }
+
+            template<class Host = void>
+            void writeIRAM(uint8_t addr, uint8_t data)
+            {
+                if (addr < 0x80)
+                {
+                    writeRAM(addr, data);
+                }
+                else
+                {
+                    writeSFR<Host>(addr, data);
+                }
+            }
+
+            // A non-zero fixed_ram replaces the runtime IRAM size; with 256
+            // bytes the check folds away entirely
+            template<int fixed_ram = 0>
+            uint8_t readIRAMIndirect(uint8_t addr)
+            {
+                uint8_t data = 0xFF;
+
+                if (addr < ((fixed_ram != 0) ? fixed_ram : ram_size))
+                {
+                    data = readRAM(addr);
+                }
+
+                return data;
+            }
+
+            template<int fixed_ram = 0>
+            void writeIRAMIndirect(uint8_t addr, uint8_t data)
+            {
+                if (addr < ((fixed_ram != 0) ? fixed_ram : ram_size))
+                {
+                    writeRAM(addr, data);
+                }
+            }
+
+            // is_port is only set while a port still has the hooks init()
+            // registers for it, which the Host paths then bypass
+            struct mcs51sfr
+            {
+                bool is_used = false;
+                bool is_plain = false;
+                bool is_port = false;
+                sfrreadfunc read_func;
+                sfrwritefunc write_func;
+            };
+
+            array<mcs51sfr, 0x80> sfr_table;
+
+            uint8_t readSFRHandler(uint8_t addr);
+            void writeSFRHandler(uint8_t addr, uint8_t data);
+
+            template<class Host = void>
+            uint8_t readSFR(uint8_t addr)
+            {
+                const mcs51sfr &sfr = sfr_table[addr & 0x7F];
+
+                if (!sfr.is_plain)
+                {
+                    if constexpr (!is_void<Host>::value)
+                    {
+                        if (sfr.is_port)
+                        {
+                            return readport<Host>((addr >> 4) & 3);
+                        }
+                    }
+
+                    return readSFRHandler(addr);
+                }
+
+                return readRAM(addr | 0x100);
+            }
+
+            template<class Host = void>
+            void writeSFR(uint8_t addr, uint8_t data)
+            {
+                if (addr < 0x80)
+                {
+                    return;
+                }
+
+                writeRAM((addr | 0x100), data);
+
+                const mcs51sfr &sfr = sfr_table[addr & 0x7F];
+
+                if (!sfr.is_plain)
+                {
+                    if constexpr (!is_void<Host>::value)
+                    {
+                        if (sfr.is_port)
+                        {
+                            writeport<Host>(((addr >> 4) & 3), data);
+                            return;
+                        }
+                    }
+
+                    writeSFRHandler(addr, data);
+                }
+            }
+
+            template<class Host = void>
+            void writeBit(uint8_t addr, bool is_set)
+            {
+                bool is_sfr = (addr >= 0x80);
+
+                int distance = (is_sfr) ? 8 : 1;
+                int offs = (is_sfr) ? 0x80 : 0x20;
+                int word = ((addr & 0x78) >> 3) * distance + offs;
+                int bit_pos = (addr & 0x7);
+
+                bee8051_trace(tracelevel::Debug, "Reading bit at address of %x", word);
+                uint8_t result = readIRAM<Host>(word);
+                result = changebit(result, bit_pos, is_set);
+                writeIRAM<Host>(word, result);
+            }
+
+            uint8_t add_internal(uint8_t accum, uint8_t data, bool is_carry = false)
+            {
+                flags_accum = accum;
+                flags_data = data;
+                flags_carry = is_carry;
+                is_flags_pending = true;
+                return uint8_t(accum + data + is_carry);
+            }
+
+            uint8_t add_accum(uint8_t data)
+            {
+                return add_internal(getAccum(), data);
+            }
+
+            uint16_t pc = 0;
+            bool is_rwm = false;
+
+            // Names of direct addresses (0x000-0x0FF) and of bit addresses
+            // (0x100-0x1FF), empty where there is none; names longer than
+            // 7 characters are cut short. Bits below 0x80 are in IRAM and
+            // always shown by address, so 0x100-0x17F go unused
+            array<array<char, 8>, 512> name_table = {};
+
+            void setname(int addr, const char *name, size_t length);
+            size_t formatinstr(char *buffer, size_t size, uint16_t pc, uint8_t opcode, const uint8_t *operands);
+    };
+
+    // Core with its program and IRAM sizes fixed at compile time, so that
+    // the ROM mask on the fetch path of run(), runUntil() and
+    // runinstruction() and the IRAM bound on indirect accesses become
+    // constants; BeeMCS51 itself remains available for hosts that
+    // configure the sizes at runtime
+    template<int prog_width, int data_width>
+    class BeeMCS51Variant : public BeeMCS51
+    {
+        static_assert(((prog_width > 0) && (prog_width <= 16)), "Program width must be between 1 and 16 bits");
+        static_assert(((data_width > 0) && (data_width <= 8)), "IRAM width must be between 1 and 8 bits");
+
+        public:
+            static constexpr uint16_t rom_mask = uint16_t((1 << prog_width) - 1);
+            static constexpr int iram_size = (1 << data_width);
+
+            BeeMCS51Variant() : BeeMCS51(prog_width, data_width)
+            {
+                setfixedram<iram_size>();
+            }
+
+            int64_t run(int64_t cycles)
+            {
+                return runloop<rom_mask>(cycles);
+            }
+
+            int runinstruction()
+            {
+                return runsingle<rom_mask>();
+            }
+
+            template<class Host>
+            int64_t run(Host &cb, int64_t cycles)
+            {
+                usehost(cb);
+                return runloop<rom_mask, Host>(cycles);
+            }
+
+            // Hides BeeMCS51::runUntil(), so calls through the variant
+            // type get the constant mask as well
+            template<typename Pred>
+            int64_t runUntil(int64_t cycles, Pred pred)
+            {
+                return rununtilloop<rom_mask>(cycles, pred);
+            }
+    };
+
+    class Bee8051 : public BeeMCS51Variant<12, 7>
+    {
+        public:
+            Bee8051()
+            {
+
+            }
+
+            virtual void init()
+            {
+                BeeMCS51::init();
+                add_names(default_names);
+                bee8051_trace(tracelevel::Info, "Bee8051::Initialized");
+            }
+
+            virtual void shutdown()
+            {
+                BeeMCS51::shutdown();
+                bee8051_trace(tracelevel::Info, "Bee8051::Shutting down...");
+            }
+    };
+
+    class Bee8751 : public BeeMCS51Variant<12, 7>
+    {
+        public:
+            Bee8751()
+            {
+
+            }
+
+            void init()
+            {
+                BeeMCS51::init();
+                add_names(default_names);
+                bee8051_trace(tracelevel::Info, "Bee8751::Initialized");
+            }
+
+            void shutdown()
+            {
+                BeeMCS51::shutdown();
+                bee8051_trace(tracelevel::Info, "Bee8751::Shutting down...");
+            }
+    };
+
+    class Bee8052 : public BeeMCS51Variant<13, 8>
+    {
+        public:
+            Bee8052()
+            {
+
+            }
+
+            void init()
+            {
+                BeeMCS51::init();
+                add_names(default_names);
+                bee8051_trace(tracelevel::Info, "Bee8052::Initialized");
+            }
+
+            void shutdown()
+            {
+                BeeMCS51::shutdown();
+                bee8051_trace(tracelevel::Info, "Bee8052::Shutting down...");
+            }
+    };
+};
+
+
 #endif // BEE8051_H
\ No newline at end of file
@@ -0,0 +1,228 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bee8051batch.h"
+#include <stdexcept>
+using namespace bee8051;
+
+namespace bee8051
+{
+    Bee8051Batch::Bee8051Batch(size_t count)
+    {
+        if (count == 0)
+        {
+            count = max<size_t>(thread::hardware_concurrency(), 1);
+        }
+
+        queues = make_unique<workqueue[]>(count);
+
+        for (size_t id = 0; id < count; id++)
+        {
+            workers.emplace_back(&Bee8051Batch::workerloop, this, id);
+        }
+    }
+
+    Bee8051Batch::~Bee8051Batch()
+    {
+        {
+            lock_guard<mutex> guard(pool_lock);
+            is_quitting = true;
+        }
+
+        start_cond.notify_all();
+
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    size_t Bee8051Batch::getThreadCount()
+    {
+        return workers.size();
+    }
+
+    void Bee8051Batch::addJob(BeeMCS51 *core, int64_t cycles)
+    {
+        batchjob job;
+        job.core = core;
+        job.cycles = cycles;
+        jobs.push_back(job);
+    }
+
+    void Bee8051Batch::addJob(corefactory factory, int64_t cycles)
+    {
+        batchjob job;
+        job.factory = factory;
+        job.cycles = cycles;
+        jobs.push_back(job);
+    }
+
+    void Bee8051Batch::setFinish(finishfunc func)
+    {
+        finish_func = func;
+    }
+
+    vector<Bee8051BatchResult> Bee8051Batch::run()
+    {
+        results.assign(jobs.size(), Bee8051BatchResult());
+
+        // Deal out contiguous runs of jobs, so neighbouring test cases,
+        // which tend to be alike, start out on the same worker
+        size_t count = workers.size();
+
+        for (size_t id = 0; id < count; id++)
+        {
+            size_t first = ((jobs.size() * id) / count);
+            size_t last = ((jobs.size() * (id + 1)) / count);
+
+            for (size_t index = first; index < last; index++)
+            {
+                queues[id].jobs.push_back(index);
+            }
+        }
+
+        {
+            unique_lock<mutex> guard(pool_lock);
+            busy_workers = count;
+            generation += 1;
+            start_cond.notify_all();
+            done_cond.wait(guard, [&]() -> bool
+            {
+                return (busy_workers == 0);
+            });
+        }
+
+        jobs.clear();
+
+        vector<Bee8051BatchResult> batch_results;
+        batch_results.swap(results);
+        return batch_results;
+    }
+
+    void Bee8051Batch::workerloop(size_t id)
+    {
+        uint64_t seen_generation = 0;
+
+        for (;;)
+        {
+            {
+                unique_lock<mutex> guard(pool_lock);
+                start_cond.wait(guard, [&]() -> bool
+                {
+                    return (is_quitting || (generation != seen_generation));
+                });
+
+                if (is_quitting)
+                {
+                    return;
+                }
+
+                seen_generation = generation;
+            }
+
+            // Nothing adds jobs while a batch is running, so once every
+            // queue has come up empty this worker is done with it
+            size_t index = 0;
+
+            while (takejob(id, index))
+            {
+                runjob(index);
+            }
+
+            {
+                lock_guard<mutex> guard(pool_lock);
+                busy_workers -= 1;
+
+                if (busy_workers == 0)
+                {
+                    done_cond.notify_all();
+                }
+            }
+        }
+    }
+
+    // Takes from the front of the worker's own queue, or failing that
+    // from the back of another's
+    bool Bee8051Batch::takejob(size_t id, size_t &index)
+    {
+        size_t count = workers.size();
+
+        for (size_t offs = 0; offs < count; offs++)
+        {
+            workqueue &queue = queues[(id + offs) % count];
+            lock_guard<mutex> guard(queue.lock);
+
+            if (queue.jobs.empty())
+            {
+                continue;
+            }
+
+            if (offs == 0)
+            {
+                index = queue.jobs.front();
+                queue.jobs.pop_front();
+            }
+            else
+            {
+                index = queue.jobs.back();
+                queue.jobs.pop_back();
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+    void Bee8051Batch::runjob(size_t index)
+    {
+        batchjob &job = jobs[index];
+        Bee8051BatchResult &result = results[index];
+
+        try
+        {
+            shared_ptr<BeeMCS51> owned_core;
+            BeeMCS51 *core = job.core;
+
+            if (core == NULL)
+            {
+                owned_core = job.factory(index);
+                core = owned_core.get();
+            }
+
+            if (core == NULL)
+            {
+                throw invalid_argument("Batch job has no core");
+            }
+
+            result.cycles = core->run(job.cycles);
+            result.is_faulted = core->isFaulted();
+            result.pc = core->getPC();
+
+            if (finish_func)
+            {
+                finish_func(index, *core, result);
+            }
+        }
+        catch (...)
+        {
+            result.error = current_exception();
+        }
+    }
+};
@@ -0,0 +1,110 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_BATCH_H
+#define BEE8051_BATCH_H
+
+#include "bee8051.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+using namespace std;
+
+namespace bee8051
+{
+    struct Bee8051BatchResult
+    {
+        // Clock cycles actually run, short of the budget if the core
+        // was stopped or faulted
+        int64_t cycles = 0;
+        bool is_faulted = false;
+        uint16_t pc = 0;
+
+        // Whatever was thrown while building, running or finishing the job
+        exception_ptr error;
+    };
+
+    // Runs many independent cores across a pool of threads
+    //
+    // Each job is either a core the caller owns, or a factory that builds
+    // one on the worker thread that runs it, so setup is spread over the
+    // pool as well. Jobs are dealt out evenly up front, and workers that
+    // run out steal from the back of the others' queues, so a few long
+    // test cases do not hold up the rest. Cores share nothing, and a
+    // faulted or throwing job only ends up in its own result.
+    class Bee8051Batch
+    {
+        public:
+            using corefactory = function<shared_ptr<BeeMCS51>(size_t index)>;
+            using finishfunc = function<void(size_t index, BeeMCS51 &core, Bee8051BatchResult &result)>;
+
+            // Starts one thread per hardware thread when count is 0
+            Bee8051Batch(size_t count = 0);
+            ~Bee8051Batch();
+
+            size_t getThreadCount();
+
+            void addJob(BeeMCS51 *core, int64_t cycles);
+            void addJob(corefactory factory, int64_t cycles);
+
+            // Called on the worker thread once a job's core has finished
+            // running, e.g. to check the outcome of a test before a core
+            // from a factory is freed
+            void setFinish(finishfunc func);
+
+            // Runs every job added since the last call and waits for all
+            // of them; results are in the order the jobs were added
+            vector<Bee8051BatchResult> run();
+
+        private:
+            struct batchjob
+            {
+                BeeMCS51 *core = NULL;
+                corefactory factory;
+                int64_t cycles = 0;
+            };
+
+            struct alignas(64) workqueue
+            {
+                mutex lock;
+                deque<size_t> jobs;
+            };
+
+            vector<thread> workers;
+            unique_ptr<workqueue[]> queues;
+
+            vector<batchjob> jobs;
+            vector<Bee8051BatchResult> results;
+            finishfunc finish_func;
+
+            mutex pool_lock;
+            condition_variable start_cond;
+            condition_variable done_cond;
+            uint64_t generation = 0;
+            size_t busy_workers = 0;
+            bool is_quitting = false;
+
+            void workerloop(size_t id);
+            bool takejob(size_t id, size_t &index);
+            void runjob(size_t index);
+    };
+};
+
+#endif // BEE8051_BATCH_H
@@ -0,0 +1,188 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bee8051file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace bee8051;
+
+namespace bee8051
+{
+    Bee8051MappedFile::Bee8051MappedFile()
+    {
+
+    }
+
+    Bee8051MappedFile::~Bee8051MappedFile()
+    {
+        close();
+    }
+
+#ifdef _WIN32
+    bool Bee8051MappedFile::open(const string &filename)
+    {
+        close();
+
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        LARGE_INTEGER file_size;
+
+        if (!GetFileSizeEx(file, &file_size))
+        {
+            CloseHandle(file);
+            return false;
+        }
+
+        file_handle = file;
+        is_open = true;
+
+        // Empty files cannot be mapped
+        if (file_size.QuadPart == 0)
+        {
+            return true;
+        }
+
+        map_handle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (map_handle == NULL)
+        {
+            close();
+            return false;
+        }
+
+        map_data = static_cast<const uint8_t*>(MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0));
+
+        if (map_data == NULL)
+        {
+            close();
+            return false;
+        }
+
+        map_size = size_t(file_size.QuadPart);
+        return true;
+    }
+
+    void Bee8051MappedFile::close()
+    {
+        if (map_data != NULL)
+        {
+            UnmapViewOfFile(map_data);
+        }
+
+        if (map_handle != NULL)
+        {
+            CloseHandle(map_handle);
+        }
+
+        if (file_handle != NULL)
+        {
+            CloseHandle(file_handle);
+        }
+
+        map_data = NULL;
+        map_size = 0;
+        map_handle = NULL;
+        file_handle = NULL;
+        is_open = false;
+    }
+#else
+    bool Bee8051MappedFile::open(const string &filename)
+    {
+        close();
+
+        int fd = ::open(filename.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat file_stat;
+
+        if ((fstat(fd, &file_stat) < 0) || !S_ISREG(file_stat.st_mode))
+        {
+            ::close(fd);
+            return false;
+        }
+
+        // Empty files cannot be mapped
+        if (file_stat.st_size == 0)
+        {
+            ::close(fd);
+            is_open = true;
+            return true;
+        }
+
+        void *buffer = mmap(NULL, size_t(file_stat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+
+        // The mapping keeps its own reference to the file
+        ::close(fd);
+
+        if (buffer == MAP_FAILED)
+        {
+            return false;
+        }
+
+        map_data = static_cast<const uint8_t*>(buffer);
+        map_size = size_t(file_stat.st_size);
+        is_open = true;
+        return true;
+    }
+
+    void Bee8051MappedFile::close()
+    {
+        if (map_data != NULL)
+        {
+            munmap(const_cast<uint8_t*>(map_data), map_size);
+        }
+
+        map_data = NULL;
+        map_size = 0;
+        is_open = false;
+    }
+#endif
+
+    bool Bee8051MappedFile::isOpen() const
+    {
+        return is_open;
+    }
+
+    const uint8_t *Bee8051MappedFile::data() const
+    {
+        return map_data;
+    }
+
+    size_t Bee8051MappedFile::size() const
+    {
+        return map_size;
+    }
+};
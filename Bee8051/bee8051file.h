@@ -0,0 +1,60 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_FILE_H
+#define BEE8051_FILE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+using namespace std;
+
+namespace bee8051
+{
+    // Maps a whole file read-only into memory, so loaders can parse it
+    // in place and processes loading the same file share its pages
+    class Bee8051MappedFile
+    {
+        public:
+            Bee8051MappedFile();
+            ~Bee8051MappedFile();
+
+            Bee8051MappedFile(const Bee8051MappedFile&) = delete;
+            Bee8051MappedFile &operator=(const Bee8051MappedFile&) = delete;
+
+            // An empty file opens successfully, with no data
+            bool open(const string &filename);
+            void close();
+
+            bool isOpen() const;
+            const uint8_t *data() const;
+            size_t size() const;
+
+        private:
+            const uint8_t *map_data = NULL;
+            size_t map_size = 0;
+            bool is_open = false;
+
+#ifdef _WIN32
+            void *file_handle = NULL;
+            void *map_handle = NULL;
+#endif
+    };
+};
+
+#endif // BEE8051_FILE_H
@@ -0,0 +1,318 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bee8051hex.h"
+#include <array>
+#include <cstring>
+#include <algorithm>
+using namespace bee8051;
+
+namespace bee8051
+{
+    // Value of each ASCII hex digit, with 0xFF for everything else
+    static constexpr array<uint8_t, 256> hexdigits = []()
+    {
+        array<uint8_t, 256> digits = {};
+
+        for (size_t ch = 0; ch < digits.size(); ch++)
+        {
+            if ((ch >= '0') && (ch <= '9'))
+            {
+                digits[ch] = uint8_t(ch - '0');
+            }
+            else if ((ch >= 'A') && (ch <= 'F'))
+            {
+                digits[ch] = uint8_t(ch - 'A' + 10);
+            }
+            else if ((ch >= 'a') && (ch <= 'f'))
+            {
+                digits[ch] = uint8_t(ch - 'a' + 10);
+            }
+            else
+            {
+                digits[ch] = 0xFF;
+            }
+        }
+
+        return digits;
+    }();
+
+    // Decodes count bytes of hex digits, advancing ptr past them
+    static bool readhex(const char *&ptr, const char *end, uint8_t *bytes, size_t count)
+    {
+        if (size_t(end - ptr) < (count * 2))
+        {
+            return false;
+        }
+
+        for (size_t index = 0; index < count; index++)
+        {
+            uint8_t high = hexdigits[uint8_t(ptr[0])];
+            uint8_t low = hexdigits[uint8_t(ptr[1])];
+
+            if ((high | low) & 0xF0)
+            {
+                return false;
+            }
+
+            bytes[index] = ((high << 4) | low);
+            ptr += 2;
+        }
+
+        return true;
+    }
+
+    // Copies a run of data into memory, merging it into the region
+    // before it when the two are contiguous
+    static bool storedata(Bee8051HexInfo &info, vector<Bee8051Region> *regions, uint8_t *memory, size_t memory_size, size_t addr, const uint8_t *data, size_t count)
+    {
+        if (count == 0)
+        {
+            return true;
+        }
+
+        if ((addr + count) > memory_size)
+        {
+            return false;
+        }
+
+        memcpy((memory + addr), data, count);
+
+        if (info.bytes_loaded == 0)
+        {
+            info.low_addr = addr;
+            info.high_addr = (addr + count);
+        }
+        else
+        {
+            info.low_addr = min(info.low_addr, addr);
+            info.high_addr = max(info.high_addr, (addr + count));
+        }
+
+        info.bytes_loaded += count;
+
+        if (regions != NULL)
+        {
+            if (!regions->empty() && ((regions->back().addr + regions->back().size) == addr))
+            {
+                regions->back().size += uint32_t(count);
+            }
+            else
+            {
+                regions->push_back({uint32_t(addr), uint32_t(count)});
+            }
+        }
+
+        return true;
+    }
+
+    static bool fail(Bee8051HexInfo &info, size_t line, const char *error)
+    {
+        info.error = error;
+        info.error_line = line;
+        return false;
+    }
+
+    bool Bee8051Hex::load(const char *text, size_t size, uint8_t *memory, size_t memory_size, Bee8051HexInfo *info, vector<Bee8051Region> *regions)
+    {
+        Bee8051HexInfo local_info;
+        Bee8051HexInfo &result = (info != NULL) ? *info : local_info;
+        result = Bee8051HexInfo();
+
+        if (regions != NULL)
+        {
+            regions->clear();
+        }
+
+        const char *ptr = text;
+        const char *end = (text + size);
+        size_t line = 1;
+
+        uint32_t base_addr = 0;
+        bool is_segment = false;
+        bool is_eof = false;
+
+        // Header (count, address and type), up to 255 data bytes and the checksum
+        array<uint8_t, (4 + 255 + 1)> record;
+
+        while ((ptr < end) && !is_eof)
+        {
+            char ch = *ptr;
+
+            if (ch == '\n')
+            {
+                line += 1;
+                ptr += 1;
+                continue;
+            }
+
+            if ((ch == '\r') || (ch == ' ') || (ch == '\t'))
+            {
+                ptr += 1;
+                continue;
+            }
+
+            if (ch != ':')
+            {
+                return fail(result, line, "Record does not start with a colon");
+            }
+
+            ptr += 1;
+
+            if (!readhex(ptr, end, record.data(), 4))
+            {
+                return fail(result, line, "Malformed record header");
+            }
+
+            uint8_t byte_count = record[0];
+            uint32_t offset = ((record[1] << 8) | record[2]);
+            uint8_t record_type = record[3];
+
+            if (!readhex(ptr, end, (record.data() + 4), (byte_count + 1)))
+            {
+                return fail(result, line, "Malformed or truncated record data");
+            }
+
+            uint8_t checksum = 0;
+
+            for (size_t index = 0; index < (4 + size_t(byte_count) + 1); index++)
+            {
+                checksum += record[index];
+            }
+
+            if (checksum != 0)
+            {
+                return fail(result, line, "Checksum mismatch");
+            }
+
+            const uint8_t *data = (record.data() + 4);
+
+            switch (record_type)
+            {
+                // Data
+                case 0x00:
+                {
+                    // Under segment addressing the offset wraps around
+                    // within the 64 KiB segment, splitting the record
+                    size_t first_count = byte_count;
+
+                    if (is_segment && ((offset + byte_count) > 0x10000))
+                    {
+                        first_count = (0x10000 - offset);
+                    }
+
+                    bool is_stored = storedata(result, regions, memory, memory_size, (base_addr + offset), data, first_count);
+                    is_stored = is_stored && storedata(result, regions, memory, memory_size, base_addr, (data + first_count), (byte_count - first_count));
+
+                    if (!is_stored)
+                    {
+                        return fail(result, line, "Data past the end of program memory");
+                    }
+                }
+                break;
+                // End of file
+                case 0x01:
+                {
+                    if (byte_count != 0)
+                    {
+                        return fail(result, line, "End of file record with data");
+                    }
+
+                    is_eof = true;
+                }
+                break;
+                // Extended segment address
+                case 0x02:
+                {
+                    if (byte_count != 2)
+                    {
+                        return fail(result, line, "Extended segment address record of the wrong length");
+                    }
+
+                    base_addr = (((data[0] << 8) | data[1]) << 4);
+                    is_segment = true;
+                }
+                break;
+                // Start segment address, as CS:IP
+                case 0x03:
+                {
+                    if (byte_count != 4)
+                    {
+                        return fail(result, line, "Start segment address record of the wrong length");
+                    }
+
+                    uint32_t segment = ((data[0] << 8) | data[1]);
+                    uint32_t pointer = ((data[2] << 8) | data[3]);
+                    result.entry = ((segment << 4) + pointer);
+                    result.has_entry = true;
+                }
+                break;
+                // Extended linear address
+                case 0x04:
+                {
+                    if (byte_count != 2)
+                    {
+                        return fail(result, line, "Extended linear address record of the wrong length");
+                    }
+
+                    base_addr = (uint32_t((data[0] << 8) | data[1]) << 16);
+                    is_segment = false;
+                }
+                break;
+                // Start linear address
+                case 0x05:
+                {
+                    if (byte_count != 4)
+                    {
+                        return fail(result, line, "Start linear address record of the wrong length");
+                    }
+
+                    result.entry = ((uint32_t(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3]);
+                    result.has_entry = true;
+                }
+                break;
+                default: return fail(result, line, "Unrecognized record type");
+            }
+        }
+
+        if (!is_eof)
+        {
+            return fail(result, line, "Missing end of file record");
+        }
+
+        return true;
+    }
+
+    bool Bee8051Hex::loadFile(const string &filename, uint8_t *memory, size_t memory_size, Bee8051HexInfo *info, vector<Bee8051Region> *regions)
+    {
+        Bee8051MappedFile file;
+
+        if (!file.open(filename))
+        {
+            if (info != NULL)
+            {
+                *info = Bee8051HexInfo();
+                info->error = "Could not open file";
+            }
+
+            return false;
+        }
+
+        return load(reinterpret_cast<const char*>(file.data()), file.size(), memory, memory_size, info, regions);
+    }
+};
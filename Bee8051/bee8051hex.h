@@ -0,0 +1,74 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_HEX_H
+#define BEE8051_HEX_H
+
+#include "bee8051file.h"
+#include <vector>
+using namespace std;
+
+namespace bee8051
+{
+    // Contiguous run of loaded program memory
+    struct Bee8051Region
+    {
+        uint32_t addr = 0;
+        uint32_t size = 0;
+    };
+
+    struct Bee8051HexInfo
+    {
+        // Range of addresses written, as [low_addr, high_addr), and the
+        // number of data bytes; both are 0 if nothing was loaded
+        size_t low_addr = 0;
+        size_t high_addr = 0;
+        size_t bytes_loaded = 0;
+
+        // From a start address record (type 03 or 05), if there was one
+        bool has_entry = false;
+        uint32_t entry = 0;
+
+        // Why loading failed, and on which line (from 1)
+        const char *error = NULL;
+        size_t error_line = 0;
+    };
+
+    // Loads Intel HEX firmware straight into program memory
+    //
+    // The text is parsed in place, with no allocation, and every record's
+    // checksum is checked before its data is written. Extended segment
+    // (02) and extended linear (04) address records move the base address,
+    // and start address records (03 and 05) set the entry point. Bytes not
+    // covered by a data record are left untouched, and on failure memory
+    // may hold the records before the bad one. The memory is usually the
+    // buffer given to attachROM(), which must then be invalidated if it
+    // was already attached. Given a region list, the loader also records
+    // which runs of memory the records covered, in file order, with
+    // adjacent records merged
+    class Bee8051Hex
+    {
+        public:
+            static bool load(const char *text, size_t size, uint8_t *memory, size_t memory_size, Bee8051HexInfo *info = NULL, vector<Bee8051Region> *regions = NULL);
+
+            // Memory-maps the file rather than reading it
+            static bool loadFile(const string &filename, uint8_t *memory, size_t memory_size, Bee8051HexInfo *info = NULL, vector<Bee8051Region> *regions = NULL);
+    };
+};
+
+#endif // BEE8051_HEX_H
@@ -0,0 +1,456 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bee8051image.h"
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace bee8051;
+
+namespace bee8051
+{
+    static constexpr uint32_t image_magic = 0x49313542; // "B51I"
+    static constexpr uint32_t image_version = 1;
+
+    // Sections start on cache line boundaries
+    static constexpr size_t image_align = 64;
+
+    // Creates an empty file next to filename, under a name no other
+    // writer is using, for the image to be written to and then moved
+    // over filename
+    static bool createtemp(const string &filename, string &temp_name)
+    {
+        static atomic<uint32_t> temp_count(0);
+
+#ifdef _WIN32
+        unsigned long process_id = GetCurrentProcessId();
+#else
+        unsigned long process_id = (unsigned long)getpid();
+#endif
+
+        // Only a name left behind by a crashed writer can already exist
+        for (int attempt = 0; attempt < 100; attempt++)
+        {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), ".%lu.%u.tmp", process_id, temp_count.fetch_add(1));
+            temp_name = (filename + suffix);
+
+#ifdef _WIN32
+            HANDLE file = CreateFileA(temp_name.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+
+            if (file != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(file);
+                return true;
+            }
+
+            if (GetLastError() != ERROR_FILE_EXISTS)
+            {
+                return false;
+            }
+#else
+            int file = open(temp_name.c_str(), (O_WRONLY | O_CREAT | O_EXCL), 0666);
+
+            if (file >= 0)
+            {
+                close(file);
+                return true;
+            }
+
+            if (errno != EEXIST)
+            {
+                return false;
+            }
+#endif
+        }
+
+        return false;
+    }
+
+    // Replaces filename atomically, even if it already exists
+    static bool replacefile(const string &temp_name, const string &filename)
+    {
+#ifdef _WIN32
+        return (MoveFileExA(temp_name.c_str(), filename.c_str(), (MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) != 0);
+#else
+        return (rename(temp_name.c_str(), filename.c_str()) == 0);
+#endif
+    }
+
+    struct imageheader
+    {
+        uint32_t magic = image_magic;
+        uint32_t version = image_version;
+        uint32_t file_size = 0;
+        uint32_t has_entry = 0;
+        uint32_t entry = 0;
+        uint32_t rom_offset = 0;
+        uint32_t rom_size = 0;
+        uint32_t region_offset = 0;
+        uint32_t region_count = 0;
+        uint32_t decoded_offset = 0;
+        uint32_t decoded_count = 0;
+        uint32_t names_offset = 0;
+        uint32_t names_size = 0;
+    };
+
+    // Decoded instruction as stored in an image; the rest of mcs51instr
+    // comes from the opcode table when the image is attached
+    struct imageinstr
+    {
+        uint8_t opcode = 0;
+        array<uint8_t, 2> operands = {{0, 0}};
+        uint8_t flags = 0;
+    };
+
+    static constexpr uint8_t instr_decoded = 0x01;
+    static constexpr uint8_t instr_idle = 0x02;
+
+    static size_t alignup(size_t offset)
+    {
+        return ((offset + image_align - 1) & ~(image_align - 1));
+    }
+
+    Bee8051Image::Bee8051Image()
+    {
+
+    }
+
+    Bee8051Image::~Bee8051Image()
+    {
+        close();
+    }
+
+    bool Bee8051Image::write(const string &filename, const Bee8051ImageSource &source)
+    {
+        if ((source.rom_size > 0x10000) || ((source.rom == NULL) && (source.rom_size != 0)))
+        {
+            return false;
+        }
+
+        vector<imageinstr> decoded;
+        string names;
+
+        if (source.core != NULL)
+        {
+            BeeMCS51 &core = *source.core;
+            uint16_t mask = core.program_mask;
+            decoded.resize(source.has_decoded ? (size_t(mask) + 1) : 0);
+
+            // Only instructions lying wholly within the image are decoded;
+            // the rest of program memory belongs to the host
+            for (size_t addr = 0; addr < decoded.size(); addr++)
+            {
+                uint8_t opcode = (addr < source.rom_size) ? source.rom[addr] : 0;
+                const auto &info = BeeMCS51::opcodetable()[opcode];
+                bool is_inside = (addr < source.rom_size);
+
+                mcs51instr instr;
+                instr.opcode = opcode;
+                instr.length = info.length;
+
+                for (int i = 1; i < info.length; i++)
+                {
+                    size_t operand_addr = ((addr + i) & mask);
+                    is_inside = is_inside && (operand_addr < source.rom_size);
+                    instr.operands[i - 1] = is_inside ? source.rom[operand_addr] : 0;
+                }
+
+                if (is_inside)
+                {
+                    decoded[addr].opcode = instr.opcode;
+                    decoded[addr].operands = instr.operands;
+                    decoded[addr].flags = instr_decoded;
+
+                    if (core.isidleloop(uint16_t(addr), instr))
+                    {
+                        decoded[addr].flags |= instr_idle;
+                    }
+                }
+            }
+
+            for (size_t addr = 0; addr < core.name_table.size(); addr++)
+            {
+                const char *name = core.name_table[addr].data();
+                size_t length = strlen(name);
+
+                if (length != 0)
+                {
+                    names.push_back(char(addr & 0xFF));
+                    names.push_back(char(addr >> 8));
+                    names.push_back(char(length));
+                    names.append(name, length);
+                }
+            }
+        }
+
+        imageheader header;
+        header.has_entry = source.has_entry;
+        header.entry = source.entry;
+        header.rom_offset = uint32_t(alignup(sizeof(imageheader)));
+        header.rom_size = uint32_t(source.rom_size);
+        header.region_offset = uint32_t(alignup(header.rom_offset + header.rom_size));
+        header.region_count = uint32_t(source.regions.size());
+        header.decoded_offset = uint32_t(alignup(header.region_offset + (header.region_count * sizeof(Bee8051Region))));
+        header.decoded_count = uint32_t(decoded.size());
+        header.names_offset = uint32_t(alignup(header.decoded_offset + (header.decoded_count * sizeof(imageinstr))));
+        header.names_size = uint32_t(names.size());
+        header.file_size = (header.names_offset + header.names_size);
+
+        string temp_name;
+
+        if (!createtemp(filename, temp_name))
+        {
+            return false;
+        }
+
+        ofstream file(temp_name, ios::binary | ios::trunc);
+
+        if (!file.is_open())
+        {
+            remove(temp_name.c_str());
+            return false;
+        }
+
+        array<char, image_align> padding = {};
+
+        auto writeat = [&](size_t offset, const void *data, size_t size)
+        {
+            size_t position = size_t(file.tellp());
+            file.write(padding.data(), (offset - position));
+            file.write(static_cast<const char*>(data), size);
+        };
+
+        writeat(0, &header, sizeof(header));
+        writeat(header.rom_offset, source.rom, header.rom_size);
+        writeat(header.region_offset, source.regions.data(), (header.region_count * sizeof(Bee8051Region)));
+        writeat(header.decoded_offset, decoded.data(), (header.decoded_count * sizeof(imageinstr)));
+        writeat(header.names_offset, names.data(), header.names_size);
+        file.close();
+
+        if (!file)
+        {
+            remove(temp_name.c_str());
+            return false;
+        }
+
+        if (!replacefile(temp_name, filename))
+        {
+            remove(temp_name.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    bool Bee8051Image::isImageFile(const string &filename)
+    {
+        ifstream file(filename, ios::binary);
+        uint32_t magic = 0;
+        file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        return (file && (magic == image_magic));
+    }
+
+    bool Bee8051Image::open(const string &filename)
+    {
+        close();
+        error = NULL;
+
+        if (!file.open(filename))
+        {
+            return fail("Could not open file");
+        }
+
+        const uint8_t *data = file.data();
+        size_t size = file.size();
+        imageheader header;
+
+        if (size < sizeof(header))
+        {
+            return fail("File is too small to be an image");
+        }
+
+        memcpy(&header, data, sizeof(header));
+
+        if (header.magic != image_magic)
+        {
+            return fail("Not a Bee8051 image");
+        }
+
+        if (header.version != image_version)
+        {
+            return fail("Image is from a different version");
+        }
+
+        // Every section must lie within the file
+        auto isinside = [&](uint32_t offset, uint64_t length) -> bool
+        {
+            return ((offset % image_align) == 0) && ((uint64_t(offset) + length) <= size);
+        };
+
+        bool is_valid = (header.file_size == size) && (header.rom_size <= 0x10000);
+        is_valid = is_valid && isinside(header.rom_offset, header.rom_size);
+        is_valid = is_valid && isinside(header.region_offset, (uint64_t(header.region_count) * sizeof(Bee8051Region)));
+        is_valid = is_valid && isinside(header.decoded_offset, (uint64_t(header.decoded_count) * sizeof(imageinstr)));
+        is_valid = is_valid && isinside(header.names_offset, header.names_size);
+
+        if (!is_valid)
+        {
+            return fail("Image is truncated or corrupt");
+        }
+
+        rom_data = (data + header.rom_offset);
+        rom_size = header.rom_size;
+        regions = reinterpret_cast<const Bee8051Region*>(data + header.region_offset);
+        region_count = header.region_count;
+        has_entry = (header.has_entry != 0);
+        entry = header.entry;
+        decoded = (data + header.decoded_offset);
+        decoded_count = header.decoded_count;
+        names = (data + header.names_offset);
+        names_size = header.names_size;
+        return true;
+    }
+
+    void Bee8051Image::close()
+    {
+        file.close();
+        rom_data = NULL;
+        rom_size = 0;
+        regions = NULL;
+        region_count = 0;
+        has_entry = false;
+        entry = 0;
+        decoded = NULL;
+        decoded_count = 0;
+        names = NULL;
+        names_size = 0;
+    }
+
+    bool Bee8051Image::fail(const char *reason)
+    {
+        close();
+        error = reason;
+        return false;
+    }
+
+    const char *Bee8051Image::getError() const
+    {
+        return error;
+    }
+
+    bool Bee8051Image::isOpen() const
+    {
+        return file.isOpen();
+    }
+
+    const uint8_t *Bee8051Image::getROM() const
+    {
+        return rom_data;
+    }
+
+    size_t Bee8051Image::getROMSize() const
+    {
+        return rom_size;
+    }
+
+    const Bee8051Region *Bee8051Image::getRegions() const
+    {
+        return regions;
+    }
+
+    size_t Bee8051Image::getRegionCount() const
+    {
+        return region_count;
+    }
+
+    bool Bee8051Image::hasEntry() const
+    {
+        return has_entry;
+    }
+
+    uint32_t Bee8051Image::getEntry() const
+    {
+        return entry;
+    }
+
+    bool Bee8051Image::hasDecoded() const
+    {
+        return (decoded_count != 0);
+    }
+
+    void Bee8051Image::attach(BeeMCS51 &core) const
+    {
+        core.attachROM(rom_data, rom_size);
+
+        bool is_matched = core.is_cache_enabled && (decoded_count != 0) && (core.instr_cache.size() == decoded_count);
+
+        if (is_matched)
+        {
+            const auto &table = BeeMCS51::opcodetable();
+
+            for (size_t addr = 0; addr < decoded_count; addr++)
+            {
+                imageinstr stored;
+                memcpy(&stored, (decoded + (addr * sizeof(imageinstr))), sizeof(imageinstr));
+
+                if ((stored.flags & instr_decoded) == 0)
+                {
+                    continue;
+                }
+
+                const auto &info = table[stored.opcode];
+                mcs51instr &instr = core.instr_cache[addr];
+                instr.opcode = stored.opcode;
+                instr.operands = stored.operands;
+                instr.length = info.length;
+                instr.cycles = info.cycles;
+                instr.handler = core.handlers[stored.opcode];
+                instr.is_idle = ((stored.flags & instr_idle) != 0);
+                instr.is_decoded = true;
+            }
+        }
+
+        for (size_t offset = 0; (offset + 3) <= names_size;)
+        {
+            uint16_t addr = uint16_t(names[offset] | (names[offset + 1] << 8));
+            size_t length = names[offset + 2];
+            offset += 3;
+
+            if ((offset + length) > names_size)
+            {
+                break;
+            }
+
+            core.setname(addr, reinterpret_cast<const char*>(names + offset), length);
+            offset += length;
+        }
+    }
+};
@@ -0,0 +1,113 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_IMAGE_H
+#define BEE8051_IMAGE_H
+
+#include "bee8051.h"
+#include "bee8051hex.h"
+using namespace std;
+
+namespace bee8051
+{
+    // What goes into a ROM image
+    struct Bee8051ImageSource
+    {
+        const uint8_t *rom = NULL;
+        size_t rom_size = 0;
+        vector<Bee8051Region> regions;
+
+        bool has_entry = false;
+        uint32_t entry = 0;
+
+        // A core to take the program width and SFR names from; with one,
+        // the image can also carry the decoded instruction table, which
+        // fills the whole instruction cache on attach. That costs about
+        // half as much as decoding every address lazily, so it only pays
+        // off for programs that run most of their code
+        BeeMCS51 *core = NULL;
+        bool has_decoded = false;
+    };
+
+    // Preprocessed binary form of a firmware image, for fast startup
+    //
+    // An image holds the raw program bytes, the map of regions that were
+    // loaded and the entry point, and optionally the instruction table
+    // and SFR names decoded by a core. It is written once, then opened
+    // through a read-only memory mapping, so the ROM is attached straight
+    // from the mapped pages and every process using the same image shares
+    // them. Images are native-endian and tagged with a version, like save
+    // states; the decoded table stores opcodes and operands rather than
+    // handlers, so it stays valid across builds of the same version
+    class Bee8051Image
+    {
+        public:
+            Bee8051Image();
+            ~Bee8051Image();
+
+            // Writes to a temporary file of its own and renames it into
+            // place, so other processes never map a partly written image
+            // and concurrent writers of the same image each leave a whole one
+            static bool write(const string &filename, const Bee8051ImageSource &source);
+
+            // Checks only the magic number, to tell images from other files
+            static bool isImageFile(const string &filename);
+
+            bool open(const string &filename);
+            void close();
+
+            // Why the last open() failed
+            const char *getError() const;
+
+            bool isOpen() const;
+            const uint8_t *getROM() const;
+            size_t getROMSize() const;
+            const Bee8051Region *getRegions() const;
+            size_t getRegionCount() const;
+            bool hasEntry() const;
+            uint32_t getEntry() const;
+            bool hasDecoded() const;
+
+            // Attaches the mapped ROM to the core, which must not outlive
+            // the image, then fills the core's instruction cache from the
+            // decoded table when the program widths match and adds the SFR
+            // names. Since init() clears the instruction cache, attach
+            // after init(); the decoded table is skipped otherwise, and
+            // instructions are decoded on first use as usual
+            void attach(BeeMCS51 &core) const;
+
+        private:
+            Bee8051MappedFile file;
+
+            const uint8_t *rom_data = NULL;
+            size_t rom_size = 0;
+            const Bee8051Region *regions = NULL;
+            size_t region_count = 0;
+            bool has_entry = false;
+            uint32_t entry = 0;
+            const uint8_t *decoded = NULL;
+            size_t decoded_count = 0;
+            const uint8_t *names = NULL;
+            size_t names_size = 0;
+            const char *error = NULL;
+
+            bool fail(const char *reason);
+    };
+};
+
+#endif // BEE8051_IMAGE_H
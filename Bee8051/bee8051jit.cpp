@@ -0,0 +1,681 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bee8051jit.h"
+#include <cstring>
+using namespace bee8051;
+
+#if defined(BEE8051_ENABLE_JIT) && defined(__x86_64__) && !defined(_WIN32)
+#define BEE8051_JIT_X64
+#include <sys/mman.h>
+#endif
+
+namespace bee8051
+{
+    // Generated code keeps the core in rbx, the internal memory block
+    // in r14 and a pointer to the remaining cycle budget in r15
+    enum : int
+    {
+        RegNone = -1,
+        RegRAX = 0,
+        RegRCX = 1,
+        RegRBX = 3,
+        RegR14 = 14,
+        RegR15 = 15,
+    };
+
+    static constexpr int max_block_instrs = 64;
+    static constexpr size_t max_block_bytes = 8192;
+
+    template<typename T>
+    static int32_t member_offset(BeeMCS51 &core, T &member)
+    {
+        return int32_t(reinterpret_cast<uint8_t*>(&member) - reinterpret_cast<uint8_t*>(&core));
+    }
+
+    Bee8051JIT::Bee8051JIT(BeeMCS51 &cpu) : core(cpu)
+    {
+#ifdef BEE8051_JIT_X64
+        code_size = (4 << 20);
+        void *buffer = mmap(NULL, code_size, (PROT_READ | PROT_WRITE), (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+
+        if (buffer == MAP_FAILED)
+        {
+            code_size = 0;
+            return;
+        }
+
+        code_buffer = reinterpret_cast<uint8_t*>(buffer);
+        code_ptr = code_buffer;
+
+        // void enter(BeeMCS51 *core, uint8_t *mem, int64_t *budget, uint8_t *block)
+        enter_func = reinterpret_cast<entryfunc>(code_ptr);
+        emit8(0x53); // push rbx
+        emit8(0x41); emit8(0x56); // push r14
+        emit8(0x41); emit8(0x57); // push r15
+        emit8(0x48); emit8(0x89); emit8(0xFB); // mov rbx, rdi
+        emit8(0x49); emit8(0x89); emit8(0xF6); // mov r14, rsi
+        emit8(0x49); emit8(0x89); emit8(0xD7); // mov r15, rdx
+        emit8(0xFF); emit8(0xE1); // jmp rcx
+
+        exit_code = code_ptr;
+        emit8(0x41); emit8(0x5F); // pop r15
+        emit8(0x41); emit8(0x5E); // pop r14
+        emit8(0x5B); // pop rbx
+        emit8(0xC3); // ret
+
+        code_start = code_ptr;
+
+        pc_offs = member_offset(core, core.pc);
+        bank_offs = member_offset(core, core.reg_bank);
+        flags_pending_offs = member_offset(core, core.is_flags_pending);
+        flags_accum_offs = member_offset(core, core.flags_accum);
+        flags_data_offs = member_offset(core, core.flags_data);
+        flags_carry_offs = member_offset(core, core.flags_carry);
+
+        blocks.assign(0x10000, NULL);
+        is_unsupported.assign(0x10000, false);
+        reset();
+        setwritable(false);
+#endif
+    }
+
+    Bee8051JIT::~Bee8051JIT()
+    {
+#ifdef BEE8051_JIT_X64
+        if (code_buffer != NULL)
+        {
+            munmap(code_buffer, code_size);
+        }
+#endif
+    }
+
+    bool Bee8051JIT::isAvailable()
+    {
+        return ((code_buffer != NULL) && !is_failed);
+    }
+
+    // Flips the whole buffer between read/write and read/execute
+    bool Bee8051JIT::setwritable(bool is_write)
+    {
+        if (is_failed)
+        {
+            return false;
+        }
+
+        if (is_writable == is_write)
+        {
+            return true;
+        }
+
+#ifdef BEE8051_JIT_X64
+        int prot = (is_write) ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC);
+
+        if (mprotect(code_buffer, code_size, prot) != 0)
+        {
+            is_failed = true;
+            return false;
+        }
+#endif
+
+        is_writable = is_write;
+        return true;
+    }
+
+    void Bee8051JIT::flush()
+    {
+        is_dirty = true;
+    }
+
+    void Bee8051JIT::reset()
+    {
+        code_ptr = code_start;
+        fill(blocks.begin(), blocks.end(), nullptr);
+        fill(is_unsupported.begin(), is_unsupported.end(), false);
+        pending_links.clear();
+        instr_pool.clear();
+        is_dirty = false;
+    }
+
+    // Runs the core's current slice, counting down its budget in place
+    void Bee8051JIT::run()
+    {
+        while ((core.slice_budget > 0) && !core.is_stop_requested)
+        {
+            uint8_t *block = getblock(core.pc);
+
+            if (block != NULL)
+            {
+                int64_t prev_budget = core.slice_budget;
+                enter_func(&core, core.internal_mem.data(), &core.slice_budget, block);
+
+                if (core.slice_budget != prev_budget)
+                {
+                    continue;
+                }
+            }
+
+            // Either there is no block here, or the budget ends partway
+            // through it, so interpret the next instruction on its own
+            core.runinstr();
+        }
+    }
+
+    uint8_t *Bee8051JIT::getblock(uint16_t addr)
+    {
+        if (is_failed)
+        {
+            return NULL;
+        }
+
+        if (is_dirty)
+        {
+            reset();
+        }
+
+        if (blocks[addr] != NULL)
+        {
+            return blocks[addr];
+        }
+
+        if (is_unsupported[addr])
+        {
+            return NULL;
+        }
+
+        return compile(addr);
+    }
+
+    bool Bee8051JIT::issupported(const mcs51instr &instr)
+    {
+        // Idle loops are left to the interpreter, which skips them whole
+        if (instr.is_idle)
+        {
+            return false;
+        }
+
+        switch (instr.opcode)
+        {
+            case 0x02:
+            case 0x25:
+            case 0x74:
+            case 0x75:
+            case 0x80:
+            case 0xC2:
+            case 0xD2:
+            case 0xF5:
+            case 0xF6:
+            case 0xF7: return true;
+            default: break;
+        }
+
+        switch (instr.opcode & 0xF8)
+        {
+            case 0x78:
+            case 0xD8:
+            case 0xF8: return true;
+            default: return false;
+        }
+    }
+
+    bool Bee8051JIT::isbranch(const mcs51instr &instr)
+    {
+        return ((instr.opcode == 0x02) || (instr.opcode == 0x80) || ((instr.opcode & 0xF8) == 0xD8));
+    }
+
+    bool Bee8051JIT::isplainsfr(uint8_t addr)
+    {
+        return core.sfr_table[addr & 0x7F].is_plain;
+    }
+
+    // Direct addresses that can be accessed without going through a
+    // handler; IRAM past the end of a small part is left to the handlers,
+    // which are the ones that check bounds
+    bool Bee8051JIT::isinlinedirect(uint8_t addr)
+    {
+        return (addr < 0x80) ? (addr < core.ram_size) : isplainsfr(addr);
+    }
+
+    static int32_t direct_offset(uint8_t addr)
+    {
+        return (addr < 0x80) ? addr : (0x100 | addr);
+    }
+
+    uint8_t *Bee8051JIT::compile(uint16_t start)
+    {
+        if (!setwritable(true))
+        {
+            return NULL;
+        }
+
+        uint8_t *entry = emitblock(start);
+
+        if (!setwritable(false))
+        {
+            return NULL;
+        }
+
+        return entry;
+    }
+
+    uint8_t *Bee8051JIT::emitblock(uint16_t start)
+    {
+        if ((code_ptr + max_block_bytes) > (code_buffer + code_size))
+        {
+            reset();
+        }
+
+        vector<mcs51instr> block;
+        uint16_t addr = start;
+
+        for (int i = 0; i < max_block_instrs; i++)
+        {
+            const mcs51instr &instr = core.fetchinstr(addr);
+
+            if (!issupported(instr))
+            {
+                break;
+            }
+
+            block.push_back(instr);
+            addr += instr.length;
+
+            if (isbranch(instr))
+            {
+                break;
+            }
+        }
+
+        if (block.empty())
+        {
+            is_unsupported[start] = true;
+            return NULL;
+        }
+
+        int total_cycles = 0;
+
+        for (auto &instr : block)
+        {
+            total_cycles += (instr.cycles * 12);
+        }
+
+        // The interpreter only starts an instruction while there is budget
+        // left, so only enter the block if it would run the last one too
+        int last_cycles = (block.back().cycles * 12);
+
+        uint8_t *entry = code_ptr;
+        memop(false, true, {0x81}, 7, RegR15, RegNone, 0); // cmp qword [r15], imm32
+        emit32(total_cycles - last_cycles);
+        emitjump({0x0F, 0x8E}, exit_code); // jle exit
+
+        int pending_cycles = 0;
+        uint16_t pc = start;
+
+        for (auto &instr : block)
+        {
+            uint16_t next_pc = (pc + instr.length);
+            emitinstr(instr, next_pc, pending_cycles);
+            pc = next_pc;
+        }
+
+        if (!isbranch(block.back()))
+        {
+            emitcycles(pending_cycles);
+            emitexit(pc);
+        }
+
+        blocks[start] = entry;
+
+        auto links = pending_links.find(start);
+
+        if (links != pending_links.end())
+        {
+            for (auto site : links->second)
+            {
+                patchjump(site, entry);
+            }
+
+            pending_links.erase(links);
+        }
+
+        return entry;
+    }
+
+    void Bee8051JIT::emitinstr(const mcs51instr &instr, uint16_t next_pc, int &pending_cycles)
+    {
+        bool is_plain_accum = isplainsfr(0xE0);
+        int reg = (instr.opcode & 0x7);
+
+        switch (instr.opcode)
+        {
+            case 0x02:
+            {
+                pending_cycles += (instr.cycles * 12);
+                emitcycles(pending_cycles);
+                emitexit((instr.operands[0] << 8) | instr.operands[1]);
+            }
+            break; // ljmp code addr
+            case 0x25:
+            {
+                uint8_t addr = instr.operands[0];
+
+                if (!isinlinedirect(addr) || !is_plain_accum)
+                {
+                    emithelper(instr, next_pc, pending_cycles);
+                    break;
+                }
+
+                memop(false, false, {0x0F, 0xB6}, RegRAX, RegR14, RegNone, 0x1E0); // movzx eax, byte [acc]
+                memop(false, false, {0x0F, 0xB6}, RegRCX, RegR14, RegNone, direct_offset(addr)); // movzx ecx, byte [addr]
+                memop(false, false, {0x88}, RegRAX, RegRBX, RegNone, flags_accum_offs); // mov [flags_accum], al
+                memop(false, false, {0x88}, RegRCX, RegRBX, RegNone, flags_data_offs); // mov [flags_data], cl
+                memop(false, false, {0xC6}, 0, RegRBX, RegNone, flags_carry_offs); // mov byte [flags_carry], 0
+                emit8(0);
+                memop(false, false, {0xC6}, 0, RegRBX, RegNone, flags_pending_offs); // mov byte [is_flags_pending], 1
+                emit8(1);
+                emit8(0x00); emit8(0xC8); // add al, cl
+                memop(false, false, {0x88}, RegRAX, RegR14, RegNone, 0x1E0); // mov [acc], al
+                pending_cycles += (instr.cycles * 12);
+            }
+            break; // add a, data addr
+            case 0x74:
+            {
+                if (!is_plain_accum)
+                {
+                    emithelper(instr, next_pc, pending_cycles);
+                    break;
+                }
+
+                memop(false, false, {0xC6}, 0, RegR14, RegNone, 0x1E0); // mov byte [acc], imm8
+                emit8(instr.operands[0]);
+                pending_cycles += (instr.cycles * 12);
+            }
+            break; // mov a, #data
+            case 0x75:
+            {
+                uint8_t addr = instr.operands[0];
+
+                if (!isinlinedirect(addr))
+                {
+                    emithelper(instr, next_pc, pending_cycles);
+                    break;
+                }
+
+                memop(false, false, {0xC6}, 0, RegR14, RegNone, direct_offset(addr)); // mov byte [addr], imm8
+                emit8(instr.operands[1]);
+                pending_cycles += (instr.cycles * 12);
+            }
+            break; // mov data addr, #data
+            case 0x80:
+            {
+                pending_cycles += (instr.cycles * 12);
+                emitcycles(pending_cycles);
+                emitexit(next_pc + int8_t(instr.operands[0]));
+            }
+            break; // sjmp code addr
+            case 0xC2:
+            case 0xD2:
+            {
+                uint8_t addr = instr.operands[0];
+                int word = (((addr & 0x78) >> 3) + 0x20);
+
+                if ((addr >= 0x80) || (word >= core.ram_size))
+                {
+                    emithelper(instr, next_pc, pending_cycles);
+                    break;
+                }
+
+                uint8_t mask = (1 << (addr & 0x7));
+
+                if (instr.opcode == 0xD2)
+                {
+                    memop(false, false, {0x80}, 1, RegR14, RegNone, word); // or byte [word], imm8
+                    emit8(mask);
+                }
+                else
+                {
+                    memop(false, false, {0x80}, 4, RegR14, RegNone, word); // and byte [word], imm8
+                    emit8(~mask);
+                }
+
+                pending_cycles += (instr.cycles * 12);
+            }
+            break; // clr/setb bit addr
+            case 0xF5:
+            {
+                uint8_t addr = instr.operands[0];
+
+                if (!isinlinedirect(addr) || !is_plain_accum)
+                {
+                    emithelper(instr, next_pc, pending_cycles);
+                    break;
+                }
+
+                memop(false, false, {0x0F, 0xB6}, RegRCX, RegR14, RegNone, 0x1E0); // movzx ecx, byte [acc]
+                memop(false, false, {0x88}, RegRCX, RegR14, RegNone, direct_offset(addr)); // mov [addr], cl
+                pending_cycles += (instr.cycles * 12);
+            }
+            break; // mov data addr, a
+            case 0xF6:
+            case 0xF7:
+            {
+                if (!is_plain_accum)
+                {
+                    emithelper(instr, next_pc, pending_cycles);
+                    break;
+                }
+
+                memop(false, false, {0x0F, 0xB6}, RegRAX, RegRBX, RegNone, bank_offs); // movzx eax, byte [reg_bank]
+                memop(false, false, {0x0F, 0xB6}, RegRAX, RegR14, RegRAX, (instr.opcode & 0x1)); // movzx eax, byte [bank + reg]
+                emit8(0x3D); emit32(core.ram_size); // cmp eax, ram_size
+                uint8_t *skip_site = emitjump({0x0F, 0x83}, NULL); // jae skip
+                memop(false, false, {0x0F, 0xB6}, RegRCX, RegR14, RegNone, 0x1E0); // movzx ecx, byte [acc]
+                memop(false, false, {0x88}, RegRCX, RegR14, RegRAX, 0); // mov [rax], cl
+                patchjump(skip_site, code_ptr);
+                pending_cycles += (instr.cycles * 12);
+            }
+            break; // mov @r0/@r1, a
+            default:
+            {
+                switch (instr.opcode & 0xF8)
+                {
+                    case 0x78:
+                    {
+                        memop(false, false, {0x0F, 0xB6}, RegRAX, RegRBX, RegNone, bank_offs); // movzx eax, byte [reg_bank]
+                        memop(false, false, {0xC6}, 0, RegR14, RegRAX, reg); // mov byte [bank + reg], imm8
+                        emit8(instr.operands[0]);
+                        pending_cycles += (instr.cycles * 12);
+                    }
+                    break; // mov r0-r7, #data
+                    case 0xD8:
+                    {
+                        memop(false, false, {0x0F, 0xB6}, RegRAX, RegRBX, RegNone, bank_offs); // movzx eax, byte [reg_bank]
+                        pending_cycles += (instr.cycles * 12);
+                        emitcycles(pending_cycles);
+                        memop(false, false, {0xFE}, 1, RegR14, RegRAX, reg); // dec byte [bank + reg]
+                        uint8_t *taken_site = emitjump({0x0F, 0x85}, NULL); // jne taken
+                        emitexit(next_pc);
+                        patchjump(taken_site, code_ptr);
+                        emitexit(next_pc + int8_t(instr.operands[0]));
+                    }
+                    break; // djnz r0-r7, code addr
+                    case 0xF8:
+                    {
+                        if (!is_plain_accum)
+                        {
+                            emithelper(instr, next_pc, pending_cycles);
+                            break;
+                        }
+
+                        memop(false, false, {0x0F, 0xB6}, RegRAX, RegRBX, RegNone, bank_offs); // movzx eax, byte [reg_bank]
+                        memop(false, false, {0x0F, 0xB6}, RegRCX, RegR14, RegNone, 0x1E0); // movzx ecx, byte [acc]
+                        memop(false, false, {0x88}, RegRCX, RegR14, RegRAX, reg); // mov [bank + reg], cl
+                        pending_cycles += (instr.cycles * 12);
+                    }
+                    break; // mov r0-r7, a
+                    default: emithelper(instr, next_pc, pending_cycles); break;
+                }
+            }
+            break;
+        }
+    }
+
+    // Runs the instruction through its regular handler, leaving the block
+    // if the handler asked the core to stop or invalidated the translations
+    void Bee8051JIT::emithelper(const mcs51instr &instr, uint16_t next_pc, int &pending_cycles)
+    {
+        instr_pool.push_back(instr);
+        const mcs51instr *instr_ptr = &instr_pool.back();
+
+        memop(true, false, {0xC7}, 0, RegRBX, RegNone, pc_offs); // mov word [pc], imm16
+        emit16(next_pc);
+
+        pending_cycles += (instr.cycles * 12);
+        emitcycles(pending_cycles);
+
+        emit8(0x48); emit8(0x89); emit8(0xDF); // mov rdi, rbx
+        emit8(0x48); emit8(0xBE); emit64(reinterpret_cast<uint64_t>(instr_ptr)); // mov rsi, imm64
+        emit8(0x48); emit8(0xB8); emit64(reinterpret_cast<uint64_t>(&Bee8051JIT::exechelper)); // mov rax, imm64
+        emit8(0xFF); emit8(0xD0); // call rax
+        emit8(0x84); emit8(0xC0); // test al, al
+        emitjump({0x0F, 0x85}, exit_code); // jne exit
+    }
+
+    // Blocks only check the budget on entry, so leave the block if the
+    // handler scheduled an event that cut the current slice short
+    uint8_t Bee8051JIT::exechelper(BeeMCS51 *core, const mcs51instr *instr)
+    {
+        (core->*(instr->handler))(*instr);
+        return (core->is_stop_requested || core->is_slice_cut || core->jit->is_dirty);
+    }
+
+    void Bee8051JIT::emitcycles(int &pending_cycles)
+    {
+        if (pending_cycles == 0)
+        {
+            return;
+        }
+
+        memop(false, true, {0x81}, 5, RegR15, RegNone, 0); // sub qword [r15], imm32
+        emit32(pending_cycles);
+        pending_cycles = 0;
+    }
+
+    // Leaves the block for target, jumping straight into its translation
+    // once there is one; the target block checks the budget on entry
+    void Bee8051JIT::emitexit(uint16_t target)
+    {
+        memop(true, false, {0xC7}, 0, RegRBX, RegNone, pc_offs); // mov word [pc], imm16
+        emit16(target);
+
+        uint8_t *target_block = blocks[target];
+        uint8_t *site = emitjump({0xE9}, (target_block != NULL) ? target_block : exit_code);
+
+        if (target_block == NULL)
+        {
+            pending_links[target].push_back(site);
+        }
+    }
+
+    void Bee8051JIT::emit8(uint8_t data)
+    {
+        *code_ptr++ = data;
+    }
+
+    void Bee8051JIT::emit16(uint16_t data)
+    {
+        memcpy(code_ptr, &data, sizeof(data));
+        code_ptr += sizeof(data);
+    }
+
+    void Bee8051JIT::emit32(uint32_t data)
+    {
+        memcpy(code_ptr, &data, sizeof(data));
+        code_ptr += sizeof(data);
+    }
+
+    void Bee8051JIT::emit64(uint64_t data)
+    {
+        memcpy(code_ptr, &data, sizeof(data));
+        code_ptr += sizeof(data);
+    }
+
+    // Emits an instruction with a [base + index + disp32] memory operand
+    void Bee8051JIT::memop(bool is_word, bool is_wide, initializer_list<uint8_t> opcode, int reg, int base, int index, int32_t disp)
+    {
+        if (is_word)
+        {
+            emit8(0x66);
+        }
+
+        int rex = 0x40;
+        rex |= (is_wide) ? 0x08 : 0;
+        rex |= ((reg >> 3) & 1) << 2;
+        rex |= (index != RegNone) ? (((index >> 3) & 1) << 1) : 0;
+        rex |= ((base >> 3) & 1);
+
+        if (rex != 0x40)
+        {
+            emit8(rex);
+        }
+
+        for (auto byte : opcode)
+        {
+            emit8(byte);
+        }
+
+        if ((index == RegNone) && ((base & 7) != 4))
+        {
+            emit8(0x80 | ((reg & 7) << 3) | (base & 7));
+        }
+        else
+        {
+            int sib_index = (index != RegNone) ? (index & 7) : 4;
+            emit8(0x80 | ((reg & 7) << 3) | 4);
+            emit8((sib_index << 3) | (base & 7));
+        }
+
+        emit32(disp);
+    }
+
+    // Emits a jump with a 32-bit displacement and returns where that
+    // displacement lives, so it can be patched later
+    uint8_t *Bee8051JIT::emitjump(initializer_list<uint8_t> opcode, uint8_t *target)
+    {
+        for (auto byte : opcode)
+        {
+            emit8(byte);
+        }
+
+        uint8_t *site = code_ptr;
+        emit32(0);
+
+        if (target != NULL)
+        {
+            patchjump(site, target);
+        }
+
+        return site;
+    }
+
+    void Bee8051JIT::patchjump(uint8_t *site, uint8_t *target)
+    {
+        int32_t rel = int32_t(target - (site + 4));
+        memcpy(site, &rel, sizeof(rel));
+    }
+};
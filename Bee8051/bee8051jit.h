@@ -0,0 +1,111 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_JIT_H
+#define BEE8051_JIT_H
+
+#include "bee8051.h"
+#include <deque>
+using namespace std;
+
+namespace bee8051
+{
+    // Basic block recompiler to x86-64, used by BeeMCS51 in execmode::JIT
+    //
+    // Blocks end at the first branch or at the first instruction the
+    // recompiler does not handle, which is then run by the interpreter.
+    // Instructions that touch hooked SFRs or the host are compiled into
+    // calls to the regular handlers, so results are identical to the
+    // interpreter, down to where a run() call stops.
+    //
+    // The code buffer is never writable and executable at once: it is
+    // only made writable while a block is emitted or linked, and the
+    // recompiler turns itself off if the protection cannot be changed.
+    class Bee8051JIT
+    {
+        public:
+            Bee8051JIT(BeeMCS51 &cpu);
+            ~Bee8051JIT();
+
+            // False if the code buffer could not be allocated, or its
+            // protection changed, in which case run() only interprets
+            bool isAvailable();
+
+            // Safe to call from within a handler running inside a block;
+            // the translations are dropped once control is back in run()
+            void flush();
+
+            void run();
+
+        private:
+            BeeMCS51 &core;
+
+            uint8_t *code_buffer = NULL;
+            size_t code_size = 0;
+            uint8_t *code_ptr = NULL;
+            uint8_t *code_start = NULL;
+
+            using entryfunc = void (*)(BeeMCS51*, uint8_t*, int64_t*, uint8_t*);
+            entryfunc enter_func = NULL;
+            uint8_t *exit_code = NULL;
+
+            bool is_dirty = true;
+            bool is_writable = true;
+            bool is_failed = false;
+
+            vector<uint8_t*> blocks;
+            vector<bool> is_unsupported;
+            unordered_map<uint16_t, vector<uint8_t*>> pending_links;
+            deque<mcs51instr> instr_pool;
+
+            int32_t pc_offs = 0;
+            int32_t bank_offs = 0;
+            int32_t flags_pending_offs = 0;
+            int32_t flags_accum_offs = 0;
+            int32_t flags_data_offs = 0;
+            int32_t flags_carry_offs = 0;
+
+            void reset();
+            uint8_t *getblock(uint16_t addr);
+            uint8_t *compile(uint16_t addr);
+            uint8_t *emitblock(uint16_t addr);
+            bool setwritable(bool is_write);
+
+            bool issupported(const mcs51instr &instr);
+            bool isbranch(const mcs51instr &instr);
+            bool isplainsfr(uint8_t addr);
+            bool isinlinedirect(uint8_t addr);
+
+            void emitinstr(const mcs51instr &instr, uint16_t next_pc, int &pending_cycles);
+            void emithelper(const mcs51instr &instr, uint16_t next_pc, int &pending_cycles);
+            void emitcycles(int &pending_cycles);
+            void emitexit(uint16_t target);
+
+            static uint8_t exechelper(BeeMCS51 *core, const mcs51instr *instr);
+
+            void emit8(uint8_t data);
+            void emit16(uint16_t data);
+            void emit32(uint32_t data);
+            void emit64(uint64_t data);
+            void memop(bool is_word, bool is_wide, initializer_list<uint8_t> opcode, int reg, int base, int index, int32_t disp);
+            uint8_t *emitjump(initializer_list<uint8_t> opcode, uint8_t *target);
+            void patchjump(uint8_t *site, uint8_t *target);
+    };
+};
+
+#endif // BEE8051_JIT_H
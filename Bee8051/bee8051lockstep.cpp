@@ -0,0 +1,1102 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bee8051lockstep.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+using namespace bee8051;
+
+namespace bee8051
+{
+    // Lane rows are padded to a multiple of the widest vector, and
+    // groups track their lanes in whole multiples of it too
+    static constexpr size_t lane_align = 32;
+
+#if defined(__AVX2__)
+    using lanevec = __m256i;
+    static constexpr size_t vec_width = 32;
+
+    static inline lanevec vload(const uint8_t *ptr)
+    {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+    }
+
+    static inline void vstore(uint8_t *ptr, lanevec data)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(ptr), data);
+    }
+
+    static inline lanevec vsplat(uint8_t data)
+    {
+        return _mm256_set1_epi8(char(data));
+    }
+
+    static inline lanevec vand(lanevec a, lanevec b)
+    {
+        return _mm256_and_si256(a, b);
+    }
+
+    static inline lanevec vor(lanevec a, lanevec b)
+    {
+        return _mm256_or_si256(a, b);
+    }
+
+    static inline lanevec vxor(lanevec a, lanevec b)
+    {
+        return _mm256_xor_si256(a, b);
+    }
+
+    // ~a & b
+    static inline lanevec vandnot(lanevec a, lanevec b)
+    {
+        return _mm256_andnot_si256(a, b);
+    }
+
+    static inline lanevec vadd(lanevec a, lanevec b)
+    {
+        return _mm256_add_epi8(a, b);
+    }
+
+    // Byte lanes of mask are all ones or all zeroes
+    static inline lanevec vselect(lanevec mask, lanevec a, lanevec b)
+    {
+        return _mm256_blendv_epi8(b, a, mask);
+    }
+
+    static inline lanevec viszero(lanevec a)
+    {
+        return _mm256_cmpeq_epi8(a, _mm256_setzero_si256());
+    }
+
+    static inline bool vany(lanevec a)
+    {
+        return !_mm256_testz_si256(a, a);
+    }
+
+    // Shifts within 16-bit words; callers mask off the bits that
+    // cross over from the neighbouring byte
+    template<int bits>
+    static inline lanevec vshl(lanevec a)
+    {
+        return _mm256_slli_epi16(a, bits);
+    }
+
+    template<int bits>
+    static inline lanevec vshr(lanevec a)
+    {
+        return _mm256_srli_epi16(a, bits);
+    }
+#elif defined(__SSE2__)
+    using lanevec = __m128i;
+    static constexpr size_t vec_width = 16;
+
+    static inline lanevec vload(const uint8_t *ptr)
+    {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+    }
+
+    static inline void vstore(uint8_t *ptr, lanevec data)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(ptr), data);
+    }
+
+    static inline lanevec vsplat(uint8_t data)
+    {
+        return _mm_set1_epi8(char(data));
+    }
+
+    static inline lanevec vand(lanevec a, lanevec b)
+    {
+        return _mm_and_si128(a, b);
+    }
+
+    static inline lanevec vor(lanevec a, lanevec b)
+    {
+        return _mm_or_si128(a, b);
+    }
+
+    static inline lanevec vxor(lanevec a, lanevec b)
+    {
+        return _mm_xor_si128(a, b);
+    }
+
+    // ~a & b
+    static inline lanevec vandnot(lanevec a, lanevec b)
+    {
+        return _mm_andnot_si128(a, b);
+    }
+
+    static inline lanevec vadd(lanevec a, lanevec b)
+    {
+        return _mm_add_epi8(a, b);
+    }
+
+    // Byte lanes of mask are all ones or all zeroes
+    static inline lanevec vselect(lanevec mask, lanevec a, lanevec b)
+    {
+        return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+    }
+
+    static inline lanevec viszero(lanevec a)
+    {
+        return _mm_cmpeq_epi8(a, _mm_setzero_si128());
+    }
+
+    static inline bool vany(lanevec a)
+    {
+        return (_mm_movemask_epi8(viszero(a)) != 0xFFFF);
+    }
+
+    // Shifts within 16-bit words; callers mask off the bits that
+    // cross over from the neighbouring byte
+    template<int bits>
+    static inline lanevec vshl(lanevec a)
+    {
+        return _mm_slli_epi16(a, bits);
+    }
+
+    template<int bits>
+    static inline lanevec vshr(lanevec a)
+    {
+        return _mm_srli_epi16(a, bits);
+    }
+#else
+    using lanevec = uint8_t;
+    static constexpr size_t vec_width = 1;
+
+    static inline lanevec vload(const uint8_t *ptr)
+    {
+        return *ptr;
+    }
+
+    static inline void vstore(uint8_t *ptr, lanevec data)
+    {
+        *ptr = data;
+    }
+
+    static inline lanevec vsplat(uint8_t data)
+    {
+        return data;
+    }
+
+    static inline lanevec vand(lanevec a, lanevec b)
+    {
+        return (a & b);
+    }
+
+    static inline lanevec vor(lanevec a, lanevec b)
+    {
+        return (a | b);
+    }
+
+    static inline lanevec vxor(lanevec a, lanevec b)
+    {
+        return (a ^ b);
+    }
+
+    // ~a & b
+    static inline lanevec vandnot(lanevec a, lanevec b)
+    {
+        return uint8_t(~a & b);
+    }
+
+    static inline lanevec vadd(lanevec a, lanevec b)
+    {
+        return uint8_t(a + b);
+    }
+
+    static inline lanevec vselect(lanevec mask, lanevec a, lanevec b)
+    {
+        return ((mask & a) | uint8_t(~mask & b));
+    }
+
+    static inline lanevec viszero(lanevec a)
+    {
+        return (a == 0) ? 0xFF : 0x00;
+    }
+
+    static inline bool vany(lanevec a)
+    {
+        return (a != 0);
+    }
+
+    template<int bits>
+    static inline lanevec vshl(lanevec a)
+    {
+        return uint8_t(a << bits);
+    }
+
+    template<int bits>
+    static inline lanevec vshr(lanevec a)
+    {
+        return uint8_t(a >> bits);
+    }
+#endif
+
+    // Bit 0 of each byte is its parity; only bit 0 is free of bits
+    // shifted in from the neighbouring byte
+    static inline lanevec vparity(lanevec data)
+    {
+        data = vxor(data, vshr<4>(data));
+        data = vxor(data, vshr<2>(data));
+        data = vxor(data, vshr<1>(data));
+        return vand(data, vsplat(0x01));
+    }
+
+    Bee8051Lockstep::Bee8051Lockstep(BeeMCS51 &cpu, size_t count) : core(cpu)
+    {
+        core.syncFlags();
+
+        lane_count = count;
+        stride = (((count + lane_align - 1) / lane_align) * lane_align);
+        lane_mem.assign((0x204 * stride), 0);
+
+        for (int addr = 0; addr < 0x200; addr++)
+        {
+            fill_n(row(addr), lane_count, core.internal_mem[addr]);
+        }
+
+        for (int port = 0; port < 4; port++)
+        {
+            int input = core.port_inputs[port].load(memory_order_relaxed);
+            fill_n(inputrow(port), lane_count, ((input >= 0) ? uint8_t(input) : 0xFF));
+        }
+
+        lane_pcs.assign(lane_count, core.pc);
+        lane_cycles.assign(lane_count, core.getcycles());
+        lane_budgets.assign(lane_count, 0);
+        lane_faults.assign(lane_count, core.is_faulted);
+
+        instr_cache.assign((core.program_mask + 1), laneinstr());
+        is_decoded.assign((core.program_mask + 1), false);
+        updatebanks();
+    }
+
+    Bee8051Lockstep::~Bee8051Lockstep()
+    {
+
+    }
+
+    size_t Bee8051Lockstep::getLaneCount()
+    {
+        return lane_count;
+    }
+
+    void Bee8051Lockstep::invalidateROM()
+    {
+        is_decoded.assign(is_decoded.size(), false);
+    }
+
+    uint8_t Bee8051Lockstep::readRAM(size_t lane, uint16_t addr)
+    {
+        return row(addr & 0x1FF)[lane];
+    }
+
+    void Bee8051Lockstep::writeRAM(size_t lane, uint16_t addr, uint8_t data)
+    {
+        row(addr & 0x1FF)[lane] = data;
+
+        if ((addr & 0x1FF) == 0x1D0)
+        {
+            updatebanks();
+        }
+    }
+
+    uint8_t Bee8051Lockstep::getPSW(size_t lane)
+    {
+        uint8_t psw = row(0x1D0)[lane];
+        return core.changebit(psw, 0, core.calcParity(row(0x1E0)[lane]));
+    }
+
+    uint16_t Bee8051Lockstep::getPC(size_t lane)
+    {
+        return lane_pcs[lane];
+    }
+
+    int64_t Bee8051Lockstep::getCycles(size_t lane)
+    {
+        return lane_cycles[lane];
+    }
+
+    bool Bee8051Lockstep::isFaulted(size_t lane)
+    {
+        return (lane_faults[lane] != 0);
+    }
+
+    void Bee8051Lockstep::setPortInput(size_t lane, int port, uint8_t data)
+    {
+        inputrow(port & 3)[lane] = data;
+    }
+
+    int64_t Bee8051Lockstep::getDispatchCount()
+    {
+        return dispatch_count;
+    }
+
+    void Bee8051Lockstep::run(int64_t cycles)
+    {
+        dispatch_count = 0;
+        updatebanks();
+
+        for (size_t lane = 0; lane < lane_count; lane++)
+        {
+            lane_budgets[lane] = cycles;
+
+            if (!lane_faults[lane] && (cycles > 0))
+            {
+                addlane(lane);
+            }
+        }
+
+        while (!groups.empty())
+        {
+            // Running the lowest PC first lets groups that split at a
+            // loop catch up with each other where the paths rejoin
+            size_t best = 0;
+
+            for (size_t index = 1; index < groups.size(); index++)
+            {
+                if (groups[index].pc < groups[best].pc)
+                {
+                    best = index;
+                }
+            }
+
+            for (size_t index = groups.size(); index-- > 0;)
+            {
+                if ((index != best) && (groups[index].pc == groups[best].pc))
+                {
+                    combine(best, index);
+                    freegroup(index);
+
+                    if (best == groups.size())
+                    {
+                        best = index;
+                    }
+                }
+            }
+
+            step(best);
+        }
+
+        for (size_t lane = 0; lane < lane_count; lane++)
+        {
+            lane_cycles[lane] += (cycles - lane_budgets[lane]);
+        }
+    }
+
+    void Bee8051Lockstep::updatebanks()
+    {
+        const uint8_t *psw = row(0x1D0);
+        common_bank = (lane_count != 0) ? (psw[0] & 0x18) : 0;
+
+        for (size_t lane = 1; lane < lane_count; lane++)
+        {
+            if ((psw[lane] & 0x18) != common_bank)
+            {
+                common_bank = -1;
+                break;
+            }
+        }
+    }
+
+    uint8_t Bee8051Lockstep::lanebank(size_t lane)
+    {
+        return (row(0x1D0)[lane] & 0x18);
+    }
+
+    // Works out up front how a direct address behaves, the same way the
+    // core's SFR table does
+    Bee8051Lockstep::laneaccess Bee8051Lockstep::classify(uint8_t addr)
+    {
+        laneaccess access;
+
+        if (addr < 0x80)
+        {
+            access.addr = addr;
+            return access;
+        }
+
+        access.addr = (0x100 | addr);
+
+        if (addr == 0xD0)
+        {
+            access.kind = AccessPSW;
+        }
+        else if ((addr & 0xCF) == 0x80)
+        {
+            access.kind = AccessPort;
+            access.port = ((addr >> 4) & 3);
+        }
+        else
+        {
+            const BeeMCS51::mcs51sfr &sfr = core.sfr_table[addr & 0x7F];
+            access.kind = sfr.is_used ? AccessRAM : AccessUnused;
+            access.is_read_hooked = bool(sfr.read_func);
+            access.is_write_hooked = bool(sfr.write_func);
+        }
+
+        return access;
+    }
+
+    const Bee8051Lockstep::laneinstr &Bee8051Lockstep::fetch(uint16_t addr)
+    {
+        uint16_t index = (addr & core.program_mask);
+        laneinstr &instr = instr_cache[index];
+
+        if (is_decoded[index])
+        {
+            return instr;
+        }
+
+        instr = laneinstr();
+        core.decodeinstr(addr, instr.instr);
+        instr.cycles = (instr.instr.cycles * 12);
+
+        uint8_t opcode = instr.instr.opcode;
+        uint8_t operand = instr.instr.operands[0];
+        bool is_read = false;
+        bool is_write = false;
+
+        switch (opcode)
+        {
+            case 0x02: instr.kind = LaneLjmp; break;
+            case 0x32: instr.kind = LaneReti; break;
+            case 0x25: instr.kind = LaneAddDir; is_read = true; break;
+            case 0x74: instr.kind = LaneMovAImm; break;
+            case 0x75: instr.kind = LaneMovDirImm; is_write = true; break;
+            case 0x80: instr.kind = LaneSjmp; break;
+            case 0xC2: instr.kind = LaneClrBit; is_read = is_write = true; break;
+            case 0xD2: instr.kind = LaneSetbBit; is_read = is_write = true; break;
+            case 0xF5: instr.kind = LaneMovDirA; is_write = true; break;
+            case 0xF6:
+            case 0xF7: instr.kind = LaneMovIndA; break;
+            default:
+            {
+                switch (opcode & 0xF8)
+                {
+                    case 0x78: instr.kind = LaneMovRnImm; break;
+                    case 0xD8: instr.kind = LaneDjnz; break;
+                    case 0xF8: instr.kind = LaneMovRnA; break;
+                    default: break;
+                }
+            }
+            break;
+        }
+
+        if ((instr.kind == LaneClrBit) || (instr.kind == LaneSetbBit))
+        {
+            uint8_t word = (operand >= 0x80) ? (operand & 0xF8) : (0x20 + ((operand & 0x78) >> 3));
+            instr.access = classify(word);
+            instr.bit_mask = uint8_t(1 << (operand & 7));
+        }
+        else
+        {
+            instr.access = classify(operand);
+        }
+
+        // Opcodes the core implements but the lanes do not are treated
+        // like hooked SFRs, so the lane stops without running them
+        bool is_unmodelled = ((instr.kind == LaneUnknown) && (instr.instr.handler != &BeeMCS51::op_unknown));
+        instr.is_hooked = (is_unmodelled || (is_read && instr.access.is_read_hooked) || (is_write && instr.access.is_write_hooked));
+
+        is_decoded[index] = true;
+        return instr;
+    }
+
+    size_t Bee8051Lockstep::newgroup(uint16_t pc)
+    {
+        lanegroup group;
+        group.pc = pc;
+        group.first = stride;
+        group.last = 0;
+        group.min_budget = INT64_MAX;
+
+        if (!spare_masks.empty())
+        {
+            group.mask = move(spare_masks.back());
+            spare_masks.pop_back();
+        }
+        else
+        {
+            group.mask.assign(stride, 0);
+        }
+
+        groups.push_back(move(group));
+        return (groups.size() - 1);
+    }
+
+    // Spare masks are kept all zero
+    void Bee8051Lockstep::freegroup(size_t index)
+    {
+        lanegroup &group = groups[index];
+
+        if (group.first < group.last)
+        {
+            fill((group.mask.begin() + group.first), (group.mask.begin() + group.last), 0);
+        }
+
+        spare_masks.push_back(move(group.mask));
+
+        if (index != (groups.size() - 1))
+        {
+            groups[index] = move(groups.back());
+        }
+
+        groups.pop_back();
+    }
+
+    // Adds a lane to the group at its PC; its budget is raised by the
+    // group's debt, as that gets taken off every lane in the group
+    void Bee8051Lockstep::addlane(size_t lane)
+    {
+        size_t index = groups.size();
+
+        for (size_t group_index = 0; group_index < groups.size(); group_index++)
+        {
+            if (groups[group_index].pc == lane_pcs[lane])
+            {
+                index = group_index;
+                break;
+            }
+        }
+
+        if (index == groups.size())
+        {
+            index = newgroup(lane_pcs[lane]);
+        }
+
+        lanegroup &group = groups[index];
+        size_t first = ((lane / lane_align) * lane_align);
+        lane_budgets[lane] += group.debt;
+        group.mask[lane] = 0xFF;
+        group.min_budget = min(group.min_budget, lane_budgets[lane]);
+        group.first = min(group.first, first);
+        group.last = max(group.last, (first + lane_align));
+    }
+
+    void Bee8051Lockstep::combine(size_t index, size_t from)
+    {
+        lanegroup &group = groups[index];
+        lanegroup &other = groups[from];
+        int64_t adjust = (group.debt - other.debt);
+        size_t last = min(other.last, lane_count);
+
+        for (size_t lane = other.first; lane < last; lane++)
+        {
+            if (other.mask[lane])
+            {
+                group.mask[lane] = 0xFF;
+                lane_budgets[lane] += adjust;
+            }
+        }
+
+        group.min_budget = min(group.min_budget, (other.min_budget + adjust));
+        group.first = min(group.first, other.first);
+        group.last = max(group.last, other.last);
+    }
+
+    // Takes the group's debt off its lanes, and drops the lanes that
+    // are out of budget; returns how many are left
+    size_t Bee8051Lockstep::settle(size_t index)
+    {
+        lanegroup &group = groups[index];
+        size_t count = 0;
+        size_t first = stride;
+        size_t last = 0;
+        int64_t min_budget = INT64_MAX;
+        size_t end = min(group.last, lane_count);
+
+        for (size_t lane = group.first; lane < end; lane++)
+        {
+            if (!group.mask[lane])
+            {
+                continue;
+            }
+
+            lane_budgets[lane] -= group.debt;
+
+            if (lane_budgets[lane] <= 0)
+            {
+                group.mask[lane] = 0;
+                lane_pcs[lane] = group.pc;
+                continue;
+            }
+
+            count += 1;
+            min_budget = min(min_budget, lane_budgets[lane]);
+            first = min(first, ((lane / lane_align) * lane_align));
+            last = max(last, (((lane / lane_align) + 1) * lane_align));
+        }
+
+        // Keep the old range if nothing is left, so freegroup() clears it
+        if (count != 0)
+        {
+            group.first = first;
+            group.last = last;
+        }
+
+        group.debt = 0;
+        group.min_budget = min_budget;
+        return count;
+    }
+
+    void Bee8051Lockstep::retire(size_t index)
+    {
+        if ((groups[index].debt >= groups[index].min_budget) && (settle(index) == 0))
+        {
+            freegroup(index);
+        }
+    }
+
+    // Stops every lane in the group on its current instruction
+    void Bee8051Lockstep::fault(size_t index)
+    {
+        lanegroup &group = groups[index];
+        size_t end = min(group.last, lane_count);
+
+        for (size_t lane = group.first; lane < end; lane++)
+        {
+            if (group.mask[lane])
+            {
+                lane_budgets[lane] -= group.debt;
+                lane_pcs[lane] = group.pc;
+                lane_faults[lane] = 1;
+            }
+        }
+
+        freegroup(index);
+    }
+
+    void Bee8051Lockstep::step(size_t index)
+    {
+        const laneinstr &instr = fetch(groups[index].pc);
+        dispatch_count += 1;
+
+        if (instr.is_hooked)
+        {
+            fault(index);
+            return;
+        }
+
+        if (instr.instr.is_idle)
+        {
+            uint16_t target = ((instr.instr.operands[0] << 8) | instr.instr.operands[1]);
+
+            // Decoded entries are shared between mirrored addresses,
+            // so an ljmp is only a loop at the address it was decoded at
+            if ((instr.kind != LaneLjmp) || (target == groups[index].pc))
+            {
+                stepidle(index, instr);
+                return;
+            }
+        }
+
+        lanegroup &group = groups[index];
+        uint16_t next_pc = (group.pc + instr.instr.length);
+        group.debt += instr.cycles;
+
+        switch (instr.kind)
+        {
+            case LaneUnknown:
+            {
+                fault(index);
+                return;
+            }
+            case LaneLjmp: group.pc = ((instr.instr.operands[0] << 8) | instr.instr.operands[1]); break;
+            case LaneSjmp: group.pc = (next_pc + int8_t(instr.instr.operands[0])); break;
+            case LaneReti: stepreti(index); return;
+            case LaneDjnz: stepdjnz(index, instr); return;
+            case LaneMovRnImm:
+            case LaneMovRnA: stepregister(group, instr); group.pc = next_pc; break;
+            case LaneMovIndA: stepindirect(group, instr); group.pc = next_pc; break;
+            default: stepdirect(group, instr); group.pc = next_pc; break;
+        }
+
+        retire(index);
+    }
+
+    // Instructions with a direct operand, which is the same row for
+    // every lane
+    void Bee8051Lockstep::stepdirect(lanegroup &group, const laneinstr &instr)
+    {
+        const laneaccess &access = instr.access;
+        const uint8_t *mask = group.mask.data();
+        uint8_t *accum = row(0x1E0);
+        uint8_t *psw = row(0x1D0);
+        uint8_t *target = row(access.addr);
+        const uint8_t *input = inputrow(access.port);
+        bool is_rmw = ((instr.kind == LaneClrBit) || (instr.kind == LaneSetbBit));
+
+        auto readdirect = [&](size_t offs, lanevec lane_mask) -> lanevec
+        {
+            switch (access.kind)
+            {
+                case AccessPSW:
+                {
+                    // Reading PSW brings the parity flag up to date
+                    lanevec data = vload(psw + offs);
+                    data = vor(vand(data, vsplat(0xFE)), vparity(vload(accum + offs)));
+                    vstore((psw + offs), vselect(lane_mask, data, vload(psw + offs)));
+                    return data;
+                }
+                case AccessPort:
+                {
+                    lanevec data = vload(target + offs);
+                    return is_rmw ? data : vand(data, vload(input + offs));
+                }
+                case AccessUnused: return vsplat(0xFF);
+                default: return vload(target + offs);
+            }
+        };
+
+        auto writedirect = [&](size_t offs, lanevec lane_mask, lanevec data)
+        {
+            vstore((target + offs), vselect(lane_mask, data, vload(target + offs)));
+        };
+
+        switch (instr.kind)
+        {
+            case LaneMovAImm:
+            {
+                lanevec data = vsplat(instr.instr.operands[0]);
+
+                for (size_t offs = group.first; offs < group.last; offs += vec_width)
+                {
+                    lanevec lane_mask = vload(mask + offs);
+                    vstore((accum + offs), vselect(lane_mask, data, vload(accum + offs)));
+                }
+            }
+            break;
+            case LaneMovDirImm:
+            {
+                lanevec data = vsplat(instr.instr.operands[1]);
+
+                for (size_t offs = group.first; offs < group.last; offs += vec_width)
+                {
+                    writedirect(offs, vload(mask + offs), data);
+                }
+            }
+            break;
+            case LaneMovDirA:
+            {
+                for (size_t offs = group.first; offs < group.last; offs += vec_width)
+                {
+                    writedirect(offs, vload(mask + offs), vload(accum + offs));
+                }
+            }
+            break;
+            case LaneAddDir:
+            {
+                for (size_t offs = group.first; offs < group.last; offs += vec_width)
+                {
+                    lanevec lane_mask = vload(mask + offs);
+                    lanevec data = readdirect(offs, lane_mask);
+                    lanevec value = vload(accum + offs);
+                    lanevec result = vadd(value, data);
+
+                    // Carries into each bit, and out of bit 7
+                    lanevec carries = vxor(vxor(value, data), result);
+                    lanevec carry = vand(vor(vand(value, data), vandnot(result, vor(value, data))), vsplat(0x80));
+                    lanevec half = vand(vshl<2>(carries), vsplat(0x40));
+                    lanevec overflow = vand(vshr<5>(vxor(carries, carry)), vsplat(0x04));
+                    lanevec flags = vor(vand(vload(psw + offs), vsplat(0x3B)), vor(carry, vor(half, overflow)));
+
+                    vstore((accum + offs), vselect(lane_mask, result, value));
+                    vstore((psw + offs), vselect(lane_mask, flags, vload(psw + offs)));
+                }
+            }
+            break;
+            case LaneClrBit:
+            case LaneSetbBit:
+            {
+                lanevec bit = vsplat(instr.bit_mask);
+
+                for (size_t offs = group.first; offs < group.last; offs += vec_width)
+                {
+                    lanevec lane_mask = vload(mask + offs);
+                    lanevec data = readdirect(offs, lane_mask);
+                    data = (instr.kind == LaneSetbBit) ? vor(data, bit) : vandnot(bit, data);
+                    writedirect(offs, lane_mask, data);
+                }
+            }
+            break;
+            default: break;
+        }
+
+        if ((access.kind == AccessPSW) && (instr.kind != LaneAddDir))
+        {
+            updatebanks();
+        }
+    }
+
+    void Bee8051Lockstep::stepregister(lanegroup &group, const laneinstr &instr)
+    {
+        int reg = (instr.instr.opcode & 7);
+        bool is_imm = (instr.kind == LaneMovRnImm);
+        uint8_t *accum = row(0x1E0);
+
+        if (common_bank >= 0)
+        {
+            const uint8_t *mask = group.mask.data();
+            uint8_t *target = row(common_bank | reg);
+            lanevec imm = vsplat(instr.instr.operands[0]);
+
+            for (size_t offs = group.first; offs < group.last; offs += vec_width)
+            {
+                lanevec data = is_imm ? imm : vload(accum + offs);
+                vstore((target + offs), vselect(vload(mask + offs), data, vload(target + offs)));
+            }
+
+            return;
+        }
+
+        size_t end = min(group.last, lane_count);
+
+        for (size_t lane = group.first; lane < end; lane++)
+        {
+            if (group.mask[lane])
+            {
+                row(lanebank(lane) | reg)[lane] = is_imm ? instr.instr.operands[0] : accum[lane];
+            }
+        }
+    }
+
+    // The address comes from each lane's own register, so this goes
+    // lane by lane
+    void Bee8051Lockstep::stepindirect(lanegroup &group, const laneinstr &instr)
+    {
+        int reg = (instr.instr.opcode & 1);
+        const uint8_t *accum = row(0x1E0);
+        size_t end = min(group.last, lane_count);
+
+        for (size_t lane = group.first; lane < end; lane++)
+        {
+            if (!group.mask[lane])
+            {
+                continue;
+            }
+
+            uint8_t addr = row(lanebank(lane) | reg)[lane];
+
+            if (addr < core.ram_size)
+            {
+                row(addr)[lane] = accum[lane];
+            }
+        }
+    }
+
+    void Bee8051Lockstep::stepdjnz(size_t index, const laneinstr &instr)
+    {
+        int reg = (instr.instr.opcode & 7);
+        uint16_t next_pc = (groups[index].pc + instr.instr.length);
+        uint16_t target_pc = (next_pc + int8_t(instr.instr.operands[0]));
+
+        vector<uint8_t> taken;
+
+        if (!spare_masks.empty())
+        {
+            taken = move(spare_masks.back());
+            spare_masks.pop_back();
+        }
+        else
+        {
+            taken.assign(stride, 0);
+        }
+
+        lanegroup &group = groups[index];
+        uint8_t *mask = group.mask.data();
+        bool is_any_taken = false;
+        bool is_any_staying = false;
+
+        if (common_bank >= 0)
+        {
+            uint8_t *counter = row(common_bank | reg);
+            lanevec any_taken = vsplat(0);
+            lanevec any_staying = vsplat(0);
+
+            for (size_t offs = group.first; offs < group.last; offs += vec_width)
+            {
+                lanevec lane_mask = vload(mask + offs);
+                lanevec data = vload(counter + offs);
+                lanevec result = vadd(data, vsplat(0xFF));
+                lanevec is_taken = vandnot(viszero(result), lane_mask);
+                lanevec is_staying = vandnot(is_taken, lane_mask);
+
+                vstore((counter + offs), vselect(lane_mask, result, data));
+                vstore((taken.data() + offs), is_taken);
+                vstore((mask + offs), is_staying);
+                any_taken = vor(any_taken, is_taken);
+                any_staying = vor(any_staying, is_staying);
+            }
+
+            is_any_taken = vany(any_taken);
+            is_any_staying = vany(any_staying);
+        }
+        else
+        {
+            size_t end = min(group.last, lane_count);
+
+            for (size_t lane = group.first; lane < end; lane++)
+            {
+                if (!mask[lane])
+                {
+                    continue;
+                }
+
+                uint8_t &counter = row(lanebank(lane) | reg)[lane];
+                counter -= 1;
+
+                if (counter != 0)
+                {
+                    taken[lane] = 0xFF;
+                    mask[lane] = 0;
+                    is_any_taken = true;
+                }
+                else
+                {
+                    is_any_staying = true;
+                }
+            }
+        }
+
+        if (!is_any_taken)
+        {
+            group.pc = next_pc;
+            spare_masks.push_back(move(taken));
+        }
+        else if (!is_any_staying)
+        {
+            group.mask.swap(taken);
+            group.pc = target_pc;
+            spare_masks.push_back(move(taken));
+        }
+        else
+        {
+            lanegroup split;
+            split.pc = target_pc;
+            split.mask = move(taken);
+            split.first = group.first;
+            split.last = group.last;
+            split.debt = group.debt;
+            split.min_budget = group.min_budget;
+            group.pc = next_pc;
+
+            groups.push_back(move(split));
+            retire(groups.size() - 1);
+        }
+
+        retire(index);
+    }
+
+    void Bee8051Lockstep::stepreti(size_t index)
+    {
+        lanegroup &group = groups[index];
+        uint8_t *sp_row = row(0x181);
+        size_t end = min(group.last, lane_count);
+        moved_lanes.clear();
+
+        for (size_t lane = group.first; lane < end; lane++)
+        {
+            if (!group.mask[lane])
+            {
+                continue;
+            }
+
+            uint8_t sp = sp_row[lane];
+            uint8_t high = (sp < core.ram_size) ? row(sp)[lane] : 0xFF;
+            sp -= 1;
+            uint8_t low = (sp < core.ram_size) ? row(sp)[lane] : 0xFF;
+            sp -= 1;
+            sp_row[lane] = sp;
+
+            lane_pcs[lane] = ((high << 8) | low);
+            lane_budgets[lane] -= group.debt;
+
+            if (lane_budgets[lane] > 0)
+            {
+                moved_lanes.push_back(lane);
+            }
+        }
+
+        freegroup(index);
+
+        for (size_t lane : moved_lanes)
+        {
+            addlane(lane);
+        }
+    }
+
+    // Idle loops are run out for each lane in one go, the same way as
+    // BeeMCS51::skipidle(); for djnz rn, $ that means the lanes whose
+    // counter runs out carry on as a group at the next instruction
+    void Bee8051Lockstep::stepidle(size_t index, const laneinstr &instr)
+    {
+        lanegroup &group = groups[index];
+        int64_t instr_cycles = instr.cycles;
+        bool is_djnz = (instr.kind == LaneDjnz);
+        int reg = (instr.instr.opcode & 7);
+        uint16_t next_pc = (group.pc + instr.instr.length);
+        size_t end = min(group.last, lane_count);
+
+        for (size_t lane = group.first; lane < end; lane++)
+        {
+            if (!group.mask[lane])
+            {
+                continue;
+            }
+
+            int64_t budget = (lane_budgets[lane] - group.debt);
+            int64_t count = max<int64_t>(1, ((budget + instr_cycles - 1) / instr_cycles));
+            uint16_t pc = group.pc;
+
+            if (is_djnz)
+            {
+                uint8_t &counter = row(lanebank(lane) | reg)[lane];
+                int remaining = (counter == 0) ? 256 : counter;
+
+                if (count >= remaining)
+                {
+                    count = remaining;
+                    pc = next_pc;
+                }
+
+                counter = uint8_t(counter - count);
+            }
+
+            // Keep the debt on the lanes that carry on, as settle()
+            // takes it off below
+            lane_budgets[lane] -= (count * instr_cycles);
+            lane_pcs[lane] = pc;
+
+            if ((lane_budgets[lane] - group.debt) <= 0)
+            {
+                lane_budgets[lane] -= group.debt;
+                group.mask[lane] = 0;
+            }
+        }
+
+        group.pc = next_pc;
+
+        if (settle(index) == 0)
+        {
+            freegroup(index);
+        }
+    }
+};
@@ -0,0 +1,198 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_LOCKSTEP_H
+#define BEE8051_LOCKSTEP_H
+
+#include "bee8051.h"
+using namespace std;
+
+namespace bee8051
+{
+    // Runs many copies of one program side by side, one instruction
+    // dispatch at a time for every lane that is at the same address
+    //
+    // IRAM and SFRs are stored as one row of bytes per address with a
+    // column per lane, so an instruction with direct operands is a few
+    // vector operations across all lanes (AVX2 when the library is built
+    // with BEE8051_AVX2, SSE2 on other x86-64 builds, plain bytes
+    // elsewhere). Lanes at the same PC form a group; a DJNZ that goes
+    // both ways splits its group, the group with the lowest PC runs
+    // next, and groups that reach the same PC merge again.
+    //
+    // Lanes model the CPU, IRAM, SFR storage and the port latches and
+    // input pins, without the host port callbacks, timers, serial port
+    // or interrupts. A lane that reaches an instruction touching any
+    // other hooked SFR stops and is flagged as faulted, as does one
+    // that reaches an opcode the core does not implement.
+    class Bee8051Lockstep
+    {
+        public:
+            // Every lane starts as a copy of the core's current CPU state;
+            // the core also provides the ROM, and must outlive the engine
+            Bee8051Lockstep(BeeMCS51 &cpu, size_t count);
+            ~Bee8051Lockstep();
+
+            size_t getLaneCount();
+
+            // Runs every lane that has not faulted for the given number
+            // of clock cycles from where it is, with the same stopping
+            // point as BeeMCS51::run()
+            void run(int64_t cycles);
+
+            // Must be called whenever the contents of program memory change
+            void invalidateROM();
+
+            // Per-lane access to IRAM (0x00-0xFF) and SFRs (0x180-0x1FF
+            // for SFR 0x80-0xFF), as laid out in the core
+            uint8_t readRAM(size_t lane, uint16_t addr);
+            void writeRAM(size_t lane, uint16_t addr, uint8_t data);
+
+            uint8_t getPSW(size_t lane);
+            uint16_t getPC(size_t lane);
+            int64_t getCycles(size_t lane);
+            bool isFaulted(size_t lane);
+
+            // What the lane reads on a port's input pins; 0xFF unless the
+            // core had published an input with setPortInput()
+            void setPortInput(size_t lane, int port, uint8_t data);
+
+            // Number of group dispatches during the last run(), to see
+            // how well the lanes stay together
+            int64_t getDispatchCount();
+
+        private:
+            BeeMCS51 &core;
+
+            size_t lane_count = 0;
+            size_t stride = 0;
+
+            // Lane rows, stride bytes each: IRAM and SFRs first, then the
+            // port input pins
+            vector<uint8_t> lane_mem;
+            vector<uint16_t> lane_pcs;
+            vector<int64_t> lane_cycles;
+            vector<int64_t> lane_budgets;
+            vector<uint8_t> lane_faults;
+
+            uint8_t *row(int addr)
+            {
+                return &lane_mem[addr * stride];
+            }
+
+            uint8_t *inputrow(int port)
+            {
+                return &lane_mem[(0x200 + port) * stride];
+            }
+
+            enum accesskind : uint8_t
+            {
+                AccessRAM = 0,
+                AccessPSW,
+                AccessPort,
+                AccessUnused,
+            };
+
+            struct laneaccess
+            {
+                accesskind kind = AccessRAM;
+                uint16_t addr = 0;
+                uint8_t port = 0;
+                bool is_read_hooked = false;
+                bool is_write_hooked = false;
+            };
+
+            enum lanekind : uint8_t
+            {
+                LaneUnknown = 0,
+                LaneLjmp,
+                LaneSjmp,
+                LaneAddDir,
+                LaneMovAImm,
+                LaneMovDirImm,
+                LaneMovRnImm,
+                LaneMovRnA,
+                LaneMovDirA,
+                LaneMovIndA,
+                LaneClrBit,
+                LaneSetbBit,
+                LaneDjnz,
+                LaneReti,
+            };
+
+            struct laneinstr
+            {
+                lanekind kind = LaneUnknown;
+                bool is_hooked = false;
+                laneaccess access;
+                uint8_t bit_mask = 0;
+                int64_t cycles = 0;
+                mcs51instr instr;
+            };
+
+            vector<laneinstr> instr_cache;
+            vector<bool> is_decoded;
+
+            const laneinstr &fetch(uint16_t addr);
+            laneaccess classify(uint8_t addr);
+
+            // Lanes at the same PC; lanes only leave a group between
+            // instructions, and the cycles the group has run since its
+            // lanes' budgets were last brought up to date are kept in
+            // debt, so that is only done once some lane may be out of
+            // budget, i.e. when debt reaches min_budget
+            struct lanegroup
+            {
+                uint16_t pc = 0;
+                vector<uint8_t> mask;
+                size_t first = 0;
+                size_t last = 0;
+                int64_t debt = 0;
+                int64_t min_budget = 0;
+            };
+
+            vector<lanegroup> groups;
+            vector<vector<uint8_t>> spare_masks;
+            int64_t dispatch_count = 0;
+
+            // Register bank shared by every lane, or -1 if they differ
+            int common_bank = 0;
+            void updatebanks();
+            uint8_t lanebank(size_t lane);
+
+            vector<size_t> moved_lanes;
+
+            size_t newgroup(uint16_t pc);
+            void freegroup(size_t index);
+            void addlane(size_t lane);
+            void combine(size_t index, size_t from);
+            size_t settle(size_t index);
+            void retire(size_t index);
+            void fault(size_t index);
+
+            void step(size_t index);
+            void stepidle(size_t index, const laneinstr &instr);
+            void stepdjnz(size_t index, const laneinstr &instr);
+            void stepreti(size_t index);
+            void stepregister(lanegroup &group, const laneinstr &instr);
+            void stepindirect(lanegroup &group, const laneinstr &instr);
+            void stepdirect(lanegroup &group, const laneinstr &instr);
+    };
+};
+
+#endif // BEE8051_LOCKSTEP_H
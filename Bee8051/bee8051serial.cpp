@@ -0,0 +1,325 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bee8051serial.h"
+#include "bee8051timer.h"
+#include "bee8051state.h"
+#include <cstring>
+using namespace bee8051;
+
+namespace bee8051
+{
+    static constexpr size_t serial_buffer_size = 0x400;
+
+    Bee8051Ring::Bee8051Ring(size_t capacity) : head(0), tail(0)
+    {
+        resize(capacity);
+    }
+
+    void Bee8051Ring::resize(size_t capacity)
+    {
+        size_t size = 1;
+
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+
+        buffer.assign(size, 0);
+        buffer.shrink_to_fit();
+        mask = (size - 1);
+        clear();
+    }
+
+    void Bee8051Ring::clear()
+    {
+        head.store(0);
+        tail.store(0);
+    }
+
+    size_t Bee8051Ring::push(const uint8_t *data, size_t size)
+    {
+        size_t write_pos = tail.load(memory_order_relaxed);
+        size_t read_pos = head.load(memory_order_acquire);
+
+        size_t count = min(size, (buffer.size() - (write_pos - read_pos)));
+        size_t offs = (write_pos & mask);
+        size_t first = min(count, (buffer.size() - offs));
+
+        memcpy(&buffer[offs], data, first);
+        memcpy(&buffer[0], (data + first), (count - first));
+
+        tail.store((write_pos + count), memory_order_release);
+        return count;
+    }
+
+    size_t Bee8051Ring::pop(uint8_t *data, size_t size)
+    {
+        size_t read_pos = head.load(memory_order_relaxed);
+        size_t write_pos = tail.load(memory_order_acquire);
+
+        size_t count = min(size, (write_pos - read_pos));
+        size_t offs = (read_pos & mask);
+        size_t first = min(count, (buffer.size() - offs));
+
+        memcpy(data, &buffer[offs], first);
+        memcpy((data + first), &buffer[0], (count - first));
+
+        head.store((read_pos + count), memory_order_release);
+        return count;
+    }
+
+    Bee8051Serial::Bee8051Serial(BeeMCS51 &cpu) : core(cpu), tx_ring(serial_buffer_size), rx_ring(serial_buffer_size)
+    {
+
+    }
+
+    Bee8051Serial::~Bee8051Serial()
+    {
+
+    }
+
+    void Bee8051Serial::init()
+    {
+        tx_ring.clear();
+        rx_ring.clear();
+        tx_data = 0;
+        rx_data = 0;
+        is_sending = false;
+        is_receiving = false;
+        tx_overflows = 0;
+        rx_overflows = 0;
+        core.cancelevent(BeeMCS51::EventSerialTx);
+        core.cancelevent(BeeMCS51::EventSerialRx);
+
+        core.writeRAM(0x187, 0);
+        core.writeRAM(0x198, 0);
+        core.writeRAM(0x199, 0);
+
+        core.registerSFR(0x87); // pcon
+
+        core.registerSFR(0x98, NULL, [&](uint8_t, uint8_t)
+        {
+            schedulerx();
+            core.updateirq();
+        }); // scon
+
+        core.registerSFR(0x99, NULL, [&](uint8_t, uint8_t data)
+        {
+            // Reads of SBUF return the receive buffer, while writes
+            // go to the transmitter and start a new frame
+            core.writeRAM(0x199, rx_data);
+            tx_data = data;
+            starttx();
+        }); // sbuf
+    }
+
+    void Bee8051Serial::event(int id)
+    {
+        if (id == BeeMCS51::EventSerialTx)
+        {
+            if (tx_ring.push(&tx_data, 1) == 0)
+            {
+                starttx();
+                return;
+            }
+
+            is_sending = false;
+            core.writeRAM(0x198, core.setbit(core.readRAM(0x198), 1)); // ti
+        }
+        else
+        {
+            is_receiving = false;
+            uint8_t data = 0;
+
+            // The receiver samples the line once per frame, and only
+            // finds a byte there if the host has queued one
+            if (rx_ring.pop(&data, 1) != 0)
+            {
+                rx_data = data;
+                core.writeRAM(0x199, rx_data);
+
+                uint8_t scon = core.setbit(core.readRAM(0x198), 0); // ri
+
+                // RB8 gets the stop bit, or the 9th bit in modes 2 and 3,
+                // which is always 1 as the host only queues 8-bit data
+                if ((scon >> 6) != 0)
+                {
+                    scon = core.setbit(scon, 2);
+                }
+
+                core.writeRAM(0x198, scon);
+            }
+
+            schedulerx();
+        }
+
+        core.updateirq();
+    }
+
+    void Bee8051Serial::baudchanging()
+    {
+        if (!isbaudtimer())
+        {
+            return;
+        }
+
+        if (is_sending)
+        {
+            tx_overflows = overflowsleft(BeeMCS51::EventSerialTx, tx_overflows);
+        }
+
+        if (is_receiving)
+        {
+            rx_overflows = overflowsleft(BeeMCS51::EventSerialRx, rx_overflows);
+        }
+    }
+
+    void Bee8051Serial::baudchanged()
+    {
+        if (!isbaudtimer())
+        {
+            return;
+        }
+
+        // A frame with no overflows left is due now, and keeps its time
+        if (is_sending && (tx_overflows > 0))
+        {
+            core.scheduleevent(BeeMCS51::EventSerialTx, core.timers->overflowtime(1, tx_overflows));
+        }
+
+        if (is_receiving && (rx_overflows > 0))
+        {
+            core.scheduleevent(BeeMCS51::EventSerialRx, core.timers->overflowtime(1, rx_overflows));
+        }
+    }
+
+    void Bee8051Serial::setbuffersize(size_t size)
+    {
+        tx_ring.resize(size);
+        rx_ring.resize(size);
+    }
+
+    size_t Bee8051Serial::read(uint8_t *data, size_t size)
+    {
+        return tx_ring.pop(data, size);
+    }
+
+    size_t Bee8051Serial::write(const uint8_t *data, size_t size)
+    {
+        return rx_ring.push(data, size);
+    }
+
+    // The rings belong to the host side and are left as they are
+    void Bee8051Serial::savestate(Bee8051StateWriter &writer)
+    {
+        writer.put(tx_data);
+        writer.put(rx_data);
+        writer.put(is_sending);
+        writer.put(is_receiving);
+        writer.put(tx_overflows);
+        writer.put(rx_overflows);
+    }
+
+    void Bee8051Serial::loadstate(Bee8051StateReader &reader)
+    {
+        reader.get(tx_data);
+        reader.get(rx_data);
+        reader.get(is_sending);
+        reader.get(is_receiving);
+        reader.get(tx_overflows);
+        reader.get(rx_overflows);
+    }
+
+    // Starts a frame on the transmitter, which waits for Timer 1 to run
+    // if it is the baud rate generator and is stopped
+    void Bee8051Serial::starttx()
+    {
+        is_sending = true;
+        tx_overflows = frameoverflows();
+        core.scheduleevent(BeeMCS51::EventSerialTx, frameend());
+    }
+
+    // Reception runs while REN is set and RI is clear
+    void Bee8051Serial::schedulerx()
+    {
+        uint8_t scon = core.readRAM(0x198);
+
+        if (!core.testbit(scon, 4) || core.testbit(scon, 0))
+        {
+            is_receiving = false;
+            core.cancelevent(BeeMCS51::EventSerialRx);
+            return;
+        }
+
+        // A frame waiting on a stopped Timer 1 starts over, in case the
+        // mode has changed to one that does not need it
+        if (!is_receiving || (core.event_times[BeeMCS51::EventSerialRx] == INT64_MAX))
+        {
+            is_receiving = true;
+            rx_overflows = frameoverflows();
+            core.scheduleevent(BeeMCS51::EventSerialRx, frameend());
+        }
+    }
+
+    // Modes 1 and 3 take their baud rate from Timer 1
+    bool Bee8051Serial::isbaudtimer()
+    {
+        return core.testbit(core.readRAM(0x198), 6);
+    }
+
+    // Timer 1 overflows a frame takes in modes 1 and 3; each bit takes 16
+    // with SMOD set, or 32 without
+    int64_t Bee8051Serial::frameoverflows()
+    {
+        uint8_t scon = core.readRAM(0x198);
+        bool is_smod = core.testbit(core.readRAM(0x187), 7);
+        int bits = ((scon >> 6) == 1) ? 10 : 11;
+        return (bits * (is_smod ? 16 : 32));
+    }
+
+    // When a frame started now would end, or INT64_MAX if the baud rate
+    // generator is stopped
+    int64_t Bee8051Serial::frameend()
+    {
+        uint8_t scon = core.readRAM(0x198);
+        bool is_smod = core.testbit(core.readRAM(0x187), 7);
+        int64_t cycles = core.getcycles();
+
+        switch (scon >> 6)
+        {
+            case 0: return (cycles + (8 * 12));
+            case 2: return (cycles + (11 * (is_smod ? 32 : 64)));
+            default: return core.timers->overflowtime(1, frameoverflows());
+        }
+    }
+
+    // Overflows left until a frame ends at the rate Timer 1 runs at now;
+    // a frame waiting on a stopped Timer 1 still has all of its own to go
+    int64_t Bee8051Serial::overflowsleft(int id, int64_t overflows)
+    {
+        int64_t time = core.event_times[id];
+
+        if (time == INT64_MAX)
+        {
+            return overflows;
+        }
+
+        return core.timers->overflowsby(1, time);
+    }
+};
@@ -0,0 +1,112 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_SERIAL_H
+#define BEE8051_SERIAL_H
+
+#include "bee8051.h"
+#include <atomic>
+using namespace std;
+
+namespace bee8051
+{
+    // Byte queue with a single producer and a single consumer, which may
+    // be on different threads; neither side ever takes a lock
+    class Bee8051Ring
+    {
+        public:
+            Bee8051Ring(size_t capacity);
+
+            // Rounds the capacity up to a power of two and empties the
+            // ring; only safe while neither side is using it
+            void resize(size_t capacity);
+            void clear();
+
+            size_t push(const uint8_t *data, size_t size);
+            size_t pop(uint8_t *data, size_t size);
+
+        private:
+            vector<uint8_t> buffer;
+            size_t mask = 0;
+
+            // Free-running positions; only the producer moves tail and
+            // only the consumer moves head
+            atomic<size_t> head;
+            atomic<size_t> tail;
+    };
+
+    // Serial port (SCON, SBUF, SMOD in PCON), in all four modes
+    //
+    // Transmitted bytes go into a ring the host drains in bulk, and
+    // received bytes come from a ring the host fills. A byte only takes
+    // effect once its whole frame has gone by; in modes 1 and 3 that is
+    // measured in Timer 1 overflows. When the host falls behind on
+    // draining, the transmitter holds off on setting TI rather than
+    // dropping bytes.
+    class Bee8051Serial
+    {
+        public:
+            Bee8051Serial(BeeMCS51 &cpu);
+            ~Bee8051Serial();
+
+            void init();
+
+            // Runs when a frame finishes sending or receiving
+            void event(int id);
+
+            // Run by the timers before and after any change to how fast
+            // Timer 1 overflows; frames in modes 1 and 3 keep the number
+            // of overflows they still had to go, and are rescheduled at
+            // the new rate, or started once Timer 1 starts running
+            void baudchanging();
+            void baudchanged();
+
+            void setbuffersize(size_t size);
+            size_t read(uint8_t *data, size_t size);
+            size_t write(const uint8_t *data, size_t size);
+
+            void savestate(Bee8051StateWriter &writer);
+            void loadstate(Bee8051StateReader &reader);
+
+        private:
+            BeeMCS51 &core;
+
+            Bee8051Ring tx_ring;
+            Bee8051Ring rx_ring;
+
+            uint8_t tx_data = 0;
+            uint8_t rx_data = 0;
+            bool is_sending = false;
+            bool is_receiving = false;
+
+            // Timer 1 overflows left until each frame ends, in modes 1
+            // and 3; only kept up to date while Timer 1 is changing or
+            // stopped, as the scheduled times cover the rest
+            int64_t tx_overflows = 0;
+            int64_t rx_overflows = 0;
+
+            bool isbaudtimer();
+            int64_t frameoverflows();
+            int64_t frameend();
+            int64_t overflowsleft(int id, int64_t overflows);
+            void starttx();
+            void schedulerx();
+    };
+};
+
+#endif // BEE8051_SERIAL_H
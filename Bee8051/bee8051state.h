@@ -0,0 +1,101 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_STATE_H
+#define BEE8051_STATE_H
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+using namespace std;
+
+namespace bee8051
+{
+    // Copies fields into a caller-provided buffer, in native byte order;
+    // with no buffer it only counts the bytes that would be written
+    class Bee8051StateWriter
+    {
+        public:
+            Bee8051StateWriter(uint8_t *buffer, size_t size) : data(buffer), capacity(size)
+            {
+
+            }
+
+            template<typename T>
+            void put(const T &value)
+            {
+                static_assert(is_trivially_copyable<T>::value, "State fields must be trivially copyable");
+
+                if ((data != NULL) && ((count + sizeof(T)) <= capacity))
+                {
+                    memcpy((data + count), &value, sizeof(T));
+                }
+
+                count += sizeof(T);
+            }
+
+            size_t size() const
+            {
+                return count;
+            }
+
+            bool isValid() const
+            {
+                return ((data != NULL) && (count <= capacity));
+            }
+
+        private:
+            uint8_t *data = NULL;
+            size_t capacity = 0;
+            size_t count = 0;
+    };
+
+    class Bee8051StateReader
+    {
+        public:
+            Bee8051StateReader(const uint8_t *buffer, size_t size) : data(buffer), capacity(size)
+            {
+
+            }
+
+            template<typename T>
+            void get(T &value)
+            {
+                static_assert(is_trivially_copyable<T>::value, "State fields must be trivially copyable");
+
+                if ((count + sizeof(T)) <= capacity)
+                {
+                    memcpy(&value, (data + count), sizeof(T));
+                }
+
+                count += sizeof(T);
+            }
+
+            bool isValid() const
+            {
+                return (count <= capacity);
+            }
+
+        private:
+            const uint8_t *data = NULL;
+            size_t capacity = 0;
+            size_t count = 0;
+    };
+};
+
+#endif // BEE8051_STATE_H
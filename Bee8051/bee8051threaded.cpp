@@ -0,0 +1,614 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bee8051threaded.h"
+#include <algorithm>
+using namespace bee8051;
+
+// Dispatch through a table of label addresses where the compiler supports
+// it, and through a switch in a loop everywhere else
+#if defined(__GNUC__) || defined(__clang__)
+#define BEE8051_COMPUTED_GOTO
+#endif
+
+namespace bee8051
+{
+    static constexpr int max_block_ops = 64;
+
+    Bee8051Threaded::Bee8051Threaded(BeeMCS51 &cpu) : core(cpu)
+    {
+        blocks.resize(0x10000);
+        is_unsupported.assign(0x10000, false);
+    }
+
+    Bee8051Threaded::~Bee8051Threaded()
+    {
+
+    }
+
+    void Bee8051Threaded::flush()
+    {
+        is_dirty = true;
+    }
+
+    void Bee8051Threaded::reset()
+    {
+        for (auto &block : blocks)
+        {
+            block.reset();
+        }
+
+        fill(is_unsupported.begin(), is_unsupported.end(), false);
+        is_dirty = false;
+    }
+
+    // Runs the core's current slice, counting down its budget in place
+    void Bee8051Threaded::run()
+    {
+        while ((core.slice_budget > 0) && !core.is_stop_requested)
+        {
+            threadblock *block = getblock(core.pc);
+
+            if (block == NULL)
+            {
+                core.runinstr();
+                continue;
+            }
+
+            execute(block);
+        }
+    }
+
+    Bee8051Threaded::threadblock *Bee8051Threaded::getblock(uint16_t addr)
+    {
+        if (is_dirty)
+        {
+            reset();
+        }
+
+        if (blocks[addr])
+        {
+            return blocks[addr].get();
+        }
+
+        if (is_unsupported[addr])
+        {
+            return NULL;
+        }
+
+        return compile(addr);
+    }
+
+    bool Bee8051Threaded::issupported(const mcs51instr &instr)
+    {
+        // Idle loops are left to the interpreter, which skips them whole
+        if (instr.is_idle)
+        {
+            return false;
+        }
+
+        switch (instr.opcode)
+        {
+            case 0x02:
+            case 0x25:
+            case 0x74:
+            case 0x75:
+            case 0x80:
+            case 0xC2:
+            case 0xD2:
+            case 0xF5:
+            case 0xF6:
+            case 0xF7: return true;
+            default: break;
+        }
+
+        switch (instr.opcode & 0xF8)
+        {
+            case 0x78:
+            case 0xD8:
+            case 0xF8: return true;
+            default: return false;
+        }
+    }
+
+    bool Bee8051Threaded::isplainsfr(uint8_t addr)
+    {
+        return core.sfr_table[addr & 0x7F].is_plain;
+    }
+
+    // Direct addresses that can be accessed without going through a
+    // handler; IRAM past the end of a small part is left to the handlers,
+    // which are the ones that check bounds
+    bool Bee8051Threaded::isinlinedirect(uint8_t addr)
+    {
+        return (addr < 0x80) ? (addr < core.ram_size) : isplainsfr(addr);
+    }
+
+    static uint16_t direct_offset(uint8_t addr)
+    {
+        return (addr < 0x80) ? addr : (0x100 | addr);
+    }
+
+    Bee8051Threaded::threadop Bee8051Threaded::translate(const mcs51instr &instr, uint16_t pc)
+    {
+        threadop op;
+        op.kind = OpGeneric;
+        op.instr = instr;
+        op.cycles = (instr.cycles * 12);
+        op.pc = pc;
+        op.next_pc = (pc + instr.length);
+        op.reg = (instr.opcode & 0x7);
+
+        bool is_plain_accum = isplainsfr(0xE0);
+
+        switch (instr.opcode)
+        {
+            case 0x25:
+            {
+                if (isinlinedirect(instr.operands[0]) && is_plain_accum)
+                {
+                    op.kind = OpAddDir;
+                    op.addr = direct_offset(instr.operands[0]);
+                }
+            }
+            break; // add a, data addr
+            case 0x74:
+            {
+                if (is_plain_accum)
+                {
+                    op.kind = OpMovAImm;
+                    op.data = instr.operands[0];
+                }
+            }
+            break; // mov a, #data
+            case 0x75:
+            {
+                if (isinlinedirect(instr.operands[0]))
+                {
+                    op.kind = OpMovDirImm;
+                    op.addr = direct_offset(instr.operands[0]);
+                    op.data = instr.operands[1];
+                }
+            }
+            break; // mov data addr, #data
+            case 0xC2:
+            case 0xD2:
+            {
+                uint8_t addr = instr.operands[0];
+                int word = (((addr & 0x78) >> 3) + 0x20);
+
+                if ((addr < 0x80) && (word < core.ram_size))
+                {
+                    op.kind = (instr.opcode == 0xD2) ? OpSetbBit : OpClrBit;
+                    op.addr = word;
+                    op.data = (1 << (addr & 0x7));
+                }
+            }
+            break; // clr/setb bit addr
+            case 0xF5:
+            {
+                if (isinlinedirect(instr.operands[0]) && is_plain_accum)
+                {
+                    op.kind = OpMovDirA;
+                    op.addr = direct_offset(instr.operands[0]);
+                }
+            }
+            break; // mov data addr, a
+            case 0xF6:
+            case 0xF7:
+            {
+                if (is_plain_accum)
+                {
+                    op.kind = OpMovIndA;
+                    op.reg = (instr.opcode & 0x1);
+                }
+            }
+            break; // mov @r0/@r1, a
+            default:
+            {
+                switch (instr.opcode & 0xF8)
+                {
+                    case 0x78:
+                    {
+                        op.kind = OpMovRnImm;
+                        op.data = instr.operands[0];
+                    }
+                    break; // mov r0-r7, #data
+                    case 0xF8:
+                    {
+                        if (is_plain_accum)
+                        {
+                            op.kind = OpMovRnA;
+                        }
+                    }
+                    break; // mov r0-r7, a
+                    default: break;
+                }
+            }
+            break;
+        }
+
+        return op;
+    }
+
+    Bee8051Threaded::threadblock *Bee8051Threaded::compile(uint16_t start)
+    {
+        vector<threadop> ops;
+        vector<uint16_t> visited;
+        uint16_t pc = start;
+        bool is_terminated = false;
+
+        while (!is_terminated && (int(ops.size()) < max_block_ops))
+        {
+            const mcs51instr &instr = core.fetchinstr(pc);
+
+            if (!issupported(instr))
+            {
+                break;
+            }
+
+            visited.push_back(pc);
+            uint16_t next_pc = (pc + instr.length);
+
+            if ((instr.opcode == 0x02) || (instr.opcode == 0x80))
+            {
+                uint16_t target = (instr.opcode == 0x02) ? ((instr.operands[0] << 8) | instr.operands[1]) : (next_pc + int8_t(instr.operands[0]));
+
+                threadop op;
+                op.cycles = (instr.cycles * 12);
+                op.pc = pc;
+
+                // Follow the jump into the same superblock,
+                // unless that would loop back into it
+                if (find(visited.begin(), visited.end(), target) == visited.end())
+                {
+                    op.kind = OpJmpInline;
+                    ops.push_back(op);
+                    pc = target;
+                    continue;
+                }
+
+                op.kind = OpExit;
+                op.target_pc = target;
+                ops.push_back(op);
+                is_terminated = true;
+            } // ljmp/sjmp code addr
+            else if ((instr.opcode & 0xF8) == 0xD8)
+            {
+                threadop op;
+                op.kind = OpDjnz;
+                op.reg = (instr.opcode & 0x7);
+                op.cycles = (instr.cycles * 12);
+                op.pc = pc;
+                op.next_pc = next_pc;
+                op.target_pc = (next_pc + int8_t(instr.operands[0]));
+                ops.push_back(op);
+                is_terminated = true;
+            } // djnz r0-r7, code addr
+            else
+            {
+                ops.push_back(translate(instr, pc));
+                pc = next_pc;
+            }
+        }
+
+        if (ops.empty())
+        {
+            is_unsupported[start] = true;
+            return NULL;
+        }
+
+        if (!is_terminated)
+        {
+            threadop op;
+            op.kind = OpExit;
+            op.pc = pc;
+            op.target_pc = pc;
+            ops.push_back(op);
+        }
+
+        fuse(ops);
+
+        blocks[start] = make_unique<threadblock>();
+        blocks[start]->ops = move(ops);
+        return blocks[start].get();
+    }
+
+    // Replaces common instruction pairs with a single operation; the second
+    // instruction's operand goes in addr2, and next_pc is where it starts
+    void Bee8051Threaded::fuse(vector<threadop> &ops)
+    {
+        vector<threadop> fused;
+
+        for (size_t i = 0; i < ops.size(); i++)
+        {
+            threadop op = ops[i];
+            opkind kind = op.kind;
+
+            if ((i + 1) < ops.size())
+            {
+                opkind next_kind = ops[i + 1].kind;
+
+                if ((op.kind == OpMovAImm) && (next_kind == OpMovDirA))
+                {
+                    kind = OpMovAImmMovDirA;
+                }
+                else if ((op.kind == OpMovAImm) && (next_kind == OpAddDir))
+                {
+                    kind = OpMovAImmAddDir;
+                }
+                else if ((op.kind == OpAddDir) && (next_kind == OpMovDirA))
+                {
+                    kind = OpAddDirMovDirA;
+                }
+            }
+
+            if (kind != op.kind)
+            {
+                const threadop &next = ops[i + 1];
+                op.kind = kind;
+                op.addr2 = next.addr;
+                op.cycles2 = next.cycles;
+                op.next_pc = next.pc;
+                i += 1;
+            }
+
+            fused.push_back(op);
+        }
+
+        ops = move(fused);
+    }
+
+    void Bee8051Threaded::execute(threadblock *block)
+    {
+        int64_t &budget = core.slice_budget;
+        uint8_t *mem = core.internal_mem.data();
+        threadop *op = block->ops.data();
+
+        uint16_t exit_pc = 0;
+        threadblock **exit_block = NULL;
+
+        // Instructions only start while there is budget left, exactly as in
+        // the interpreter, so a run stops at the same point in both modes
+#define BEE8051_NEXT() \
+        op++; \
+        if (budget <= 0) \
+        { \
+            core.pc = op->pc; \
+            return; \
+        } \
+        BEE8051_DISPATCH()
+
+#ifdef BEE8051_COMPUTED_GOTO
+        static const void *labels[OpCount] =
+        {
+            &&label_OpGeneric,
+            &&label_OpMovAImm,
+            &&label_OpMovDirImm,
+            &&label_OpMovRnImm,
+            &&label_OpMovRnA,
+            &&label_OpMovDirA,
+            &&label_OpMovIndA,
+            &&label_OpAddDir,
+            &&label_OpClrBit,
+            &&label_OpSetbBit,
+            &&label_OpJmpInline,
+            &&label_OpMovAImmMovDirA,
+            &&label_OpMovAImmAddDir,
+            &&label_OpAddDirMovDirA,
+            &&label_OpDjnz,
+            &&label_OpExit,
+        };
+
+#define BEE8051_OP(name) label_##name
+#define BEE8051_DISPATCH() goto *labels[op->kind]
+#else
+#define BEE8051_OP(name) case name
+#define BEE8051_DISPATCH() continue
+#endif
+
+        for (;;)
+        {
+#ifdef BEE8051_COMPUTED_GOTO
+            BEE8051_DISPATCH();
+#else
+            switch (op->kind)
+            {
+#endif
+                BEE8051_OP(OpGeneric):
+                {
+                    core.pc = op->next_pc;
+                    budget -= op->cycles;
+                    (core.*(op->instr.handler))(op->instr);
+
+                    if (core.is_stop_requested || is_dirty)
+                    {
+                        return;
+                    }
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpMovAImm):
+                {
+                    mem[0x1E0] = op->data;
+                    budget -= op->cycles;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpMovDirImm):
+                {
+                    mem[op->addr] = op->data;
+                    budget -= op->cycles;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpMovRnImm):
+                {
+                    mem[core.reg_bank | op->reg] = op->data;
+                    budget -= op->cycles;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpMovRnA):
+                {
+                    mem[core.reg_bank | op->reg] = mem[0x1E0];
+                    budget -= op->cycles;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpMovDirA):
+                {
+                    mem[op->addr] = mem[0x1E0];
+                    budget -= op->cycles;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpMovIndA):
+                {
+                    uint8_t addr = mem[core.reg_bank | op->reg];
+
+                    if (addr < core.ram_size)
+                    {
+                        mem[addr] = mem[0x1E0];
+                    }
+
+                    budget -= op->cycles;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpAddDir):
+                {
+                    mem[0x1E0] = core.add_internal(mem[0x1E0], mem[op->addr]);
+                    budget -= op->cycles;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpClrBit):
+                {
+                    mem[op->addr] &= ~op->data;
+                    budget -= op->cycles;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpSetbBit):
+                {
+                    mem[op->addr] |= op->data;
+                    budget -= op->cycles;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpJmpInline):
+                {
+                    budget -= op->cycles;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpMovAImmMovDirA):
+                {
+                    mem[0x1E0] = op->data;
+                    budget -= op->cycles;
+
+                    if (budget <= 0)
+                    {
+                        core.pc = op->next_pc;
+                        return;
+                    }
+
+                    mem[op->addr2] = mem[0x1E0];
+                    budget -= op->cycles2;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpMovAImmAddDir):
+                {
+                    mem[0x1E0] = op->data;
+                    budget -= op->cycles;
+
+                    if (budget <= 0)
+                    {
+                        core.pc = op->next_pc;
+                        return;
+                    }
+
+                    mem[0x1E0] = core.add_internal(mem[0x1E0], mem[op->addr2]);
+                    budget -= op->cycles2;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpAddDirMovDirA):
+                {
+                    mem[0x1E0] = core.add_internal(mem[0x1E0], mem[op->addr]);
+                    budget -= op->cycles;
+
+                    if (budget <= 0)
+                    {
+                        core.pc = op->next_pc;
+                        return;
+                    }
+
+                    mem[op->addr2] = mem[0x1E0];
+                    budget -= op->cycles2;
+                }
+                BEE8051_NEXT();
+                BEE8051_OP(OpDjnz):
+                {
+                    uint8_t &reg = mem[core.reg_bank | op->reg];
+                    reg -= 1;
+                    budget -= op->cycles;
+
+                    if (reg != 0)
+                    {
+                        exit_pc = op->target_pc;
+                        exit_block = &op->target_block;
+                    }
+                    else
+                    {
+                        exit_pc = op->next_pc;
+                        exit_block = &op->next_block;
+                    }
+                }
+                goto block_exit;
+                BEE8051_OP(OpExit):
+                {
+                    budget -= op->cycles;
+                    exit_pc = op->target_pc;
+                    exit_block = &op->target_block;
+                }
+                goto block_exit;
+#ifndef BEE8051_COMPUTED_GOTO
+                default: return;
+            }
+#endif
+
+            // Chain straight into the next block, remembering it in the
+            // exit so the lookup only happens the first time around
+            block_exit:
+            {
+                core.pc = exit_pc;
+
+                if ((budget <= 0) || is_dirty)
+                {
+                    return;
+                }
+
+                if (*exit_block == NULL)
+                {
+                    *exit_block = getblock(exit_pc);
+
+                    if (*exit_block == NULL)
+                    {
+                        return;
+                    }
+                }
+
+                op = (*exit_block)->ops.data();
+            }
+        }
+
+#undef BEE8051_NEXT
+#undef BEE8051_OP
+#undef BEE8051_DISPATCH
+    }
+};
@@ -0,0 +1,112 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_THREADED_H
+#define BEE8051_THREADED_H
+
+#include "bee8051.h"
+using namespace std;
+
+namespace bee8051
+{
+    // Threaded-code translator, used by BeeMCS51 in execmode::Threaded
+    //
+    // ROM is translated into superblocks of pre-decoded operations, which
+    // follow unconditional jumps and end at DJNZ or at the first
+    // instruction the translator does not handle. Common instruction pairs
+    // are fused into single operations, and block exits jump straight into
+    // the next block without going back through run().
+    class Bee8051Threaded
+    {
+        public:
+            Bee8051Threaded(BeeMCS51 &cpu);
+            ~Bee8051Threaded();
+
+            // Safe to call from within a handler running inside a block;
+            // the translations are dropped once control is back in run()
+            void flush();
+
+            void run();
+
+        private:
+            BeeMCS51 &core;
+
+            enum opkind : uint8_t
+            {
+                OpGeneric = 0,
+                OpMovAImm,
+                OpMovDirImm,
+                OpMovRnImm,
+                OpMovRnA,
+                OpMovDirA,
+                OpMovIndA,
+                OpAddDir,
+                OpClrBit,
+                OpSetbBit,
+                OpJmpInline,
+                OpMovAImmMovDirA,
+                OpMovAImmAddDir,
+                OpAddDirMovDirA,
+                OpDjnz,
+                OpExit,
+                OpCount,
+            };
+
+            struct threadblock;
+
+            struct threadop
+            {
+                opkind kind = OpGeneric;
+                uint8_t data = 0;
+                uint8_t reg = 0;
+                uint16_t addr = 0;
+                uint16_t addr2 = 0;
+                int cycles = 0;
+                int cycles2 = 0;
+                uint16_t pc = 0;
+                uint16_t next_pc = 0;
+                uint16_t target_pc = 0;
+                threadblock *next_block = NULL;
+                threadblock *target_block = NULL;
+                mcs51instr instr;
+            };
+
+            struct threadblock
+            {
+                vector<threadop> ops;
+            };
+
+            vector<unique_ptr<threadblock>> blocks;
+            vector<bool> is_unsupported;
+            bool is_dirty = false;
+
+            void reset();
+            threadblock *getblock(uint16_t addr);
+            threadblock *compile(uint16_t addr);
+            void fuse(vector<threadop> &ops);
+
+            bool issupported(const mcs51instr &instr);
+            bool isplainsfr(uint8_t addr);
+            bool isinlinedirect(uint8_t addr);
+            threadop translate(const mcs51instr &instr, uint16_t pc);
+
+            void execute(threadblock *block);
+    };
+};
+
+#endif // BEE8051_THREADED_H
@@ -0,0 +1,394 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bee8051timer.h"
+#include "bee8051serial.h"
+#include "bee8051state.h"
+using namespace bee8051;
+
+namespace bee8051
+{
+    Bee8051Timers::Bee8051Timers(BeeMCS51 &cpu) : core(cpu)
+    {
+
+    }
+
+    Bee8051Timers::~Bee8051Timers()
+    {
+
+    }
+
+    void Bee8051Timers::init()
+    {
+        tl.fill(0);
+        th.fill(0);
+        sync_time = core.getcycles();
+        core.writeRAM(0x188, 0);
+        core.writeRAM(0x189, 0);
+        store();
+
+        core.registerSFR(0x88, [&](uint8_t) -> uint8_t
+        {
+            sync();
+            return core.readRAM(0x188);
+        },
+        [&](uint8_t, uint8_t data)
+        {
+            // Overflows up to now are accounted for before the new
+            // value replaces the flags
+            sync();
+            core.writeRAM(0x188, data);
+            update();
+            core.updateirq();
+        }); // tcon
+
+        core.registerSFR(0x89, NULL, [&](uint8_t, uint8_t)
+        {
+            sync();
+            update();
+        }); // tmod
+
+        for (int sfr = 0x8A; sfr <= 0x8D; sfr++)
+        {
+            core.registerSFR(sfr, [&](uint8_t addr) -> uint8_t
+            {
+                sync();
+                return core.readRAM(0x100 | addr);
+            },
+            [&](uint8_t addr, uint8_t data)
+            {
+                sync();
+                int timer = (addr & 0x1);
+                auto &reg = (addr < 0x8C) ? tl : th;
+
+                // Timer 1 clocks the serial port, which has to reschedule
+                // its frames whenever TL1 or the TH1 reload changes
+                if (timer == 1)
+                {
+                    core.serial->baudchanging();
+                }
+
+                reg[timer] = data;
+                store();
+                schedule();
+
+                if (timer == 1)
+                {
+                    core.serial->baudchanged();
+                }
+            }); // tl0, tl1, th0, th1
+        }
+
+        update();
+    }
+
+    void Bee8051Timers::sync()
+    {
+        int64_t elapsed = ((core.getcycles() - sync_time) / 12);
+
+        if (elapsed <= 0)
+        {
+            return;
+        }
+
+        sync_time += (elapsed * 12);
+        uint8_t flags = 0;
+
+        if (is_timing[0] && (advance(0, elapsed) != 0))
+        {
+            flags |= 0x20;
+        }
+
+        if (is_th0_timing && (advanceth0(elapsed) != 0))
+        {
+            flags |= 0x80;
+        }
+
+        // With timer 0 in mode 3, TH0 has taken over TF1
+        if (is_timing[1] && (advance(1, elapsed) != 0) && (modes[0] != 3))
+        {
+            flags |= 0x80;
+        }
+
+        store();
+
+        if (flags != 0)
+        {
+            core.writeRAM(0x188, (core.readRAM(0x188) | flags));
+            core.updateirq();
+        }
+    }
+
+    void Bee8051Timers::event()
+    {
+        sync();
+        schedule();
+    }
+
+    void Bee8051Timers::acknowledge(int timer)
+    {
+        sync();
+        core.writeRAM(0x188, core.resetbit(core.readRAM(0x188), (timer == 0) ? 5 : 7));
+        schedule();
+    }
+
+    void Bee8051Timers::pulse(int timer, int pulses)
+    {
+        if ((timer < 0) || (timer > 1))
+        {
+            return;
+        }
+
+        sync();
+
+        if (is_counting[timer] && (advance(timer, pulses) != 0))
+        {
+            if (timer == 0)
+            {
+                core.writeRAM(0x188, (core.readRAM(0x188) | 0x20));
+            }
+            else if (modes[0] != 3)
+            {
+                core.writeRAM(0x188, (core.readRAM(0x188) | 0x80));
+            }
+        }
+
+        store();
+        schedule();
+        core.updateirq();
+    }
+
+    void Bee8051Timers::savestate(Bee8051StateWriter &writer)
+    {
+        writer.put(tl);
+        writer.put(th);
+        writer.put(sync_time);
+        writer.put(modes);
+        writer.put(is_timing);
+        writer.put(is_counting);
+        writer.put(is_th0_timing);
+    }
+
+    void Bee8051Timers::loadstate(Bee8051StateReader &reader)
+    {
+        reader.get(tl);
+        reader.get(th);
+        reader.get(sync_time);
+        reader.get(modes);
+        reader.get(is_timing);
+        reader.get(is_counting);
+        reader.get(is_th0_timing);
+    }
+
+    // Works out how each counter is clocked after a change to TMOD or TCON
+    void Bee8051Timers::update()
+    {
+        core.serial->baudchanging();
+        uint8_t tmod = core.readRAM(0x189);
+        uint8_t tcon = core.readRAM(0x188);
+
+        for (int timer = 0; timer < 2; timer++)
+        {
+            uint8_t config = ((tmod >> (timer * 4)) & 0xF);
+            modes[timer] = (config & 0x3);
+
+            bool is_run = core.testbit(tcon, (4 + (timer * 2)));
+            bool is_gate_open = (!core.testbit(config, 3) || core.int_pins[timer]);
+
+            if (timer == 1)
+            {
+                // Timer 1 stops in mode 3, and runs regardless of TR1
+                // while timer 0 is in mode 3 and has taken TR1 over
+                if (modes[1] == 3)
+                {
+                    is_run = false;
+                }
+                else if (modes[0] == 3)
+                {
+                    is_run = true;
+                }
+            }
+
+            bool is_enabled = (is_run && is_gate_open);
+            is_timing[timer] = (is_enabled && !core.testbit(config, 2));
+            is_counting[timer] = (is_enabled && core.testbit(config, 2));
+        }
+
+        is_th0_timing = ((modes[0] == 3) && core.testbit(tcon, 6));
+        schedule();
+        core.serial->baudchanged();
+    }
+
+    // Schedules the next overflow that would set a TFx flag; once a flag
+    // is set, further overflows cannot be observed until it is cleared
+    void Bee8051Timers::schedule()
+    {
+        uint8_t tcon = core.readRAM(0x188);
+
+        if (is_timing[0] && !core.testbit(tcon, 5))
+        {
+            core.scheduleevent(BeeMCS51::EventTimer0, (sync_time + (overflowcounts(0) * 12)));
+        }
+        else
+        {
+            core.cancelevent(BeeMCS51::EventTimer0);
+        }
+
+        int64_t counts = 0;
+
+        if (modes[0] == 3)
+        {
+            counts = (is_th0_timing) ? (0x100 - th[0]) : 0;
+        }
+        else if (is_timing[1])
+        {
+            counts = overflowcounts(1);
+        }
+
+        if ((counts != 0) && !core.testbit(tcon, 7))
+        {
+            core.scheduleevent(BeeMCS51::EventTimer1, (sync_time + (counts * 12)));
+        }
+        else
+        {
+            core.cancelevent(BeeMCS51::EventTimer1);
+        }
+    }
+
+    void Bee8051Timers::store()
+    {
+        core.writeRAM(0x18A, tl[0]);
+        core.writeRAM(0x18B, tl[1]);
+        core.writeRAM(0x18C, th[0]);
+        core.writeRAM(0x18D, th[1]);
+    }
+
+    int64_t Bee8051Timers::overflowtime(int timer, int64_t count)
+    {
+        sync();
+
+        if (!is_timing[timer])
+        {
+            return INT64_MAX;
+        }
+
+        return (sync_time + ((overflowcounts(timer) + ((count - 1) * overflowperiod(timer))) * 12));
+    }
+
+    int64_t Bee8051Timers::overflowsby(int timer, int64_t time)
+    {
+        sync();
+
+        if (!is_timing[timer] || (time == INT64_MAX))
+        {
+            return 0;
+        }
+
+        int64_t counts = ((time - sync_time) / 12);
+        int64_t first_overflow = overflowcounts(timer);
+
+        if (counts < first_overflow)
+        {
+            return 0;
+        }
+
+        return (1 + ((counts - first_overflow) / overflowperiod(timer)));
+    }
+
+    // Counts until the counter next overflows
+    int64_t Bee8051Timers::overflowcounts(int timer)
+    {
+        switch (modes[timer])
+        {
+            case 0: return (0x2000 - ((th[timer] << 5) | (tl[timer] & 0x1F)));
+            case 1: return (0x10000 - ((th[timer] << 8) | tl[timer]));
+            default: return (0x100 - tl[timer]);
+        }
+    }
+
+    // Counts between overflows after the first; only mode 2 reloads, the
+    // others wrap around to zero
+    int64_t Bee8051Timers::overflowperiod(int timer)
+    {
+        switch (modes[timer])
+        {
+            case 0: return 0x2000;
+            case 1: return 0x10000;
+            case 2: return (0x100 - th[timer]);
+            default: return 0x100;
+        }
+    }
+
+    // Advances a counter and returns the number of times it overflowed
+    int64_t Bee8051Timers::advance(int timer, int64_t counts)
+    {
+        switch (modes[timer])
+        {
+            case 0:
+            {
+                // 13-bit counter: TH with the lower 5 bits of TL as a prescaler
+                int64_t value = (((th[timer] << 5) | (tl[timer] & 0x1F)) + counts);
+                th[timer] = ((value >> 5) & 0xFF);
+                tl[timer] = ((tl[timer] & 0xE0) | (value & 0x1F));
+                return (value >> 13);
+            }
+            break;
+            case 1:
+            {
+                int64_t value = (((th[timer] << 8) | tl[timer]) + counts);
+                th[timer] = ((value >> 8) & 0xFF);
+                tl[timer] = (value & 0xFF);
+                return (value >> 16);
+            }
+            break;
+            case 2:
+            {
+                // 8-bit counter in TL, reloaded from TH on overflow
+                int64_t first_overflow = (0x100 - tl[timer]);
+
+                if (counts < first_overflow)
+                {
+                    tl[timer] += counts;
+                    return 0;
+                }
+
+                int64_t period = (0x100 - th[timer]);
+                int64_t remaining = (counts - first_overflow);
+                tl[timer] = (th[timer] + (remaining % period));
+                return (1 + (remaining / period));
+            }
+            break;
+            default:
+            {
+                // TL0 as an 8-bit counter, with timer 0 in mode 3
+                int64_t value = (tl[timer] + counts);
+                tl[timer] = (value & 0xFF);
+                return (value >> 8);
+            }
+            break;
+        }
+    }
+
+    // TH0 as an 8-bit timer, with timer 0 in mode 3
+    int64_t Bee8051Timers::advanceth0(int64_t counts)
+    {
+        int64_t value = (th[0] + counts);
+        th[0] = (value & 0xFF);
+        return (value >> 8);
+    }
+};
@@ -0,0 +1,94 @@
+/*
+    This file is part of Bee8051.
+    Copyright (C) 2022 BueniaDev.
+
+    Bee8051 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Bee8051 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Bee8051.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEE8051_TIMER_H
+#define BEE8051_TIMER_H
+
+#include "bee8051.h"
+using namespace std;
+
+namespace bee8051
+{
+    // Timer 0 and 1 (TMOD, TCON, TL0/TL1, TH0/TH1), in all four modes
+    //
+    // The counters are not advanced after each instruction; they are
+    // brought up to date from the elapsed time whenever the CPU accesses
+    // one of their SFRs, and the only event scheduled is the next
+    // overflow that would set a TFx flag which is still clear.
+    class Bee8051Timers
+    {
+        public:
+            Bee8051Timers(BeeMCS51 &cpu);
+            ~Bee8051Timers();
+
+            void init();
+
+            // Brings the counters and overflow flags up to the current time
+            void sync();
+
+            // Runs when a scheduled overflow is due
+            void event();
+
+            // Re-reads TMOD, TCON and the INTx gate inputs
+            void update();
+
+            // Clears TFx when the CPU vectors to the timer's interrupt
+            void acknowledge(int timer);
+
+            // When the timer will have overflowed count more times, if its
+            // setup stays the same, or INT64_MAX if it is not running
+            int64_t overflowtime(int timer, int64_t count);
+
+            // How many times the timer will have overflowed by the given
+            // time, if its setup stays the same
+            int64_t overflowsby(int timer, int64_t time);
+
+            // Counts edges on the T0/T1 inputs while in counter mode
+            void pulse(int timer, int pulses);
+
+            void savestate(Bee8051StateWriter &writer);
+            void loadstate(Bee8051StateReader &reader);
+
+        private:
+            BeeMCS51 &core;
+
+            array<uint8_t, 2> tl = {{0, 0}};
+            array<uint8_t, 2> th = {{0, 0}};
+
+            // Time the counters were last brought up to, always a
+            // whole number of machine cycles
+            int64_t sync_time = 0;
+
+            // How each counter is clocked, worked out from TMOD, TCON and
+            // the gate inputs whenever those change
+            array<int, 2> modes = {{0, 0}};
+            array<bool, 2> is_timing = {{false, false}};
+            array<bool, 2> is_counting = {{false, false}};
+            bool is_th0_timing = false;
+
+            void schedule();
+            void store();
+
+            int64_t advance(int timer, int64_t counts);
+            int64_t advanceth0(int64_t counts);
+            int64_t overflowcounts(int timer);
+            int64_t overflowperiod(int timer);
+    };
+};
+
+#endif // BEE8051_TIMER_H
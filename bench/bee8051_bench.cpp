@@ -0,0 +1,481 @@
+#include <Bee8051/bee8051.h>
+#include <Bee8051/bee8051hex.h>
+#include <Bee8051/bee8051image.h>
+#include <filesystem>
+#include <fstream>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <sstream>
+using namespace bee8051;
+using namespace std;
+
+// Host with a flat 64 KiB program memory; ports read back as pulled up
+class BenchHost
+{
+    public:
+	uint8_t readROM(uint16_t addr)
+	{
+	    return rom[addr];
+	}
+
+	uint8_t portIn(int port)
+	{
+	    (void)port;
+	    return 0xFF;
+	}
+
+	void portOut(int port, uint8_t data)
+	{
+	    (void)port;
+	    (void)data;
+	}
+
+	array<uint8_t, 0x10000> rom;
+};
+
+struct BenchCase
+{
+    string name;
+    vector<uint8_t> body;
+};
+
+struct BenchStats
+{
+    double median = 0.0;
+    double min = 0.0;
+    double spread = 0.0;
+};
+
+// Repeats the body through the first 4 KiB, followed by a jump back to
+// the start, so each class runs as one long straight line
+vector<uint8_t> buildrom(const vector<uint8_t> &body)
+{
+    vector<uint8_t> rom;
+
+    while ((rom.size() + body.size()) < 0xFFD)
+    {
+	rom.insert(rom.end(), body.begin(), body.end());
+    }
+
+    rom.push_back(0x02);
+    rom.push_back(0x00);
+    rom.push_back(0x00);
+    return rom;
+}
+
+vector<BenchCase> benchcases()
+{
+    return {
+	{"reg_moves", {0x78, 0x11, 0xF9, 0x7A, 0x22, 0xFB, 0x7C, 0x33, 0xFD, 0x7E, 0x44, 0xFF}}, // mov rn, #data / mov rn, a
+	{"iram_direct", {0x75, 0x30, 0x55, 0xF5, 0x31, 0x25, 0x32, 0x74, 0x12}}, // mov dir, #data / mov dir, a / add a, dir / mov a, #data
+	{"iram_indirect", {0x78, 0x40, 0xF6, 0x79, 0x41, 0xF7}}, // mov r0, #data / mov @r0, a / mov r1, #data / mov @r1, a
+	{"sfr_port", {0xF5, 0x90, 0x25, 0x90, 0xF5, 0xA0, 0x25, 0x81}}, // mov p1, a / add a, p1 / mov p2, a / add a, sp
+	{"bit_ops", {0xD2, 0x00, 0xC2, 0x01, 0xD2, 0x90, 0xC2, 0x90}}, // setb/clr in IRAM and on p1
+	{"branches", {0x80, 0x00, 0x02, 0xFF, 0xFF}}, // sjmp to the next instruction / ljmp (patched to the next one)
+	{"djnz_loops", {0x7A, 0x10, 0x74, 0x01, 0xDA, 0xFC}}, // mov r2, #16 / loop: mov a, #1 / djnz r2, loop
+	{"add_flags", {0x25, 0x30, 0x25, 0xD0, 0x25, 0xE0}}, // add a, dir / add a, psw / add a, acc
+    };
+}
+
+// The ljmp in the branch body has to target the instruction after it,
+// which depends on where each copy ends up
+void patchjumps(vector<uint8_t> &rom)
+{
+    for (size_t addr = 0; (addr + 2) < rom.size(); addr++)
+    {
+	if ((rom[addr] == 0x02) && (rom[addr + 1] == 0xFF) && (rom[addr + 2] == 0xFF))
+	{
+	    uint16_t target = uint16_t(addr + 3);
+	    rom[addr + 1] = (target >> 8);
+	    rom[addr + 2] = (target & 0xFF);
+	    addr += 2;
+	}
+    }
+}
+
+BenchStats getstats(vector<double> samples)
+{
+    BenchStats stats;
+    sort(samples.begin(), samples.end());
+    stats.median = samples[samples.size() / 2];
+    stats.min = samples.front();
+
+    // Median absolute deviation, relative to the median
+    vector<double> deviations;
+
+    for (double sample : samples)
+    {
+	deviations.push_back(fabs(sample - stats.median));
+    }
+
+    sort(deviations.begin(), deviations.end());
+    stats.spread = (stats.median > 0.0) ? (deviations[deviations.size() / 2] / stats.median) : 0.0;
+    return stats;
+}
+
+void printstats(const string &name, const string &mode, const BenchStats &stats)
+{
+    printf("%-20s %-12s %10.3f %10.3f %8.1f%%\n", name.c_str(), mode.c_str(), stats.median, stats.min, (stats.spread * 100.0));
+}
+
+const char *modename(execmode mode)
+{
+    switch (mode)
+    {
+	case execmode::Interpreter: return "interpreter";
+	case execmode::Threaded: return "threaded";
+	case execmode::JIT: return "jit";
+    }
+
+    return "";
+}
+
+// Counts the instructions in the timed part of a run, with the
+// interpreter stepping one at a time; every mode runs the same ones
+int64_t countinstrs(BenchHost &host, int64_t cycles)
+{
+    Bee8051 core;
+    core.bindHost(&host);
+    core.init();
+
+    core.runUntil((cycles / 16), []() -> bool
+    {
+	return false;
+    });
+
+    int64_t count = 0;
+    core.runUntil(cycles, [&]() -> bool
+    {
+	count += 1;
+	return false;
+    });
+
+    return count;
+}
+
+double timerun(BenchHost &host, execmode mode, int64_t cycles, int64_t instrs)
+{
+    Bee8051 core;
+    core.bindHost(&host);
+    core.init();
+    core.setExecMode(mode);
+
+    // Warm up the decode cache and any translations first; the host is
+    // passed in so that the loop is instantiated for BenchHost
+    core.run(host, (cycles / 16));
+
+    auto start_time = chrono::steady_clock::now();
+    core.run(host, cycles);
+    auto end_time = chrono::steady_clock::now();
+
+    return (chrono::duration<double, nano>(end_time - start_time).count() / double(instrs));
+}
+
+// Disassembles the first 4 KiB of ROM, either into a fixed buffer or
+// through the ostream wrapper
+void benchdisassembler(BenchHost &host, int reps, const string &name, bool is_stream)
+{
+    Bee8051 core;
+    core.bindHost(&host);
+    core.init();
+
+    vector<double> samples;
+    stringstream stream;
+    char buffer[64];
+    size_t total_length = 0;
+
+    for (int rep = 0; rep < reps; rep++)
+    {
+	int64_t count = 0;
+	auto start_time = chrono::steady_clock::now();
+
+	for (int pass = 0; pass < 16; pass++)
+	{
+	    stream.str("");
+
+	    for (uint32_t pc = 0; pc < 0xFF0;)
+	    {
+		if (is_stream)
+		{
+		    pc += uint32_t(core.disassembleinstr(stream, pc));
+		}
+		else
+		{
+		    pc += uint32_t(core.disassembleinstr(buffer, sizeof(buffer), pc));
+		    total_length += strlen(buffer);
+		}
+
+		count += 1;
+	    }
+	}
+
+	auto end_time = chrono::steady_clock::now();
+	samples.push_back(chrono::duration<double, nano>(end_time - start_time).count() / double(count));
+    }
+
+    // Keeps the formatting from being optimized away
+    if (total_length == 1)
+    {
+	cout << buffer << endl;
+    }
+
+    printstats(name, "-", getstats(samples));
+}
+
+// Formats a 64 KiB image as Intel HEX, in 32-byte data records with an
+// extended linear address record up front
+string buildhex(const array<uint8_t, 0x10000> &rom)
+{
+    string text;
+    char record[80];
+
+    auto addrecord = [&](uint8_t count, uint16_t addr, uint8_t type, const uint8_t *data)
+    {
+	uint8_t checksum = (count + (addr >> 8) + (addr & 0xFF) + type);
+	int length = snprintf(record, sizeof(record), ":%02X%04X%02X", count, addr, type);
+
+	for (int index = 0; index < count; index++)
+	{
+	    length += snprintf((record + length), (sizeof(record) - length), "%02X", data[index]);
+	    checksum += data[index];
+	}
+
+	snprintf((record + length), (sizeof(record) - length), "%02X\r\n", uint8_t(-checksum));
+	text += record;
+    };
+
+    uint8_t upper[2] = {0x00, 0x00};
+    addrecord(2, 0, 0x04, upper);
+
+    for (size_t addr = 0; addr < rom.size(); addr += 32)
+    {
+	addrecord(32, uint16_t(addr), 0x00, (rom.data() + addr));
+    }
+
+    addrecord(0, 0, 0x01, NULL);
+    return text;
+}
+
+// Times loading and attaching a 64 KiB program: parsing HEX text already
+// in memory, loading a HEX file, and mapping a prebuilt image, with and
+// without the decoded instruction table
+void benchloaders(const array<uint8_t, 0x10000> &rom, int reps, const string &filter)
+{
+    string text = buildhex(rom);
+    auto memory = make_unique<array<uint8_t, 0x10000>>();
+    auto temp_dir = filesystem::temp_directory_path();
+    string hex_filename = (temp_dir / "bee8051_bench.hex").string();
+    string image_filename = (temp_dir / "bee8051_bench.b51").string();
+    string decoded_filename = (temp_dir / "bee8051_bench_decoded.b51").string();
+
+    ofstream hex_file(hex_filename, ios::binary | ios::trunc);
+    hex_file << text;
+    hex_file.close();
+
+    // A full 64 KiB program space, so the decoded table has an entry
+    // for every byte of the ROM
+    BeeMCS51 core(16, 8);
+    core.init();
+    core.attachROM(rom.data(), rom.size());
+
+    Bee8051ImageSource source;
+    source.rom = rom.data();
+    source.rom_size = rom.size();
+    source.regions = {{0, uint32_t(rom.size())}};
+    source.core = &core;
+
+    bool is_written = Bee8051Image::write(image_filename, source);
+    source.has_decoded = true;
+    is_written = is_written && Bee8051Image::write(decoded_filename, source);
+
+    if (!hex_file || !is_written)
+    {
+	cout << "Could not write the loader test files" << endl;
+	return;
+    }
+
+    auto loadimage = [&](const string &filename) -> bool
+    {
+	Bee8051Image image;
+
+	if (!image.open(filename))
+	{
+	    return false;
+	}
+
+	image.attach(core);
+	return true;
+    };
+
+    vector<pair<string, function<bool()>>> loaders = {
+	{"hex_loader", [&]() -> bool
+	{
+	    core.attachROM(memory->data(), memory->size());
+	    return Bee8051Hex::load(text.data(), text.size(), memory->data(), memory->size());
+	}},
+	{"hex_file", [&]() -> bool
+	{
+	    core.attachROM(memory->data(), memory->size());
+	    return Bee8051Hex::loadFile(hex_filename, memory->data(), memory->size());
+	}},
+	{"image_file", [&]() -> bool
+	{
+	    return loadimage(image_filename);
+	}},
+	{"image_decoded", [&]() -> bool
+	{
+	    return loadimage(decoded_filename);
+	}},
+    };
+
+    for (auto &loader : loaders)
+    {
+	if (loader.first.find(filter) == string::npos)
+	{
+	    continue;
+	}
+
+	vector<double> samples;
+
+	for (int rep = 0; rep < reps; rep++)
+	{
+	    auto start_time = chrono::steady_clock::now();
+
+	    for (int pass = 0; pass < 16; pass++)
+	    {
+		if (!loader.second())
+		{
+		    cout << loader.first << " failed to load" << endl;
+		    return;
+		}
+	    }
+
+	    auto end_time = chrono::steady_clock::now();
+	    samples.push_back(chrono::duration<double, nano>(end_time - start_time).count() / double(16 * rom.size()));
+	}
+
+	printstats(loader.first, "per byte", getstats(samples));
+    }
+
+    core.detachROM();
+    filesystem::remove(hex_filename);
+    filesystem::remove(image_filename);
+    filesystem::remove(decoded_filename);
+}
+
+void usage()
+{
+    cout << "Usage: bee8051_bench [options]" << endl;
+    cout << "Options:" << endl;
+    cout << "  --reps <count>          Timed runs per benchmark (default 9)" << endl;
+    cout << "  --cycles <count>        Clock cycles per run (default 24000000)" << endl;
+    cout << "  --filter <text>         Only run benchmarks whose name contains this" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int reps = 9;
+    int64_t cycles = 24000000;
+    string filter;
+
+    for (int index = 1; index < argc; index++)
+    {
+	string arg = argv[index];
+	bool has_value = ((index + 1) < argc);
+
+	if ((arg == "--reps") && has_value)
+	{
+	    reps = max(1, atoi(argv[++index]));
+	}
+	else if ((arg == "--cycles") && has_value)
+	{
+	    cycles = max<int64_t>(12, strtoll(argv[++index], NULL, 10));
+	}
+	else if ((arg == "--filter") && has_value)
+	{
+	    filter = argv[++index];
+	}
+	else
+	{
+	    usage();
+	    return 1;
+	}
+    }
+
+    auto host = make_unique<BenchHost>();
+    execmode modes[] = {execmode::Interpreter, execmode::Threaded, execmode::JIT};
+
+    printf("%-20s %-12s %10s %10s %9s\n", "benchmark", "mode", "ns/instr", "min", "spread");
+
+    for (const BenchCase &bench : benchcases())
+    {
+	if (bench.name.find(filter) == string::npos)
+	{
+	    continue;
+	}
+
+	vector<uint8_t> rom = buildrom(bench.body);
+	patchjumps(rom);
+	host->rom.fill(0);
+	copy(rom.begin(), rom.end(), host->rom.begin());
+
+	int64_t instrs = countinstrs(*host, cycles);
+
+	for (execmode mode : modes)
+	{
+	    Bee8051 probe;
+
+	    if (!probe.setExecMode(mode))
+	    {
+		continue;
+	    }
+
+	    vector<double> samples;
+
+	    for (int rep = 0; rep < reps; rep++)
+	    {
+		samples.push_back(timerun(*host, mode, cycles, instrs));
+	    }
+
+	    printstats(bench.name, modename(mode), getstats(samples));
+	}
+    }
+
+    bool is_disassembling = (string("disassembler").find(filter) != string::npos);
+    bool is_streaming = (string("disassembler_stream").find(filter) != string::npos);
+
+    if (is_disassembling || is_streaming)
+    {
+	vector<uint8_t> rom;
+
+	for (const BenchCase &bench : benchcases())
+	{
+	    rom.insert(rom.end(), bench.body.begin(), bench.body.end());
+	}
+
+	rom = buildrom(rom);
+	patchjumps(rom);
+	host->rom.fill(0);
+	copy(rom.begin(), rom.end(), host->rom.begin());
+
+	if (is_disassembling)
+	{
+	    benchdisassembler(*host, reps, "disassembler", false);
+	}
+
+	if (is_streaming)
+	{
+	    benchdisassembler(*host, reps, "disassembler_stream", true);
+	}
+    }
+
+    for (size_t addr = 0; addr < host->rom.size(); addr++)
+    {
+	host->rom[addr] = uint8_t((addr * 37) ^ (addr >> 8));
+    }
+
+    benchloaders(host->rom, reps, filter);
+
+    return 0;
+}
@@ -1,198 +1,493 @@
-#include <Bee8051/bee8051.h>
-#include <fstream>
-#include <SDL2/SDL.h>
-using namespace bee8051;
-using namespace std;
-
-class Sim8051 : public Bee8051Interface
-{
-    public:
-	Sim8051()
-	{
-	    core.setInterface(this);
-	}
-
-	~Sim8051()
-	{
-
-	}
-
-	bool init(string filename)
-	{
-	    main_rom.fill(0);
-	    if (!process_intel_hex_file(filename))
-	    {
-		return false;
-	    }
-
-	    if (SDL_Init(SDL_INIT_VIDEO) < 0)
-	    {
-		return sdl_error("SDL2 could not be initialized!");
-	    }
-
-	    window = SDL_CreateWindow("Sim8051", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 640, 480, SDL_WINDOW_SHOWN);
-
-	    if (window == NULL)
-	    {
-		return sdl_error("Window could not be created!");
-	    }
-
-	    core.init();
-
-	    for (int i = 0; i < 5; i++)
-	    {
-		core.debugoutput();
-		core.runinstruction();
-	    }
-
-	    return true;
-	}
-
-	void shutdown()
-	{
-	    core.shutdown();
-
-	    if (window != NULL)
-	    {
-		SDL_DestroyWindow(window);
-		window = NULL;
-	    }
-
-	    SDL_Quit();
-	}
-
-	void run()
-	{
-	    bool quit = false;
-	    SDL_Event event;
-
-	    while (!quit)
-	    {
-		while (SDL_PollEvent(&event))
-		{
-		    switch (event.type)
-		    {
-			case SDL_QUIT: quit = true; break;
-		    }
-		}
-
-		runcore();
-	    }
-	}
-
-	uint8_t readROM(uint16_t addr)
-	{
-	    return main_rom.at(addr);
-	}
-
-	void portOut(int port, uint8_t data)
-	{
-	    (void)port;
-	    (void)data;
-	    return;
-	}
-
-    private:
-	bool process_intel_hex_file(string filename)
-	{
-	    ifstream file(filename);
-
-	    if (!file.is_open())
-	    {
-		return false;
-	    }
-
-	    string line;
-
-	    while (getline(file, line))
-	    {
-		if (line.at(0) != ':')
-		{
-		    cout << "Invalid HEX file" << endl;
-		    return false;
-		}
-
-		uint32_t byte_count = from_hex_str(line.substr(1, 2));
-		uint32_t mem_addr = from_hex_str(line.substr(3, 4));
-		uint8_t record_type = from_hex_str(line.substr(7, 2));
-
-		switch (record_type)
-		{
-		    case 0x00:
-		    {
-			for (size_t index = 0; index < byte_count; index++)
-			{
-			    uint32_t byte_offs = (9 + (index * 2));
-			    uint8_t data_byte = from_hex_str(line.substr(byte_offs, 2));
-			    main_rom.at(mem_addr + index) = data_byte;
-			}
-		    }
-		    break;
-		    case 0x01: break; // End of file
-		    default:
-		    {
-			cout << "Unrecognized record type of " << hex << int(record_type) << endl;
-			return false;
-		    }
-		    break;
-		}
-	    }
-
-	    return true;
-	}
-
-	uint32_t from_hex_str(string hex_str)
-	{
-	    return strtoul(hex_str.c_str(), NULL, 16);
-	}
-
-	bool sdl_error(string msg)
-	{
-	    cout << msg << " SDL_Error: " << SDL_GetError() << endl;
-	    return false;
-	}
-
-	void runcore()
-	{
-	    uint32_t cycle_count = (from_mhz(12) / 60);
-	    uint32_t cycles = 0;
-
-	    while (cycles < cycle_count)
-	    {
-		// core.debugoutput();
-		cycles += core.runinstruction();
-	    }
-	}
-
-	Bee8051 core;
-
-	SDL_Window *window = NULL;
-	SDL_Renderer *render = NULL;
-
-	uint32_t from_mhz(uint32_t mhz)
-	{
-	    return (mhz * 1e6);
-	}
-
-	array<uint8_t, 0x1000> main_rom;
-};
-
-int main(int argc, char* argv[])
-{
-    if (argc < 2)
-    {
-	cout << "Usage: sim8051 <Intel HEX file>" << endl;
-	return 1;
-    }
-
-    Sim8051 core;
-
-    if (!core.init(argv[1]))
-    {
-	return 1;
-    }
-
-    core.run();
-    core.shutdown();
-    return 0;
-}
\ No newline at end of file
+#include <Bee8051/bee8051.h>
+#include <Bee8051/bee8051hex.h>
+#include <Bee8051/bee8051image.h>
+#include <chrono>
+#include <cstring>
+#ifdef SIM8051_SDL
+#include <SDL2/SDL.h>
+#endif
+using namespace bee8051;
+using namespace std;
+
+struct SimOptions
+{
+    string filename;
+    string image_filename;
+    bool is_headless = false;
+    execmode mode = execmode::Interpreter;
+    int64_t max_cycles = 0;
+    int64_t max_instrs = 0;
+    bool is_halt_stop = false;
+    double clock_mhz = 12.0;
+};
+
+class Sim8051 : public Bee8051Interface
+{
+    public:
+        Sim8051()
+        {
+            core.setInterface(this);
+            core.setTraceSink(&trace);
+        }
+
+        ~Sim8051()
+        {
+
+        }
+
+        bool init(const SimOptions &options)
+        {
+            if (!loadprogram(options.filename))
+            {
+                return false;
+            }
+
+            core.init();
+
+            if (image.isOpen())
+            {
+                image.attach(core);
+            }
+
+            if (has_entry)
+            {
+                core.setPC(uint16_t(entry));
+            }
+
+            if (!options.image_filename.empty())
+            {
+                Bee8051ImageSource source;
+                source.rom = rom_data;
+                source.rom_size = rom_size;
+                source.regions = regions;
+                source.has_entry = has_entry;
+                source.entry = entry;
+                source.core = &core;
+
+                if (!Bee8051Image::write(options.image_filename, source))
+                {
+                    cout << "Could not write image to " << options.image_filename << endl;
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+#ifdef SIM8051_SDL
+        bool initwindow()
+        {
+            if (SDL_Init(SDL_INIT_VIDEO) < 0)
+            {
+                return sdl_error("SDL2 could not be initialized!");
+            }
+
+            window = SDL_CreateWindow("Sim8051", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 640, 480, SDL_WINDOW_SHOWN);
+
+            if (window == NULL)
+            {
+                return sdl_error("Window could not be created!");
+            }
+
+            for (int i = 0; i < 5; i++)
+            {
+                core.debugoutput();
+                core.runinstruction();
+            }
+
+            return true;
+        }
+#endif
+
+        void shutdown()
+        {
+            core.shutdown();
+
+#ifdef SIM8051_SDL
+            if (window != NULL)
+            {
+                SDL_DestroyWindow(window);
+                window = NULL;
+            }
+
+            SDL_Quit();
+#endif
+        }
+
+#ifdef SIM8051_SDL
+        void run()
+        {
+            bool quit = false;
+            SDL_Event event;
+
+            while (!quit)
+            {
+                while (SDL_PollEvent(&event))
+                {
+                    switch (event.type)
+                    {
+                        case SDL_QUIT: quit = true; break;
+                    }
+                }
+
+                runcore();
+            }
+        }
+#endif
+
+        // Runs flat out until a limit or a halt, then reports throughput
+        int runheadless(const SimOptions &options)
+        {
+            if (!core.setExecMode(options.mode))
+            {
+                cout << "Execution mode is not available in this build" << endl;
+                return 1;
+            }
+
+            findhalts();
+
+            // The interpreter only stops after every instruction, counting
+            // them, when an instruction limit or a halt needs it to; any
+            // other run, and the translated modes, go through run() in
+            // chunks, checking for halts in between
+            bool is_counting = ((options.mode == execmode::Interpreter) && ((options.max_instrs > 0) || options.is_halt_stop));
+            int64_t max_cycles = (options.max_cycles > 0) ? options.max_cycles : INT64_MAX;
+            int64_t max_instrs = (options.max_instrs > 0) ? options.max_instrs : INT64_MAX;
+            int64_t cycles = 0;
+            int64_t instrs = 0;
+            bool is_halted = false;
+
+            auto start_time = chrono::steady_clock::now();
+
+            while ((cycles < max_cycles) && (instrs < max_instrs) && !is_halted && !core.isFaulted())
+            {
+                int64_t chunk = min<int64_t>((max_cycles - cycles), ((is_counting || !options.is_halt_stop) ? (int64_t(1) << 40) : 4096));
+
+                if (is_counting)
+                {
+                    cycles += core.runUntil(chunk, [&]() -> bool
+                    {
+                        instrs += 1;
+                        return ((instrs >= max_instrs) || (options.is_halt_stop && ishalted()));
+                    });
+                }
+                else
+                {
+                    cycles += core.run(*this, chunk);
+                }
+
+                is_halted = (options.is_halt_stop && ishalted());
+            }
+
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+            seconds = max(seconds, 1e-9);
+            double emulated_seconds = (double(cycles) / (options.clock_mhz * 1e6));
+
+            cout << "Ran " << dec << cycles << " cycles";
+
+            if (is_counting)
+            {
+                cout << " (" << instrs << " instructions)";
+            }
+
+            cout << " in " << seconds << " s" << endl;
+
+            if (is_counting)
+            {
+                cout << "Measured loop: runUntil(), stopping after every instruction" << endl;
+            }
+            else
+            {
+                cout << "Measured loop: run()" << (options.is_halt_stop ? ", in 4096-cycle chunks" : "") << endl;
+            }
+
+            if (is_halted)
+            {
+                cout << "Halted at PC " << hex << int(core.getPC()) << dec << endl;
+            }
+
+            if (is_counting)
+            {
+                cout << "Emulated MIPS: " << ((double(instrs) / seconds) / 1e6) << endl;
+            }
+            else
+            {
+                cout << "Emulated MIPS: not counted by run(); --instructions counts them in the interpreter" << endl;
+            }
+
+            cout << "Cycles/sec: " << (double(cycles) / seconds) << endl;
+            cout << "Real-time factor: " << (emulated_seconds / seconds) << "x at " << options.clock_mhz << " MHz" << endl;
+
+            if (core.isFaulted())
+            {
+                cout << "Core faulted at PC " << hex << int(core.getPC()) << dec << endl;
+                return 1;
+            }
+
+            return 0;
+        }
+
+        // Program memory past the end of a short image reads as zeros,
+        // as it does in the 4 KiB buffer HEX files are loaded into
+        uint8_t readROM(uint16_t addr)
+        {
+            addr &= Bee8051::rom_mask;
+            return (addr < rom_size) ? rom_data[addr] : 0x00;
+        }
+
+        void portOut(int port, uint8_t data)
+        {
+            (void)port;
+            (void)data;
+            return;
+        }
+
+    private:
+        // Prebuilt images are mapped and attached as they are, after
+        // init(), and anything else is loaded as Intel HEX
+        bool loadprogram(const string &filename)
+        {
+            if (Bee8051Image::isImageFile(filename))
+            {
+                if (!image.open(filename))
+                {
+                    cout << "Could not load " << filename << ": " << image.getError() << endl;
+                    return false;
+                }
+
+                rom_data = image.getROM();
+                rom_size = image.getROMSize();
+                regions.assign(image.getRegions(), (image.getRegions() + image.getRegionCount()));
+                has_entry = image.hasEntry();
+                entry = image.getEntry();
+                return true;
+            }
+
+            main_rom.fill(0);
+            Bee8051HexInfo info;
+
+            if (!Bee8051Hex::loadFile(filename, main_rom.data(), main_rom.size(), &info, &regions))
+            {
+                cout << "Could not load " << filename << ": " << info.error;
+
+                if (info.error_line != 0)
+                {
+                    cout << " on line " << dec << info.error_line;
+                }
+
+                cout << endl;
+                return false;
+            }
+
+            rom_data = main_rom.data();
+            rom_size = main_rom.size();
+            has_entry = info.has_entry;
+            entry = info.entry;
+            core.attachROM(rom_data, rom_size);
+            return true;
+        }
+
+        // Marks the jumps to themselves (sjmp $ and ljmp $) that firmware
+        // uses to halt; the core masks the PC to the program space on
+        // fetch, so an ljmp to a mirror of itself halts too
+        void findhalts()
+        {
+            is_halt.assign((Bee8051::rom_mask + 1), false);
+
+            for (uint32_t addr = 0; addr <= Bee8051::rom_mask; addr++)
+            {
+                uint8_t opcode = readROM(uint16_t(addr));
+                uint8_t operand0 = readROM(uint16_t(addr + 1));
+                uint8_t operand1 = readROM(uint16_t(addr + 2));
+
+                if ((opcode == 0x80) && (operand0 == 0xFE))
+                {
+                    is_halt[addr] = true;
+                }
+                else if ((opcode == 0x02) && ((((operand0 << 8) | operand1) & Bee8051::rom_mask) == addr))
+                {
+                    is_halt[addr] = true;
+                }
+            }
+        }
+
+        bool ishalted()
+        {
+            return is_halt[core.getPC() & Bee8051::rom_mask];
+        }
+
+#ifdef SIM8051_SDL
+        bool sdl_error(string msg)
+        {
+            cout << msg << " SDL_Error: " << SDL_GetError() << endl;
+            return false;
+        }
+
+        void runcore()
+        {
+            uint32_t cycle_count = (from_mhz(12) / 60);
+            core.run(cycle_count);
+        }
+
+        uint32_t from_mhz(uint32_t mhz)
+        {
+            return (mhz * 1e6);
+        }
+
+        SDL_Window *window = NULL;
+        SDL_Renderer *render = NULL;
+#endif
+
+        Bee8051StreamTrace trace{cout, tracelevel::Info};
+        Bee8051 core;
+
+        array<uint8_t, 0x1000> main_rom;
+        Bee8051Image image;
+        const uint8_t *rom_data = NULL;
+        size_t rom_size = 0;
+        vector<Bee8051Region> regions;
+        bool has_entry = false;
+        uint32_t entry = 0;
+        vector<bool> is_halt;
+};
+
+void usage()
+{
+    cout << "Usage: sim8051 [options] <Intel HEX file or image>" << endl;
+    cout << "Options:" << endl;
+    cout << "  --headless              Run without a window, as fast as possible, and report throughput" << endl;
+    cout << "  --cycles <count>        Stop after this many clock cycles" << endl;
+    cout << "  --instructions <count>  Stop after this many instructions (interpreter only)" << endl;
+    cout << "  --halt                  Stop when the program reaches sjmp $ or ljmp $" << endl;
+    cout << "  --mode <mode>           interpreter, threaded or jit" << endl;
+    cout << "  --clock <MHz>           Clock used for the real-time factor (default 12)" << endl;
+    cout << "  --save-image <file>     Save the loaded HEX file as an image for faster startup" << endl;
+}
+
+bool parseoptions(int argc, char* argv[], SimOptions &options)
+{
+    for (int index = 1; index < argc; index++)
+    {
+        string arg = argv[index];
+        bool has_value = ((index + 1) < argc);
+
+        if (arg == "--headless")
+        {
+            options.is_headless = true;
+        }
+        else if (arg == "--halt")
+        {
+            options.is_halt_stop = true;
+        }
+        else if ((arg == "--cycles") && has_value)
+        {
+            options.max_cycles = strtoll(argv[++index], NULL, 10);
+        }
+        else if ((arg == "--instructions") && has_value)
+        {
+            options.max_instrs = strtoll(argv[++index], NULL, 10);
+        }
+        else if ((arg == "--clock") && has_value)
+        {
+            options.clock_mhz = strtod(argv[++index], NULL);
+        }
+        else if ((arg == "--save-image") && has_value)
+        {
+            options.image_filename = argv[++index];
+        }
+        else if ((arg == "--mode") && has_value)
+        {
+            string mode = argv[++index];
+
+            if (mode == "interpreter")
+            {
+                options.mode = execmode::Interpreter;
+            }
+            else if (mode == "threaded")
+            {
+                options.mode = execmode::Threaded;
+            }
+            else if (mode == "jit")
+            {
+                options.mode = execmode::JIT;
+            }
+            else
+            {
+                cout << "Unknown execution mode of " << mode << endl;
+                return false;
+            }
+        }
+        else if ((arg.compare(0, 2, "--") == 0) || !options.filename.empty())
+        {
+            cout << "Unrecognized argument of " << arg << endl;
+            return false;
+        }
+        else
+        {
+            options.filename = arg;
+        }
+    }
+
+    if ((options.max_instrs > 0) && (options.mode != execmode::Interpreter))
+    {
+        cout << "--instructions needs the interpreter" << endl;
+        return false;
+    }
+
+    if (options.clock_mhz <= 0)
+    {
+        cout << "Invalid clock speed" << endl;
+        return false;
+    }
+
+    return !options.filename.empty();
+}
+
+int main(int argc, char* argv[])
+{
+    SimOptions options;
+
+    if (!parseoptions(argc, argv, options))
+    {
+        usage();
+        return 1;
+    }
+
+#ifndef SIM8051_SDL
+    // Built without SDL, so there is no window to open
+    options.is_headless = true;
+#endif
+
+    Sim8051 core;
+
+    if (!core.init(options))
+    {
+        return 1;
+    }
+
+    if (options.is_headless)
+    {
+        if ((options.max_cycles <= 0) && (options.max_instrs <= 0) && !options.is_halt_stop)
+        {
+            cout << "Headless runs need --cycles, --instructions or --halt" << endl;
+            core.shutdown();
+            return 1;
+        }
+
+        int result = core.runheadless(options);
+        core.shutdown();
+        return result;
+    }
+
+#ifdef SIM8051_SDL
+    if (!core.initwindow())
+    {
+        core.shutdown();
+        return 1;
+    }
+
+    core.run();
+#endif
+    core.shutdown();
+    return 0;
+}
@@ -0,0 +1,321 @@
+#include <Bee8051/bee8051.h>
+#include <cstring>
+#include <random>
+using namespace bee8051;
+using namespace std;
+
+// Runs random programs built from the implemented opcodes through every
+// execution mode and way of binding the host, and checks that all of them
+// end in the same state as the interpreter bound with setInterface(),
+// byte for byte, having made the same port accesses along the way
+
+// Logs every port access, and can stop the core after a given number
+// of port writes, to check where each mode stops a run
+class TestHost
+{
+    public:
+	uint8_t readROM(uint16_t addr)
+	{
+	    return rom[addr & 0xFFF];
+	}
+
+	uint8_t portIn(int port)
+	{
+	    uint8_t data = uint8_t(0x5A + (7 * num_inputs));
+	    num_inputs += 1;
+	    log.push_back({-1 - port, data});
+	    return data;
+	}
+
+	void portOut(int port, uint8_t data)
+	{
+	    log.push_back({port, data});
+
+	    if (int(log.size()) == stop_after)
+	    {
+		core->stop();
+	    }
+	}
+
+	array<uint8_t, 0x1000> rom;
+	vector<pair<int, uint8_t>> log;
+	int num_inputs = 0;
+	int stop_after = -1;
+	BeeMCS51 *core = NULL;
+};
+
+class TestInterface : public Bee8051Interface
+{
+    public:
+	TestInterface(TestHost &cb) : host(cb)
+	{
+
+	}
+
+	uint8_t readROM(uint16_t addr)
+	{
+	    return host.readROM(addr);
+	}
+
+	uint8_t portIn(int port)
+	{
+	    return host.portIn(port);
+	}
+
+	void portOut(int port, uint8_t data)
+	{
+	    host.portOut(port, data);
+	}
+
+    private:
+	TestHost &host;
+};
+
+enum class binding
+{
+    Interface,
+    BindHost,
+    RunHost,
+};
+
+struct TestCase
+{
+    array<uint8_t, 0x1000> rom;
+    vector<int64_t> budgets;
+    int stop_after = -1;
+    bool is_stepping = false;
+};
+
+struct TestResult
+{
+    vector<uint8_t> state;
+    vector<pair<int, uint8_t>> log;
+    int64_t cycles = 0;
+};
+
+// Straight-line code with loops and jumps back into it, touching IRAM,
+// the ports and the SFRs that have hooks, then jumping back to the start
+void buildprogram(mt19937 &rng, array<uint8_t, 0x1000> &rom)
+{
+    auto random = [&](int count) -> int
+    {
+	return int(rng() % uint32_t(count));
+    };
+
+    static const uint8_t sfrs[] = {0x80, 0x81, 0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x8D, 0x90, 0xA0, 0xB0, 0xD0, 0xE0};
+
+    auto direct = [&]() -> uint8_t
+    {
+	return (random(4) != 0) ? uint8_t(random(0x80)) : sfrs[random(sizeof(sfrs))];
+    };
+
+    rom.fill(0);
+    vector<int> starts;
+    vector<pair<int, bool>> targets;
+    int pc = 0;
+
+    while (pc < 0x300)
+    {
+	starts.push_back(pc);
+
+	switch (random(12))
+	{
+	    case 0: rom[pc++] = 0x74; rom[pc++] = uint8_t(random(256)); break; // mov a, #data
+	    case 1: rom[pc++] = 0x75; rom[pc++] = direct(); rom[pc++] = uint8_t(random(256)); break; // mov dir, #data
+	    case 2: rom[pc++] = uint8_t(0x78 | random(8)); rom[pc++] = uint8_t(random(256)); break; // mov rn, #data
+	    case 3: rom[pc++] = uint8_t(0xF8 | random(8)); break; // mov rn, a
+	    case 4: rom[pc++] = 0xF5; rom[pc++] = direct(); break; // mov dir, a
+	    case 5: rom[pc++] = uint8_t(0xF6 | random(2)); break; // mov @ri, a
+	    case 6: rom[pc++] = (random(2) != 0) ? 0xC2 : 0xD2; rom[pc++] = uint8_t(random(256)); break; // clr/setb bit
+	    case 7:
+	    {
+		// djnz rn, either back into the program or onto itself
+		rom[pc++] = uint8_t(0xD8 | random(8));
+
+		if (random(3) != 0)
+		{
+		    targets.push_back({pc, false});
+		    rom[pc++] = 0;
+		}
+		else
+		{
+		    rom[pc++] = 0xFE;
+		}
+	    }
+	    break;
+	    case 8:
+	    {
+		if (random(4) != 0)
+		{
+		    rom[pc++] = 0x25; rom[pc++] = direct(); // add a, dir
+		}
+		else
+		{
+		    rom[pc++] = 0x80; // sjmp
+		    targets.push_back({pc, false});
+		    rom[pc++] = 0;
+		}
+	    }
+	    break;
+	    case 9:
+	    {
+		if (random(6) != 0)
+		{
+		    rom[pc++] = 0x74; rom[pc++] = uint8_t(random(256));
+		}
+		else
+		{
+		    rom[pc++] = 0x02; // ljmp
+		    targets.push_back({pc, true});
+		    pc += 2;
+		}
+	    }
+	    break;
+	    default: rom[pc++] = 0x25; rom[pc++] = direct(); break; // add a, dir
+	}
+    }
+
+    starts.push_back(pc);
+    rom[pc++] = 0x02;
+    rom[pc++] = 0x00;
+    rom[pc++] = 0x00;
+
+    for (auto &target : targets)
+    {
+	int addr = starts[random(int(starts.size()))];
+
+	if (target.second)
+	{
+	    // Some jumps go through a mirror of the 4 KiB program space
+	    int mirror = (random(3) == 0) ? 0x10 : 0x00;
+	    rom[target.first] = uint8_t((addr >> 8) | mirror);
+	    rom[target.first + 1] = uint8_t(addr & 0xFF);
+	}
+	else
+	{
+	    int offset = (addr - (target.first + 1));
+	    rom[target.first] = ((offset >= -128) && (offset <= 127)) ? uint8_t(offset) : 0x00;
+	}
+    }
+}
+
+bool runprogram(const TestCase &test, execmode mode, binding bind, TestResult &result)
+{
+    TestHost host;
+    host.rom = test.rom;
+    host.stop_after = test.stop_after;
+
+    Bee8051 core;
+    TestInterface iface(host);
+    host.core = &core;
+
+    if (bind == binding::Interface)
+    {
+	core.setInterface(&iface);
+    }
+    else
+    {
+	core.bindHost(&host);
+    }
+
+    core.init();
+
+    if (!core.setExecMode(mode))
+    {
+	return false;
+    }
+
+    for (int64_t budget : test.budgets)
+    {
+	result.cycles += (bind == binding::RunHost) ? core.run(host, budget) : core.run(budget);
+
+	if (test.is_stepping)
+	{
+	    result.cycles += core.runinstruction();
+	}
+    }
+
+    result.state.resize(core.getStateSize());
+    result.state.resize(core.saveState(result.state.data(), result.state.size()));
+    result.log = host.log;
+    return true;
+}
+
+const char *modename(execmode mode)
+{
+    switch (mode)
+    {
+	case execmode::Interpreter: return "interpreter";
+	case execmode::Threaded: return "threaded";
+	case execmode::JIT: return "jit";
+    }
+
+    return "";
+}
+
+const char *bindname(binding bind)
+{
+    switch (bind)
+    {
+	case binding::Interface: return "setInterface";
+	case binding::BindHost: return "bindHost";
+	case binding::RunHost: return "run(host)";
+    }
+
+    return "";
+}
+
+int main(int argc, char *argv[])
+{
+    int num_programs = (argc > 1) ? atoi(argv[1]) : 300;
+    int num_failures = 0;
+    bool has_jit = true;
+
+    for (int seed = 0; seed < num_programs; seed++)
+    {
+	mt19937 rng(seed);
+	TestCase test;
+	buildprogram(rng, test.rom);
+
+	int num_budgets = int(1 + (rng() % 6));
+
+	for (int index = 0; index < num_budgets; index++)
+	{
+	    test.budgets.push_back(int64_t(1 + (rng() % 20000)));
+	}
+
+	test.stop_after = ((rng() % 3) == 0) ? int(1 + (rng() % 50)) : -1;
+	test.is_stepping = ((rng() % 2) == 0);
+
+	TestResult expected;
+	runprogram(test, execmode::Interpreter, binding::Interface, expected);
+
+	for (execmode mode : {execmode::Interpreter, execmode::Threaded, execmode::JIT})
+	{
+	    for (binding bind : {binding::Interface, binding::BindHost, binding::RunHost})
+	    {
+		TestResult result;
+
+		if (!runprogram(test, mode, bind, result))
+		{
+		    has_jit = false;
+		    continue;
+		}
+
+		if (result.state.empty() || (result.state != expected.state) || (result.log != expected.log) || (result.cycles != expected.cycles))
+		{
+		    printf("Program %d differs in %s mode with %s: %zu/%zu port accesses, %lld/%lld cycles\n", seed, modename(mode), bindname(bind), result.log.size(), expected.log.size(), (long long)result.cycles, (long long)expected.cycles);
+		    num_failures += 1;
+		}
+	    }
+	}
+    }
+
+    if (!has_jit)
+    {
+	printf("JIT not available in this build, skipped\n");
+    }
+
+    printf("%d programs, %d failures\n", num_programs, num_failures);
+    return (num_failures == 0) ? 0 : 1;
+}
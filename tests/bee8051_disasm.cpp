@@ -0,0 +1,351 @@
+#include <Bee8051/bee8051.h>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <sstream>
+using namespace bee8051;
+using namespace std;
+
+// Checks the table-driven disassembler against a reference written the
+// way the original one was, a switch over the opcodes formatting into a
+// stringstream, for every opcode with every first operand byte and a
+// sample of second ones; the core names its SFRs and bits through
+// get_sfr_names(), which the reference looks up the way the original
+// did, as must get_bit_addr(). Then checks that disassembling into a
+// buffer never allocates, and that a short buffer cuts the text short
+// but always terminates it
+
+static size_t num_allocs = 0;
+
+void *operator new(size_t size)
+{
+    num_allocs += 1;
+    void *ptr = malloc((size != 0) ? size : 1);
+
+    if (ptr == NULL)
+    {
+        throw bad_alloc();
+    }
+
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+class TestHost
+{
+    public:
+        uint8_t readROM(uint16_t addr)
+        {
+            return rom[addr];
+        }
+
+        uint8_t portIn(int port)
+        {
+            (void)port;
+            return 0xFF;
+        }
+
+        void portOut(int port, uint8_t data)
+        {
+            (void)port;
+            (void)data;
+        }
+
+        array<uint8_t, 0x10000> rom = {};
+};
+
+// Names given through the hook, on top of the ones Bee8051 adds in init();
+// the one for bit 0x05 must not show up, as bits below 0x80 are in IRAM
+static const vector<pair<uint16_t, const char*>> test_names =
+{
+    {0x30, "count"},
+    {0x90, "p1"},
+    {0xE0, "acc"},
+    {0x105, "flag"},
+    {0x194, "led"},
+    {0x1E7, "sign"},
+};
+
+class TestCore : public Bee8051
+{
+    public:
+        string bitname(uint8_t addr)
+        {
+            return get_bit_addr(addr);
+        }
+
+    protected:
+        string get_sfr_names(uint16_t addr) override
+        {
+            for (auto &name : test_names)
+            {
+                if (name.first == addr)
+                {
+                    return name.second;
+                }
+            }
+
+            return Bee8051::get_sfr_names(addr);
+        }
+};
+
+class ReferenceDisassembler
+{
+    public:
+        ReferenceDisassembler(TestHost &cb) : host(cb)
+        {
+            mem_names = {{0x81, "sp"}, {0x1B6, "wr"}, {0x1B7, "rd"}};
+
+            for (auto &name : test_names)
+            {
+                mem_names[name.first] = name.second;
+            }
+        }
+
+        size_t disassemble(ostream &stream, uint32_t pc)
+        {
+            uint32_t prev_pc = pc;
+            uint8_t instr = readROM(pc++);
+
+            switch (instr)
+            {
+                case 0x02:
+                {
+                    uint8_t high = readROM(pc++);
+                    uint8_t low = readROM(pc++);
+                    stream << "ljmp $" << hex << int((high << 8) | low);
+                }
+                break;
+                case 0x25: stream << "add a, (" << hex << int(readROM(pc++)) << ")"; break;
+                case 0x32: stream << "reti"; break;
+                case 0x74: stream << "mov a, #$" << hex << int(readROM(pc++)); break;
+                case 0x75:
+                {
+                    uint8_t addr = readROM(pc++);
+                    uint8_t data = readROM(pc++);
+                    stream << "mov " << directname(addr) << ", #$" << hex << int(data);
+                }
+                break;
+                case 0x80:
+                {
+                    int8_t rel = int8_t(readROM(pc++));
+                    stream << "sjmp $" << hex << int(pc + rel);
+                }
+                break;
+                case 0xC2: stream << "clr " << bitname(readROM(pc++)); break;
+                case 0xD2: stream << "setb " << bitname(readROM(pc++)); break;
+                case 0xF5: stream << "mov " << directname(readROM(pc++)) << ", a"; break;
+                case 0xF6:
+                case 0xF7: stream << "mov @r" << dec << int(instr & 0x1) << ", a"; break;
+                default:
+                {
+                    switch (instr & 0xF8)
+                    {
+                        case 0x78: stream << "mov r" << dec << int(instr & 0x7) << ", #$" << hex << int(readROM(pc++)); break;
+                        case 0xD8:
+                        {
+                            int8_t rel = int8_t(readROM(pc++));
+                            stream << "djnz r" << dec << int(instr & 0x7) << ", $" << hex << int(pc + rel);
+                        }
+                        break;
+                        case 0xF8: stream << "mov r" << dec << int(instr & 0x7) << ", a"; break;
+                        default: stream << "unk"; break;
+                    }
+                }
+                break;
+            }
+
+            return (pc - prev_pc);
+        }
+
+    private:
+        TestHost &host;
+        map<uint16_t, string> mem_names;
+
+        uint8_t readROM(uint32_t addr)
+        {
+            return host.readROM(uint16_t(addr & 0xFFF));
+        }
+
+    public:
+        string directname(uint8_t addr)
+        {
+            stringstream ss;
+            auto name = mem_names.find(addr);
+
+            if (name == mem_names.end())
+            {
+                ss << "$" << hex << int(addr);
+            }
+            else
+            {
+                ss << name->second;
+            }
+
+            return ss.str();
+        }
+
+        string bitname(uint8_t addr)
+        {
+            stringstream ss;
+
+            if (addr < 0x80)
+            {
+                ss << "$" << hex << int((addr >> 3) | 0x20) << "." << dec << int(addr & 0x7);
+                return ss.str();
+            }
+
+            auto name = mem_names.find(addr | 0x100);
+
+            if (name != mem_names.end())
+            {
+                ss << name->second;
+                return ss.str();
+            }
+
+            name = mem_names.find(addr & 0xF8);
+
+            if (name == mem_names.end())
+            {
+                ss << "$" << hex << int(addr & 0xF8) << "." << dec << int(addr & 0x7);
+            }
+            else
+            {
+                ss << name->second << "." << dec << int(addr & 0x7);
+            }
+
+            return ss.str();
+        }
+};
+
+int comparereference(TestCore &core, TestHost &host)
+{
+    ReferenceDisassembler reference(host);
+    int num_failures = 0;
+    char buffer[64];
+    stringstream expected;
+    stringstream streamed;
+
+    for (int opcode = 0; opcode < 256; opcode++)
+    {
+        for (int first = 0; first < 256; first++)
+        {
+            for (int second = 0; second < 256; second += 17)
+            {
+                // Far enough into the ROM that jump targets stay positive
+                uint16_t pc = uint16_t(0x123 + first);
+                host.rom[pc] = uint8_t(opcode);
+                host.rom[pc + 1] = uint8_t(first);
+                host.rom[pc + 2] = uint8_t(second);
+
+                expected.str("");
+                streamed.str("");
+                size_t expected_length = reference.disassemble(expected, pc);
+                size_t length = core.disassembleinstr(buffer, sizeof(buffer), pc);
+                size_t streamed_length = core.disassembleinstr(streamed, pc);
+
+                if ((expected.str() != buffer) || (expected.str() != streamed.str()) || (length != expected_length) || (streamed_length != expected_length))
+                {
+                    if (num_failures < 10)
+                    {
+                        printf("%02X %02X %02X: \"%s\" (%zu), expected \"%s\" (%zu)\n", opcode, first, second, buffer, length, expected.str().c_str(), expected_length);
+                    }
+
+                    num_failures += 1;
+                }
+            }
+        }
+    }
+
+    // The string helpers subclasses used before the table are kept, and
+    // read the same names
+    for (int addr = 0; addr < 256; addr++)
+    {
+        string name = core.bitname(uint8_t(addr));
+
+        if (name != reference.bitname(uint8_t(addr)))
+        {
+            printf("Bit %02X: \"%s\", expected \"%s\"\n", addr, name.c_str(), reference.bitname(uint8_t(addr)).c_str());
+            num_failures += 1;
+        }
+    }
+
+    return num_failures;
+}
+
+int checkbuffers(TestCore &core, TestHost &host)
+{
+    int num_failures = 0;
+    char buffer[64];
+
+    for (size_t addr = 0; addr < host.rom.size(); addr++)
+    {
+        host.rom[addr] = uint8_t(addr * 7);
+    }
+
+    // mov sp, #$42
+    host.rom[0] = 0x75;
+    host.rom[1] = 0x81;
+    host.rom[2] = 0x42;
+
+    size_t prev_allocs = num_allocs;
+
+    for (uint32_t pc = 0; pc < 0x10000; pc++)
+    {
+        core.disassembleinstr(buffer, sizeof(buffer), pc);
+    }
+
+    if (num_allocs != prev_allocs)
+    {
+        printf("Disassembling into a buffer allocated %zu times\n", (num_allocs - prev_allocs));
+        num_failures += 1;
+    }
+
+    const vector<pair<size_t, string>> cut_cases = {{1, ""}, {4, "mov"}, {8, "mov sp,"}, {20, "mov sp, #$42"}};
+
+    for (auto &cut : cut_cases)
+    {
+        memset(buffer, '#', sizeof(buffer));
+        core.disassembleinstr(buffer, cut.first, 0);
+
+        if (cut.second != buffer)
+        {
+            printf("Buffer of %zu: \"%s\", expected \"%s\"\n", cut.first, buffer, cut.second.c_str());
+            num_failures += 1;
+        }
+    }
+
+    buffer[0] = '#';
+
+    if ((core.disassembleinstr(buffer, 0, 0) != 3) || (buffer[0] != '#'))
+    {
+        printf("Empty buffer was written to\n");
+        num_failures += 1;
+    }
+
+    return num_failures;
+}
+
+int main()
+{
+    static TestHost host;
+    TestCore core;
+    core.bindHost(&host);
+    core.init();
+
+    int num_failures = comparereference(core, host);
+    num_failures += checkbuffers(core, host);
+
+    printf("%d failures\n", num_failures);
+    return (num_failures == 0) ? 0 : 1;
+}
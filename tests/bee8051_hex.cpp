@@ -0,0 +1,229 @@
+#include <Bee8051/bee8051hex.h>
+#include <cstdio>
+#include <cstring>
+using namespace bee8051;
+using namespace std;
+
+// Table of Intel HEX files, good and bad, each with the result the
+// loader should come back with
+
+struct HexCase
+{
+    string name;
+    string text;
+    size_t memory_size = 0x10000;
+    const char *error = NULL;
+    size_t error_line = 0;
+    vector<pair<uint32_t, uint8_t>> bytes;
+    vector<Bee8051Region> regions;
+    bool has_entry = false;
+    uint32_t entry = 0;
+};
+
+// Formats one record, with its checksum adjusted by checksum_delta to
+// make a bad one
+string hexrecord(uint8_t type, uint16_t addr, const vector<uint8_t> &data, int checksum_delta = 0)
+{
+    char digits[16];
+    uint8_t checksum = uint8_t(data.size() + (addr >> 8) + (addr & 0xFF) + type);
+    snprintf(digits, sizeof(digits), ":%02X%04X%02X", int(data.size()), addr, type);
+    string text = digits;
+
+    for (uint8_t data_byte : data)
+    {
+	snprintf(digits, sizeof(digits), "%02X", data_byte);
+	text += digits;
+	checksum += data_byte;
+    }
+
+    snprintf(digits, sizeof(digits), "%02X\r\n", uint8_t(-checksum + checksum_delta));
+    return (text + digits);
+}
+
+const string hexeof = ":00000001FF\r\n";
+
+vector<HexCase> hexcases()
+{
+    vector<HexCase> cases;
+
+    {
+	// Contiguous records merge into one region, and the start linear
+	// address record sets the entry point
+	HexCase test;
+	test.name = "good multi-record file";
+	test.text = hexrecord(0x04, 0, {0x00, 0x00});
+	test.text += hexrecord(0x00, 0x0000, {0x02, 0x01, 0x00});
+	test.text += hexrecord(0x00, 0x0003, {0x74, 0x55});
+	test.text += hexrecord(0x00, 0x0100, {0x80, 0xFE});
+	test.text += hexrecord(0x05, 0, {0x00, 0x00, 0x01, 0x00});
+	test.text += hexeof;
+	test.bytes = {{0x0000, 0x02}, {0x0002, 0x00}, {0x0003, 0x74}, {0x0004, 0x55}, {0x0100, 0x80}, {0x0101, 0xFE}};
+	test.regions = {{0x0000, 5}, {0x0100, 2}};
+	test.has_entry = true;
+	test.entry = 0x100;
+	cases.push_back(test);
+    }
+
+    {
+	HexCase test;
+	test.name = "bad checksum";
+	test.text = hexrecord(0x00, 0x0000, {0x01, 0x02});
+	test.text += hexrecord(0x00, 0x0002, {0x03, 0x04}, 1);
+	test.text += hexeof;
+	test.error = "Checksum mismatch";
+	test.error_line = 2;
+	cases.push_back(test);
+    }
+
+    {
+	// Drops the last digit of the checksum
+	HexCase test;
+	test.name = "odd digit count";
+	string record = hexrecord(0x00, 0x0000, {0x01, 0x02});
+	test.text = (record.substr(0, (record.size() - 3)) + "\r\n") + hexeof;
+	test.error = "Malformed or truncated record data";
+	test.error_line = 1;
+	cases.push_back(test);
+    }
+
+    {
+	// Under segment addressing, offsets wrap around within the
+	// 64 KiB segment, so the record is split in two
+	HexCase test;
+	test.name = "segment wrap";
+	test.text = hexrecord(0x02, 0, {0x10, 0x00});
+	test.text += hexrecord(0x00, 0xFFFE, {0x11, 0x22, 0x33, 0x44});
+	test.text += hexeof;
+	test.memory_size = 0x20000;
+	test.bytes = {{0x1FFFE, 0x11}, {0x1FFFF, 0x22}, {0x10000, 0x33}, {0x10001, 0x44}};
+	test.regions = {{0x1FFFE, 2}, {0x10000, 2}};
+	cases.push_back(test);
+    }
+
+    {
+	// Under linear addressing, a record runs on past the end of the
+	// 64 KiB page, and the next page starts where the base says
+	HexCase test;
+	test.name = "linear wrap";
+	test.text = hexrecord(0x04, 0, {0x00, 0x01});
+	test.text += hexrecord(0x00, 0xFFFE, {0x11, 0x22, 0x33, 0x44});
+	test.text += hexrecord(0x04, 0, {0x00, 0x02});
+	test.text += hexrecord(0x00, 0x0010, {0x55});
+	test.text += hexeof;
+	test.memory_size = 0x30000;
+	test.bytes = {{0x1FFFE, 0x11}, {0x1FFFF, 0x22}, {0x20000, 0x33}, {0x20001, 0x44}, {0x20010, 0x55}};
+	test.regions = {{0x1FFFE, 4}, {0x20010, 1}};
+	cases.push_back(test);
+    }
+
+    {
+	HexCase test;
+	test.name = "data past the end of the buffer";
+	test.text = hexrecord(0x00, 0x0000, {0x01});
+	test.text += hexrecord(0x00, 0x00FE, {0x01, 0x02, 0x03, 0x04});
+	test.text += hexeof;
+	test.memory_size = 0x100;
+	test.error = "Data past the end of program memory";
+	test.error_line = 2;
+	cases.push_back(test);
+    }
+
+    {
+	HexCase test;
+	test.name = "segment past the end of the buffer";
+	test.text = hexrecord(0x02, 0, {0x10, 0x00});
+	test.text += hexrecord(0x00, 0x0000, {0x01});
+	test.text += hexeof;
+	test.error = "Data past the end of program memory";
+	test.error_line = 2;
+	cases.push_back(test);
+    }
+
+    {
+	HexCase test;
+	test.name = "missing end of file";
+	test.text = hexrecord(0x00, 0x0000, {0x01});
+	test.error = "Missing end of file record";
+	test.error_line = 2;
+	cases.push_back(test);
+    }
+
+    return cases;
+}
+
+bool runcase(const HexCase &test)
+{
+    vector<uint8_t> memory(test.memory_size, 0x00);
+    Bee8051HexInfo info;
+    vector<Bee8051Region> regions;
+
+    bool is_loaded = Bee8051Hex::load(test.text.data(), test.text.size(), memory.data(), memory.size(), &info, &regions);
+
+    if (test.error != NULL)
+    {
+	if (is_loaded || (info.error == NULL) || (strcmp(info.error, test.error) != 0) || (info.error_line != test.error_line))
+	{
+	    printf("%s: expected \"%s\" on line %zu, got \"%s\" on line %zu\n", test.name.c_str(), test.error, test.error_line, ((info.error != NULL) ? info.error : "no error"), info.error_line);
+	    return false;
+	}
+
+	return true;
+    }
+
+    if (!is_loaded)
+    {
+	printf("%s: failed with \"%s\" on line %zu\n", test.name.c_str(), info.error, info.error_line);
+	return false;
+    }
+
+    for (auto &expected : test.bytes)
+    {
+	if (memory[expected.first] != expected.second)
+	{
+	    printf("%s: %02X at %X, expected %02X\n", test.name.c_str(), memory[expected.first], expected.first, expected.second);
+	    return false;
+	}
+    }
+
+    size_t num_bytes = 0;
+
+    for (auto &region : test.regions)
+    {
+	num_bytes += region.size;
+    }
+
+    bool is_regions_match = (regions.size() == test.regions.size());
+
+    for (size_t index = 0; is_regions_match && (index < regions.size()); index++)
+    {
+	is_regions_match = ((regions[index].addr == test.regions[index].addr) && (regions[index].size == test.regions[index].size));
+    }
+
+    if (!is_regions_match || (info.bytes_loaded != num_bytes))
+    {
+	printf("%s: %zu regions and %zu bytes, expected %zu regions and %zu bytes\n", test.name.c_str(), regions.size(), info.bytes_loaded, test.regions.size(), num_bytes);
+	return false;
+    }
+
+    if ((info.has_entry != test.has_entry) || (info.entry != test.entry))
+    {
+	printf("%s: entry %X, expected %X\n", test.name.c_str(), info.entry, test.entry);
+	return false;
+    }
+
+    return true;
+}
+
+int main()
+{
+    int num_failures = 0;
+    vector<HexCase> cases = hexcases();
+
+    for (auto &test : cases)
+    {
+	num_failures += (runcase(test)) ? 0 : 1;
+    }
+
+    printf("%zu cases, %d failures\n", cases.size(), num_failures);
+    return (num_failures == 0) ? 0 : 1;
+}
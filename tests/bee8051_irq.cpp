@@ -0,0 +1,306 @@
+#include <Bee8051/bee8051.h>
+#include <cstring>
+#include <functional>
+using namespace bee8051;
+using namespace std;
+
+// Table of short programs with interrupt handlers, run in every execution
+// mode in steps, with the host driving INT0 and INT1 between steps. The
+// handlers log their number into IRAM from $50 on through @r0 as they
+// start, and their number plus $10 as they end, so the test can check
+// the order they ran and nested in, along with TCON and SP
+
+class TestHost
+{
+    public:
+        uint8_t readROM(uint16_t addr)
+        {
+            return rom[addr & 0xFFF];
+        }
+
+        uint8_t portIn(int port)
+        {
+            (void)port;
+            return 0xFF;
+        }
+
+        void portOut(int port, uint8_t data)
+        {
+            (void)port;
+            (void)data;
+        }
+
+        array<uint8_t, 0x1000> rom = {};
+};
+
+// Expects the byte at addr to be within low and high
+struct IrqCheck
+{
+    uint16_t addr;
+    uint8_t low;
+    uint8_t high;
+};
+
+struct IrqStep
+{
+    function<void(Bee8051&)> action;
+    int64_t cycles = 0;
+    vector<IrqCheck> expected;
+};
+
+struct IrqCase
+{
+    string name;
+    vector<pair<uint16_t, vector<uint8_t>>> code;
+    vector<IrqStep> steps;
+};
+
+// mov a, #id / mov @r0, a / mov a, #1 / add a, r0 / mov r0, a
+vector<uint8_t> logentry(uint8_t id)
+{
+    return {0x74, id, 0xF6, 0x74, 0x01, 0x25, 0x00, 0xF8};
+}
+
+// A handler that logs its start, waits in djnz rn, $ for count
+// iterations if count is not zero, then logs its end and returns
+vector<uint8_t> handler(uint8_t id, int reg = 0, uint8_t count = 0)
+{
+    vector<uint8_t> code = logentry(id);
+
+    if (count != 0)
+    {
+        vector<uint8_t> wait = {uint8_t(0x78 | reg), count, uint8_t(0xD8 | reg), 0xFE};
+        code.insert(code.end(), wait.begin(), wait.end());
+    }
+
+    vector<uint8_t> end = logentry(id + 0x10);
+    code.insert(code.end(), end.begin(), end.end());
+    code.push_back(0x32);
+    return code;
+}
+
+void pinlow(Bee8051 &core, int line)
+{
+    core.setIntPin(line, false);
+}
+
+vector<IrqCase> irqcases()
+{
+    vector<IrqCase> cases;
+
+    // Every program starts at $40 with r0 pointing at the log, and the
+    // handlers for INT0, Timer 0 and INT1 are at $80, $a0 and $c0
+    vector<pair<uint16_t, vector<uint8_t>>> vectors = {
+        {0x00, {0x02, 0x00, 0x40}},
+        {0x03, {0x02, 0x00, 0x80}},
+        {0x0B, {0x02, 0x00, 0xA0}},
+        {0x13, {0x02, 0x00, 0xC0}},
+    };
+
+    {
+        // Timer 0 overflows about 30 machine cycles in, and its handler
+        // then waits for about 400 more
+        IrqCase test;
+        test.name = "high priority INT0 preempts low priority Timer 0";
+        test.code = vectors;
+        test.code.push_back({0x40, {
+            0x78, 0x50, // mov r0, #$50
+            0x75, 0x89, 0x01, // mov tmod, #$01
+            0x75, 0x8C, 0xFF, // mov th0, #$ff
+            0x75, 0x8A, 0xF0, // mov tl0, #$f0
+            0x75, 0xB8, 0x01, // mov ip, #$01
+            0x75, 0xA8, 0x83, // mov ie, #$83
+            0x75, 0x88, 0x11, // mov tcon, #$11
+            0x80, 0xFE, // sjmp $
+        }});
+        test.code.push_back({0x80, handler(0x01)});
+        test.code.push_back({0xA0, handler(0x02, 2, 200)});
+        test.steps = {
+            {NULL, 1500, {{0x50, 0x02, 0x02}, {0x00, 0x51, 0x51}, {0x181, 0x09, 0x09}}},
+            {[](Bee8051 &core) { pinlow(core, 0); }, 20000, {
+                {0x50, 0x02, 0x02}, {0x51, 0x01, 0x01}, {0x52, 0x11, 0x11}, {0x53, 0x12, 0x12},
+                {0x00, 0x54, 0x54}, {0x181, 0x07, 0x07}, {0x188, 0x11, 0x11},
+            }},
+        };
+        cases.push_back(test);
+    }
+
+    {
+        // INT0 is made edge-triggered before its pin goes low
+        IrqCase test;
+        test.name = "low priority INT1 waits for high priority INT0";
+        test.code = vectors;
+        test.code.push_back({0x40, {
+            0x78, 0x50, // mov r0, #$50
+            0x75, 0xB8, 0x01, // mov ip, #$01
+            0x75, 0xA8, 0x85, // mov ie, #$85
+            0x75, 0x88, 0x05, // mov tcon, #$05
+            0x80, 0xFE, // sjmp $
+        }});
+        test.code.push_back({0x80, handler(0x01, 3, 200)});
+        test.code.push_back({0xC0, handler(0x03)});
+        test.steps = {
+            {NULL, 240, {}},
+            {[](Bee8051 &core) { pinlow(core, 0); }, 1500, {{0x50, 0x01, 0x01}, {0x181, 0x09, 0x09}}},
+            {[](Bee8051 &core) { pinlow(core, 1); }, 20000, {
+                {0x50, 0x01, 0x01}, {0x51, 0x11, 0x11}, {0x52, 0x03, 0x03}, {0x53, 0x13, 0x13},
+                {0x00, 0x54, 0x54}, {0x181, 0x07, 0x07}, {0x188, 0x05, 0x05},
+            }},
+        };
+        cases.push_back(test);
+    }
+
+    {
+        // Both requests are latched while EA is still clear
+        IrqCase test;
+        test.name = "same priority requests are taken in polling order";
+        test.code = vectors;
+        test.code.push_back({0x40, {
+            0x78, 0x50, // mov r0, #$50
+            0x75, 0xB8, 0x00, // mov ip, #$00
+            0x75, 0x88, 0x05, // mov tcon, #$05
+            0x75, 0xA8, 0x05, // mov ie, #$05
+            0x7C, 0x64, 0xDC, 0xFE, // mov r4, #100 / djnz r4, $
+            0xD2, 0xAF, // setb ea
+            0x80, 0xFE, // sjmp $
+        }});
+        test.code.push_back({0x80, handler(0x01)});
+        test.code.push_back({0xC0, handler(0x03)});
+        test.steps = {
+            {NULL, 600, {{0x00, 0x50, 0x50}}},
+            {[](Bee8051 &core) { pinlow(core, 0); pinlow(core, 1); }, 20000, {
+                {0x50, 0x01, 0x01}, {0x51, 0x11, 0x11}, {0x52, 0x03, 0x03}, {0x53, 0x13, 0x13},
+                {0x00, 0x54, 0x54}, {0x181, 0x07, 0x07},
+            }},
+        };
+        cases.push_back(test);
+    }
+
+    {
+        IrqCase test = cases.back();
+        test.name = "high priority INT1 is taken before INT0";
+        test.code[vectors.size()].second[4] = 0x04; // mov ip, #$04
+        test.steps[1].expected = {
+            {0x50, 0x03, 0x03}, {0x51, 0x13, 0x13}, {0x52, 0x01, 0x01}, {0x53, 0x11, 0x11},
+            {0x00, 0x54, 0x54}, {0x181, 0x07, 0x07},
+        };
+        cases.push_back(test);
+    }
+
+    // The next two count calls to the INT0 handler in $30
+
+    {
+        // Holding the pin low does not request again, and vectoring
+        // clears IE0
+        IrqCase test;
+        test.name = "edge-triggered INT0 runs once per falling edge";
+        test.code = {
+            {0x00, {0x02, 0x00, 0x40}},
+            {0x03, {0x74, 0x01, 0x25, 0x30, 0xF5, 0x30, 0x32}},
+            {0x40, {0x75, 0x88, 0x01, 0x75, 0xA8, 0x81, 0x80, 0xFE}},
+        };
+        test.steps = {
+            {NULL, 240, {}},
+            {[](Bee8051 &core) { pinlow(core, 0); }, 2000, {{0x30, 0x01, 0x01}, {0x188, 0x01, 0x01}}},
+            {NULL, 5000, {{0x30, 0x01, 0x01}}},
+            {[](Bee8051 &core) { core.setIntPin(0, true); pinlow(core, 0); }, 2000, {{0x30, 0x02, 0x02}, {0x188, 0x01, 0x01}, {0x181, 0x07, 0x07}}},
+        };
+        cases.push_back(test);
+    }
+
+    {
+        // The handler takes 9 machine cycles a time, with the hardware
+        // call and the sjmp it returns to, so it runs about 18 times in 2000
+        // cycles; the last call may still be under way when the pin goes high
+        IrqCase test;
+        test.name = "level-triggered INT0 runs while the pin is low";
+        test.code = {
+            {0x00, {0x02, 0x00, 0x40}},
+            {0x03, {0x74, 0x01, 0x25, 0x30, 0xF5, 0x30, 0x32}},
+            {0x40, {0x75, 0xA8, 0x81, 0x80, 0xFE}},
+        };
+        test.steps = {
+            {NULL, 240, {}},
+            {[](Bee8051 &core) { pinlow(core, 0); }, 2000, {{0x30, 0x11, 0x14}, {0x188, 0x02, 0x02}}},
+            {[](Bee8051 &core) { core.setIntPin(0, true); core.writeMemory(0x30, 0); }, 2000, {{0x30, 0x00, 0x01}, {0x188, 0x00, 0x00}}},
+        };
+        cases.push_back(test);
+    }
+
+    return cases;
+}
+
+const char *modename(execmode mode)
+{
+    switch (mode)
+    {
+        case execmode::Interpreter: return "interpreter";
+        case execmode::Threaded: return "threaded";
+        case execmode::JIT: return "jit";
+    }
+
+    return "";
+}
+
+bool runcase(const IrqCase &test, execmode mode)
+{
+    TestHost host;
+
+    for (auto &block : test.code)
+    {
+        copy(block.second.begin(), block.second.end(), (host.rom.begin() + block.first));
+    }
+
+    Bee8051 core;
+    core.bindHost(&host);
+    core.init();
+
+    if (!core.setExecMode(mode))
+    {
+        return true;
+    }
+
+    bool is_passed = true;
+
+    for (size_t index = 0; index < test.steps.size(); index++)
+    {
+        const IrqStep &step = test.steps[index];
+
+        if (step.action)
+        {
+            step.action(core);
+        }
+
+        core.run(step.cycles);
+
+        for (auto &expected : step.expected)
+        {
+            uint8_t data = core.readMemory(expected.addr);
+
+            if ((data < expected.low) || (data > expected.high))
+            {
+                printf("%s (%s), step %zu: %02X at %X, expected %02X-%02X\n", test.name.c_str(), modename(mode), index, data, expected.addr, expected.low, expected.high);
+                is_passed = false;
+            }
+        }
+    }
+
+    return is_passed;
+}
+
+int main()
+{
+    int num_failures = 0;
+    vector<IrqCase> cases = irqcases();
+
+    for (auto &test : cases)
+    {
+        for (execmode mode : {execmode::Interpreter, execmode::Threaded, execmode::JIT})
+        {
+            num_failures += (runcase(test, mode)) ? 0 : 1;
+        }
+    }
+
+    printf("%zu cases, %d failures\n", cases.size(), num_failures);
+    return (num_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,262 @@
+#include <Bee8051/bee8051.h>
+#include <Bee8051/bee8051lockstep.h>
+#include <cstring>
+#include <random>
+using namespace bee8051;
+using namespace std;
+
+// Runs random programs on a lockstep engine whose lanes each start with
+// their own IRAM, register bank and port inputs, and checks every lane
+// that has not faulted against a Bee8051 started in the same state and
+// run on its own: the same PC, cycles, IRAM, SFRs and PSW. Lanes fault
+// on SFRs the engine does not model, where the core would carry on.
+// The engine uses whichever vector path the library was built with
+// (SSE2 by default on x86-64, AVX2 with BEE8051_AVX2)
+
+class TestHost
+{
+    public:
+	uint8_t readROM(uint16_t addr)
+	{
+	    return rom[addr & 0xFFF];
+	}
+
+	uint8_t portIn(int port)
+	{
+	    (void)port;
+	    return 0xFF;
+	}
+
+	void portOut(int port, uint8_t data)
+	{
+	    (void)port;
+	    (void)data;
+	}
+
+	array<uint8_t, 0x1000> rom;
+};
+
+// Straight-line code with loops and jumps back into it, touching IRAM,
+// the ports, PSW and unimplemented SFRs (which fault lanes), with reti
+// in some programs to pop return addresses off random stacks
+void buildprogram(mt19937 &rng, array<uint8_t, 0x1000> &rom, bool has_reti)
+{
+    auto random = [&](int count) -> int
+    {
+	return int(rng() % uint32_t(count));
+    };
+
+    static const uint8_t sfrs[] = {0xE0, 0xD0, 0x81, 0x80, 0x90, 0xA0, 0xB0, 0xF0};
+
+    auto direct = [&]() -> uint8_t
+    {
+	return (random(3) != 0) ? uint8_t(random(0x80)) : sfrs[random(sizeof(sfrs))];
+    };
+
+    // Bits in IRAM, on the ports, and the carry and bank bits in PSW
+    auto bit = [&]() -> uint8_t
+    {
+	switch (random(4))
+	{
+	    case 0: return uint8_t(0xD0 | ((random(2) != 0) ? 3 : (4 + random(4))));
+	    case 1: return uint8_t((0x80 + (0x10 * random(4))) | random(8));
+	    default: return uint8_t(random(0x80));
+	}
+    };
+
+    rom.fill(0xA5);
+    vector<int> starts;
+    vector<pair<int, bool>> targets;
+    int pc = 0;
+
+    while (pc < 0x300)
+    {
+	starts.push_back(pc);
+
+	switch (random(14))
+	{
+	    case 0: rom[pc++] = 0x74; rom[pc++] = uint8_t(random(256)); break; // mov a, #data
+	    case 1: rom[pc++] = 0x75; rom[pc++] = direct(); rom[pc++] = uint8_t(random(256)); break; // mov dir, #data
+	    case 2: rom[pc++] = uint8_t(0x78 | random(8)); rom[pc++] = uint8_t(random(256)); break; // mov rn, #data
+	    case 3: rom[pc++] = uint8_t(0xF8 | random(8)); break; // mov rn, a
+	    case 4: rom[pc++] = 0xF5; rom[pc++] = direct(); break; // mov dir, a
+	    case 5: rom[pc++] = uint8_t(0xF6 | random(2)); break; // mov @ri, a
+	    case 6:
+	    case 11: rom[pc++] = 0x25; rom[pc++] = direct(); break; // add a, dir
+	    case 7: rom[pc++] = (random(2) != 0) ? 0xC2 : 0xD2; rom[pc++] = bit(); break; // clr/setb bit
+	    case 8:
+	    case 12:
+	    {
+		// djnz rn, either back into the program or onto itself
+		rom[pc++] = uint8_t(0xD8 | random(8));
+
+		if (random(4) != 0)
+		{
+		    targets.push_back({pc, false});
+		    rom[pc++] = 0;
+		}
+		else
+		{
+		    rom[pc++] = 0xFE;
+		}
+	    }
+	    break;
+	    case 9: rom[pc++] = 0x80; targets.push_back({pc, false}); rom[pc++] = 0; break; // sjmp
+	    case 10: rom[pc++] = 0x02; targets.push_back({pc, true}); pc += 2; break; // ljmp
+	    default:
+	    {
+		if (has_reti && (random(6) == 0))
+		{
+		    rom[pc++] = 0x32;
+		}
+		else
+		{
+		    rom[pc++] = 0x74; rom[pc++] = uint8_t(random(256));
+		}
+	    }
+	    break;
+	}
+    }
+
+    rom[pc++] = 0x02;
+    rom[pc++] = 0x00;
+    rom[pc++] = 0x00;
+
+    for (auto &target : targets)
+    {
+	int addr = starts[random(int(starts.size()))];
+
+	if (target.second)
+	{
+	    rom[target.first] = uint8_t(addr >> 8);
+	    rom[target.first + 1] = uint8_t(addr & 0xFF);
+	}
+	else
+	{
+	    int offset = (addr - (target.first + 1));
+	    rom[target.first] = ((offset >= -128) && (offset <= 127)) ? uint8_t(offset) : 0x00;
+	}
+    }
+}
+
+// Returns the first address where the lane and the core differ, 0x200
+// for the PC, cycles or the core having faulted, or -1 if they match
+int comparelane(Bee8051Lockstep &lockstep, size_t lane, Bee8051 &core)
+{
+    if ((lockstep.getPC(lane) != core.getPC()) || (lockstep.getCycles(lane) != core.getCycles()) || core.isFaulted())
+    {
+	return 0x200;
+    }
+
+    if (lockstep.getPSW(lane) != core.readMemory(0x1D0))
+    {
+	return 0x1D0;
+    }
+
+    for (int addr = 0; addr < 0x200; addr++)
+    {
+	if ((addr != 0x1D0) && (lockstep.readRAM(lane, uint16_t(addr)) != core.readMemory(uint16_t(addr))))
+	{
+	    return addr;
+	}
+    }
+
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_programs = (argc > 1) ? atoi(argv[1]) : 200;
+    int num_failures = 0;
+    size_t num_lanes = 0;
+    size_t num_faulted = 0;
+
+#if defined(BEE8051_AVX2) && (defined(__GNUC__) || defined(__clang__))
+    if (!__builtin_cpu_supports("avx2"))
+    {
+	printf("Built for AVX2, which this CPU does not have, skipped\n");
+	return 77;
+    }
+#endif
+
+    for (int seed = 0; seed < num_programs; seed++)
+    {
+	mt19937 rng(seed);
+	TestHost host;
+	buildprogram(rng, host.rom, ((seed % 3) == 0));
+
+	size_t count = size_t(1 + (rng() % 70));
+	bool is_same_bank = ((rng() % 2) == 0);
+
+	Bee8051 origin;
+	origin.bindHost(&host);
+	origin.init();
+
+	Bee8051Lockstep lockstep(origin, count);
+	vector<unique_ptr<Bee8051>> cores;
+
+	for (size_t lane = 0; lane < count; lane++)
+	{
+	    cores.push_back(make_unique<Bee8051>());
+	    Bee8051 &core = *cores.back();
+	    core.bindHost(&host);
+	    core.init();
+
+	    for (uint16_t addr = 0; addr < 0x80; addr++)
+	    {
+		uint8_t data = uint8_t(rng());
+		core.writeMemory(addr, data);
+		lockstep.writeRAM(lane, addr, data);
+	    }
+
+	    for (int port = 0; port < 4; port++)
+	    {
+		uint8_t data = uint8_t(rng());
+		core.setPortInput(port, data);
+		lockstep.setPortInput(lane, port, data);
+	    }
+
+	    if (!is_same_bank && ((rng() % 2) == 0))
+	    {
+		uint8_t psw = uint8_t(0x08 * (rng() % 4));
+		core.writeMemory(0x1D0, psw);
+		lockstep.writeRAM(lane, 0x1D0, psw);
+	    }
+	}
+
+	int num_runs = int(1 + (rng() % 3));
+
+	for (int run = 0; run < num_runs; run++)
+	{
+	    int64_t cycles = int64_t(rng() % 30000);
+	    lockstep.run(cycles);
+
+	    for (auto &core : cores)
+	    {
+		core->run(cycles);
+	    }
+	}
+
+	for (size_t lane = 0; lane < count; lane++)
+	{
+	    if (lockstep.isFaulted(lane))
+	    {
+		num_faulted += 1;
+		continue;
+	    }
+
+	    int addr = comparelane(lockstep, lane, *cores[lane]);
+
+	    if (addr >= 0)
+	    {
+		printf("Program %d, lane %zu differs at %x: PC %x/%x, %lld/%lld cycles\n", seed, lane, addr, lockstep.getPC(lane), cores[lane]->getPC(), (long long)lockstep.getCycles(lane), (long long)cores[lane]->getCycles());
+		num_failures += 1;
+	    }
+	}
+
+	num_lanes += count;
+    }
+
+    printf("%d programs, %zu lanes (%zu faulted), %d failures\n", num_programs, num_lanes, num_faulted, num_failures);
+    return (num_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+#include <Bee8051/bee8051.h>
+#include <cstring>
+using namespace bee8051;
+using namespace std;
+
+// Runs a program that writes P1 in every execution mode, first with a
+// call to portOut() on every write, then switched to changes-only
+// notification partway through, and checks the calls the host got and
+// what the program read back through the published input pins
+
+class TestHost
+{
+    public:
+        uint8_t readROM(uint16_t addr)
+        {
+            return rom[addr & 0xFFF];
+        }
+
+        uint8_t portIn(int port)
+        {
+            (void)port;
+            return 0xFF;
+        }
+
+        void portOut(int port, uint8_t data)
+        {
+            writes.push_back({port, data});
+        }
+
+        void portChanged(int port, uint8_t data, int64_t cycles)
+        {
+            (void)cycles;
+            changes.push_back({port, data});
+        }
+
+        array<uint8_t, 0x1000> rom = {};
+        vector<pair<int, uint8_t>> writes;
+        vector<pair<int, uint8_t>> changes;
+};
+
+const vector<uint8_t> program = {
+    0x75, 0x90, 0x12, // mov p1, #$12
+    0x7F, 0x32, 0xDF, 0xFE, // mov r7, #50 / djnz r7, $
+    0x75, 0x90, 0xFF, // mov p1, #$ff
+    0x75, 0x90, 0xFF, // mov p1, #$ff
+    0x75, 0x90, 0x34, // mov p1, #$34
+    0x74, 0x00, 0x25, 0x90, 0xF5, 0x30, // p1 to $30
+    0x80, 0xFE, // sjmp $
+};
+
+const char *modename(execmode mode)
+{
+    switch (mode)
+    {
+        case execmode::Interpreter: return "interpreter";
+        case execmode::Threaded: return "threaded";
+        case execmode::JIT: return "jit";
+    }
+
+    return "";
+}
+
+bool runprogram(execmode mode)
+{
+    TestHost host;
+    copy(program.begin(), program.end(), host.rom.begin());
+
+    Bee8051 core;
+    core.bindHost(&host);
+    core.init();
+
+    if (!core.setExecMode(mode))
+    {
+        return true;
+    }
+
+    bool is_passed = true;
+
+    // Stops in the delay loop, after the first write
+    host.writes.clear();
+    core.run(600);
+
+    vector<pair<int, uint8_t>> expected_writes = {{1, 0x12}};
+
+    if ((host.writes != expected_writes) || !host.changes.empty())
+    {
+        printf("%s: %zu writes and %zu changes before notification, expected 1 write\n", modename(mode), host.writes.size(), host.changes.size());
+        is_passed = false;
+    }
+
+    // The first write after this changes P1 from $12, and the second
+    // does not change it
+    host.writes.clear();
+    core.setPortNotify(true);
+    core.setPortInput(1, 0x0F);
+    core.run(2000);
+
+    vector<pair<int, uint8_t>> expected_changes = {{1, 0xFF}, {1, 0x34}};
+
+    if (!host.writes.empty() || (host.changes != expected_changes))
+    {
+        printf("%s: %zu writes and %zu changes after notification, expected 2 changes\n", modename(mode), host.writes.size(), host.changes.size());
+        is_passed = false;
+    }
+
+    uint8_t data = core.readMemory(0x30);
+
+    if (data != 0x04)
+    {
+        printf("%s: read %02X from P1, expected 04\n", modename(mode), data);
+        is_passed = false;
+    }
+
+    return is_passed;
+}
+
+int main()
+{
+    int num_failures = 0;
+
+    for (execmode mode : {execmode::Interpreter, execmode::Threaded, execmode::JIT})
+    {
+        num_failures += (runprogram(mode)) ? 0 : 1;
+    }
+
+    printf("%d failures\n", num_failures);
+    return (num_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,249 @@
+#include <Bee8051/bee8051.h>
+#include <cstring>
+using namespace bee8051;
+using namespace std;
+
+// Table of short programs that set up the serial port and Timer 1 in
+// different orders, each run in every execution mode with bytes queued
+// for the receiver, and checked for SCON, SBUF and the bytes sent
+
+class TestHost
+{
+    public:
+        uint8_t readROM(uint16_t addr)
+        {
+            return rom[addr & 0xFFF];
+        }
+
+        uint8_t portIn(int port)
+        {
+            (void)port;
+            return 0xFF;
+        }
+
+        void portOut(int port, uint8_t data)
+        {
+            (void)port;
+            (void)data;
+        }
+
+        array<uint8_t, 0x1000> rom = {};
+};
+
+struct SerialCase
+{
+    string name;
+    vector<uint8_t> program;
+    int64_t cycles = 100000;
+    vector<uint8_t> input;
+    uint8_t scon = 0;
+    uint8_t sbuf = 0;
+    vector<uint8_t> output;
+};
+
+// Each program ends in sjmp $
+vector<SerialCase> serialcases()
+{
+    vector<SerialCase> cases;
+
+    {
+        SerialCase test;
+        test.name = "receive, Timer 1 started first";
+        test.program = {
+            0x75, 0x89, 0x20, // mov tmod, #$20
+            0x75, 0x8D, 0xFD, // mov th1, #$fd
+            0x75, 0x8B, 0xFD, // mov tl1, #$fd
+            0xD2, 0x8E, // setb tr1
+            0x75, 0x98, 0x50, // mov scon, #$50
+        };
+        test.input = {0x41};
+        test.scon = 0x55;
+        test.sbuf = 0x41;
+        cases.push_back(test);
+    }
+
+    {
+        // The receiver waits for Timer 1 to start
+        SerialCase test;
+        test.name = "receive, SCON written first";
+        test.program = {
+            0x75, 0x98, 0x50, // mov scon, #$50
+            0x75, 0x89, 0x20, // mov tmod, #$20
+            0x75, 0x8D, 0xFD, // mov th1, #$fd
+            0xD2, 0x8E, // setb tr1
+        };
+        test.input = {0x41};
+        test.scon = 0x55;
+        test.sbuf = 0x41;
+        cases.push_back(test);
+    }
+
+    {
+        SerialCase test;
+        test.name = "send, Timer 1 started first";
+        test.program = {
+            0x75, 0x89, 0x20, // mov tmod, #$20
+            0x75, 0x8D, 0xFD, // mov th1, #$fd
+            0xD2, 0x8E, // setb tr1
+            0x75, 0x98, 0x40, // mov scon, #$40
+            0x75, 0x99, 0x41, // mov sbuf, #$41
+        };
+        test.scon = 0x42;
+        test.output = {0x41};
+        cases.push_back(test);
+    }
+
+    {
+        // The frame waits for Timer 1 to start
+        SerialCase test;
+        test.name = "send, SBUF written before TR1";
+        test.program = {
+            0x75, 0x98, 0x40, // mov scon, #$40
+            0x75, 0x89, 0x20, // mov tmod, #$20
+            0x75, 0x99, 0x41, // mov sbuf, #$41
+            0x75, 0x8D, 0xFD, // mov th1, #$fd
+            0xD2, 0x8E, // setb tr1
+        };
+        test.scon = 0x42;
+        test.output = {0x41};
+        cases.push_back(test);
+    }
+
+    {
+        SerialCase test;
+        test.name = "send, Timer 1 never started";
+        test.program = {
+            0x75, 0x98, 0x40, // mov scon, #$40
+            0x75, 0x99, 0x41, // mov sbuf, #$41
+        };
+        test.scon = 0x40;
+        cases.push_back(test);
+    }
+
+    {
+        // Starts at one overflow every 12 cycles, for a frame of 3840,
+        // then slows to one every 3072
+        SerialCase test;
+        test.name = "send, TH1 reload slowed mid-frame";
+        test.program = {
+            0x75, 0x98, 0x40, // mov scon, #$40
+            0x75, 0x89, 0x20, // mov tmod, #$20
+            0x75, 0x8D, 0xFF, // mov th1, #$ff
+            0x75, 0x8B, 0xFF, // mov tl1, #$ff
+            0xD2, 0x8E, // setb tr1
+            0x75, 0x99, 0x41, // mov sbuf, #$41
+            0x75, 0x8D, 0x00, // mov th1, #$00
+        };
+        test.cycles = 50000;
+        test.scon = 0x40;
+        cases.push_back(test);
+    }
+
+    {
+        SerialCase test = cases.back();
+        test.name = "send, TH1 reload slowed mid-frame, run to the end";
+        test.cycles = 2000000;
+        test.scon = 0x42;
+        test.output = {0x41};
+        cases.push_back(test);
+    }
+
+    {
+        // Starts at one overflow every 3072 cycles, then speeds up to one
+        // every 12
+        SerialCase test;
+        test.name = "send, TH1 reload sped up mid-frame";
+        test.program = {
+            0x75, 0x98, 0x40, // mov scon, #$40
+            0x75, 0x89, 0x20, // mov tmod, #$20
+            0x75, 0x8D, 0x00, // mov th1, #$00
+            0xD2, 0x8E, // setb tr1
+            0x75, 0x99, 0x41, // mov sbuf, #$41
+            0x75, 0x8D, 0xFF, // mov th1, #$ff
+        };
+        test.cycles = 20000;
+        test.scon = 0x42;
+        test.output = {0x41};
+        cases.push_back(test);
+    }
+
+    {
+        // Mode 2 runs off the oscillator, with RB8 set by the 9th bit
+        SerialCase test;
+        test.name = "send and receive in mode 2";
+        test.program = {
+            0x75, 0x98, 0x90, // mov scon, #$90
+            0x75, 0x99, 0x55, // mov sbuf, #$55
+        };
+        test.input = {0x41};
+        test.scon = 0x97;
+        test.sbuf = 0x41;
+        test.output = {0x55};
+        cases.push_back(test);
+    }
+
+    return cases;
+}
+
+const char *modename(execmode mode)
+{
+    switch (mode)
+    {
+        case execmode::Interpreter: return "interpreter";
+        case execmode::Threaded: return "threaded";
+        case execmode::JIT: return "jit";
+    }
+
+    return "";
+}
+
+bool runcase(const SerialCase &test, execmode mode)
+{
+    TestHost host;
+    copy(test.program.begin(), test.program.end(), host.rom.begin());
+    host.rom[test.program.size()] = 0x80;
+    host.rom[test.program.size() + 1] = 0xFE;
+
+    Bee8051 core;
+    core.bindHost(&host);
+    core.init();
+
+    if (!core.setExecMode(mode))
+    {
+        return true;
+    }
+
+    core.writeSerial(test.input.data(), test.input.size());
+    core.run(test.cycles);
+
+    vector<uint8_t> output(0x10);
+    output.resize(core.readSerial(output.data(), output.size()));
+
+    uint8_t scon = core.readMemory(0x198);
+    uint8_t sbuf = core.readMemory(0x199);
+
+    if ((scon != test.scon) || (sbuf != test.sbuf) || (output != test.output))
+    {
+        printf("%s (%s): SCON=%02X SBUF=%02X, %zu bytes sent, expected SCON=%02X SBUF=%02X, %zu bytes sent\n", test.name.c_str(), modename(mode), scon, sbuf, output.size(), test.scon, test.sbuf, test.output.size());
+        return false;
+    }
+
+    return true;
+}
+
+int main()
+{
+    int num_failures = 0;
+    vector<SerialCase> cases = serialcases();
+
+    for (auto &test : cases)
+    {
+        for (execmode mode : {execmode::Interpreter, execmode::Threaded, execmode::JIT})
+        {
+            num_failures += (runcase(test, mode)) ? 0 : 1;
+        }
+    }
+
+    printf("%zu cases, %d failures\n", cases.size(), num_failures);
+    return (num_failures == 0) ? 0 : 1;
+}
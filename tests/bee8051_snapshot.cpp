@@ -0,0 +1,283 @@
+#include <Bee8051/bee8051.h>
+#include <cstring>
+using namespace bee8051;
+using namespace std;
+
+// Runs programs that keep the timers, interrupts and serial port busy,
+// takes a snapshot partway through, and checks that a run forked from it
+// on a fresh core, and one rewound to it on the same core, end in the
+// same state as the run that carried on, byte for byte, having sent the
+// same bytes; then checks the registers the forked run ended with
+
+class TestHost
+{
+    public:
+        uint8_t readROM(uint16_t addr)
+        {
+            return rom[addr & 0xFFF];
+        }
+
+        uint8_t portIn(int port)
+        {
+            (void)port;
+            return 0xFF;
+        }
+
+        void portOut(int port, uint8_t data)
+        {
+            (void)port;
+            (void)data;
+        }
+
+        array<uint8_t, 0x1000> rom = {};
+};
+
+// Expects the byte at addr to be within low and high
+struct SnapshotCheck
+{
+    uint16_t addr;
+    uint8_t low;
+    uint8_t high;
+};
+
+struct SnapshotCase
+{
+    string name;
+    vector<pair<uint16_t, vector<uint8_t>>> code;
+    int64_t cycles_before = 0;
+    vector<int64_t> budgets_after;
+    vector<uint8_t> input_before;
+    vector<uint8_t> input_after;
+
+    // Bytes the run after the snapshot sends, as counts going up by one
+    // from wherever they are at the snapshot
+    size_t min_output = 0;
+    size_t max_output = 0;
+    vector<SnapshotCheck> expected;
+};
+
+struct SnapshotResult
+{
+    vector<uint8_t> state;
+    vector<uint8_t> output;
+};
+
+vector<SnapshotCase> snapshotcases()
+{
+    vector<SnapshotCase> cases;
+
+    {
+        // Timer 0 interrupts every 3072 cycles and counts in $30, while the
+        // serial interrupt sends the count it keeps in $31 at 9600 baud
+        // (a frame every 11520 cycles) and acknowledges received bytes; the
+        // main loop adds 3 to $32. The snapshot is taken mid-frame, with
+        // both bytes received before it already taken, and 80001 cycles
+        // after it make 6 or 7 frames, depending on where the byte
+        // received after it restarts one
+        SnapshotCase test;
+        test.name = "timers, interrupts and serial port";
+        test.code = {
+            {0x00, {0x02, 0x00, 0x40}},
+            {0x0B, {0x74, 0x01, 0x25, 0x30, 0xF5, 0x30, 0x32}},
+            {0x23, {
+                0xC2, 0x99, 0xC2, 0x98, // clr ti / clr ri
+                0x74, 0x01, 0x25, 0x31, 0xF5, 0x31, // $31 += 1
+                0xF5, 0x99, // mov sbuf, a
+                0x32, // reti
+            }},
+            {0x40, {
+                0x75, 0x89, 0x22, // mov tmod, #$22
+                0x75, 0x8C, 0x00, // mov th0, #$00
+                0x75, 0x8D, 0xFD, // mov th1, #$fd
+                0x75, 0x98, 0x50, // mov scon, #$50
+                0x75, 0xA8, 0x92, // mov ie, #$92
+                0x75, 0x88, 0x50, // mov tcon, #$50
+                0x75, 0x99, 0x00, // mov sbuf, #$00
+                0x74, 0x03, 0x25, 0x32, 0xF5, 0x32, // $32 += 3
+                0x80, 0xF8, // sjmp back
+            }},
+        };
+        test.cycles_before = 40000;
+        test.budgets_after = {30000, 1, 25000, 25000};
+        test.input_before = {0x68, 0x69};
+        test.input_after = {0x21};
+        test.min_output = 6;
+        test.max_output = 7;
+
+        // Timer 1 overflows set TF1, which nothing clears
+        test.expected = {{0x30, 0x26, 0x29}, {0x31, 0x0A, 0x0C}, {0x188, 0xD0, 0xD0}};
+        cases.push_back(test);
+    }
+
+    {
+        // SBUF is written with Timer 1 stopped, so the frame is still
+        // waiting for it when the snapshot is taken
+        SnapshotCase test;
+        test.name = "frame waiting for Timer 1";
+        test.code = {
+            {0x00, {
+                0x75, 0x98, 0x40, // mov scon, #$40
+                0x75, 0x89, 0x20, // mov tmod, #$20
+                0x75, 0x8D, 0xFD, // mov th1, #$fd
+                0x75, 0x99, 0x41, // mov sbuf, #$41
+                0x7F, 0xC8, 0xDF, 0xFE, // mov r7, #200 / djnz r7, $
+                0xD2, 0x8E, // setb tr1
+                0x80, 0xFE, // sjmp $
+            }},
+        };
+        test.cycles_before = 2000;
+        test.budgets_after = {30000};
+        test.min_output = 1;
+        test.max_output = 1;
+        test.expected = {{0x198, 0x42, 0x42}, {0x188, 0xC0, 0xC0}};
+        cases.push_back(test);
+    }
+
+    return cases;
+}
+
+const char *modename(execmode mode)
+{
+    switch (mode)
+    {
+        case execmode::Interpreter: return "interpreter";
+        case execmode::Threaded: return "threaded";
+        case execmode::JIT: return "jit";
+    }
+
+    return "";
+}
+
+vector<uint8_t> savestate(Bee8051 &core)
+{
+    vector<uint8_t> state(core.getStateSize());
+    state.resize(core.saveState(state.data(), state.size()));
+    return state;
+}
+
+vector<uint8_t> readoutput(Bee8051 &core)
+{
+    vector<uint8_t> output(0x100);
+    output.resize(core.readSerial(output.data(), output.size()));
+    return output;
+}
+
+// Feeds the input for after the snapshot, and runs the rest of the case
+SnapshotResult runafter(const SnapshotCase &test, Bee8051 &core)
+{
+    SnapshotResult result;
+    core.writeSerial(test.input_after.data(), test.input_after.size());
+
+    for (int64_t budget : test.budgets_after)
+    {
+        core.run(budget);
+    }
+
+    result.state = savestate(core);
+    result.output = readoutput(core);
+    return result;
+}
+
+bool compareresult(const SnapshotCase &test, execmode mode, const char *run_name, const SnapshotResult &result, const SnapshotResult &expected)
+{
+    if (result.state.empty() || (result.state != expected.state) || (result.output != expected.output))
+    {
+        printf("%s (%s): %s run differs, %zu/%zu bytes sent\n", test.name.c_str(), modename(mode), run_name, result.output.size(), expected.output.size());
+        return false;
+    }
+
+    return true;
+}
+
+bool runcase(const SnapshotCase &test, execmode mode)
+{
+    TestHost host;
+
+    for (auto &block : test.code)
+    {
+        copy(block.second.begin(), block.second.end(), (host.rom.begin() + block.first));
+    }
+
+    Bee8051 core;
+    core.bindHost(&host);
+    core.init();
+
+    if (!core.setExecMode(mode))
+    {
+        return true;
+    }
+
+    core.writeSerial(test.input_before.data(), test.input_before.size());
+    core.run(test.cycles_before);
+    readoutput(core);
+
+    vector<uint8_t> snapshot = savestate(core);
+
+    if (snapshot.empty() || core.loadState(snapshot.data(), (snapshot.size() - 1)))
+    {
+        printf("%s (%s): snapshot of %zu bytes not taken, or taken back from a short buffer\n", test.name.c_str(), modename(mode), snapshot.size());
+        return false;
+    }
+
+    SnapshotResult expected = runafter(test, core);
+    bool is_passed = true;
+    bool is_counting = true;
+
+    for (size_t index = 1; index < expected.output.size(); index++)
+    {
+        is_counting &= (expected.output[index] == uint8_t(expected.output[index - 1] + 1));
+    }
+
+    if (!is_counting || (expected.output.size() < test.min_output) || (expected.output.size() > test.max_output))
+    {
+        printf("%s (%s): %zu bytes sent, expected %zu-%zu counting up\n", test.name.c_str(), modename(mode), expected.output.size(), test.min_output, test.max_output);
+        is_passed = false;
+    }
+
+    // Forked onto a fresh core, which starts from init() like any other
+    Bee8051 fork;
+    fork.bindHost(&host);
+    fork.init();
+    fork.setExecMode(mode);
+
+    if (!fork.loadState(snapshot.data(), snapshot.size()))
+    {
+        printf("%s (%s): snapshot not taken back\n", test.name.c_str(), modename(mode));
+        return false;
+    }
+
+    is_passed &= compareresult(test, mode, "forked", runafter(test, fork), expected);
+
+    for (auto &check : test.expected)
+    {
+        uint8_t data = fork.readMemory(check.addr);
+
+        if ((data < check.low) || (data > check.high))
+        {
+            printf("%s (%s): %02X at %X in the forked run, expected %02X-%02X\n", test.name.c_str(), modename(mode), data, check.addr, check.low, check.high);
+            is_passed = false;
+        }
+    }
+
+    // Rewound on the core that took the snapshot
+    core.loadState(snapshot.data(), snapshot.size());
+    is_passed &= compareresult(test, mode, "rewound", runafter(test, core), expected);
+    return is_passed;
+}
+
+int main()
+{
+    int num_failures = 0;
+    vector<SnapshotCase> cases = snapshotcases();
+
+    for (auto &test : cases)
+    {
+        for (execmode mode : {execmode::Interpreter, execmode::Threaded, execmode::JIT})
+        {
+            num_failures += (runcase(test, mode)) ? 0 : 1;
+        }
+    }
+
+    printf("%zu cases, %d failures\n", cases.size(), num_failures);
+    return (num_failures == 0) ? 0 : 1;
+}
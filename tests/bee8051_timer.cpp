@@ -0,0 +1,253 @@
+#include <Bee8051/bee8051.h>
+#include <cstring>
+#include <functional>
+using namespace bee8051;
+using namespace std;
+
+// Table of short programs that set up Timer 0 and 1 in each mode, run in
+// every execution mode in steps, with the host driving the T0 and INT0
+// inputs between steps. The timers are only brought up to date when the
+// CPU reads them, so the programs copy TLx and THx into IRAM themselves,
+// with mov a, #0 / add a, dir / mov dir, a, and the test checks IRAM and
+// TCON after each step
+
+class TestHost
+{
+    public:
+        uint8_t readROM(uint16_t addr)
+        {
+            return rom[addr & 0xFFF];
+        }
+
+        uint8_t portIn(int port)
+        {
+            (void)port;
+            return 0xFF;
+        }
+
+        void portOut(int port, uint8_t data)
+        {
+            (void)port;
+            (void)data;
+        }
+
+        array<uint8_t, 0x1000> rom = {};
+};
+
+struct TimerStep
+{
+    function<void(Bee8051&)> action;
+    int64_t cycles = 0;
+    vector<pair<uint16_t, uint8_t>> expected;
+};
+
+struct TimerCase
+{
+    string name;
+    vector<uint8_t> program;
+    vector<TimerStep> steps;
+};
+
+// Each program ends in sjmp $, unless it loops on its own; the times in
+// the comments are in machine cycles, at the end of each instruction,
+// which is when the CPU reads and writes SFRs
+vector<TimerCase> timercases()
+{
+    vector<TimerCase> cases;
+
+    {
+        TimerCase test;
+        test.name = "mode 1 counts up and sets TF0";
+        test.program = {
+            0x75, 0x89, 0x01, // mov tmod, #$01
+            0x75, 0x8C, 0xFF, // mov th0, #$ff
+            0x75, 0x8A, 0xF0, // mov tl0, #$f0
+            0xD2, 0x8C, // setb tr0 (starts at 7)
+            0x74, 0x00, 0x25, 0x8A, 0xF5, 0x30, // tl0 at 9 to $30
+            0x74, 0x00, 0x25, 0x8C, 0xF5, 0x31, // th0 at 12 to $31
+        };
+        test.steps = {{NULL, 1000, {{0x30, 0xF2}, {0x31, 0xFF}, {0x188, 0x30}}}};
+        cases.push_back(test);
+    }
+
+    {
+        TimerCase test;
+        test.name = "mode 2 reloads TL1 from TH1";
+        test.program = {
+            0x75, 0x89, 0x20, // mov tmod, #$20
+            0x75, 0x8D, 0xFE, // mov th1, #$fe
+            0x75, 0x8B, 0xFE, // mov tl1, #$fe
+            0xD2, 0x8E, // setb tr1 (starts at 7)
+            0x74, 0x00, 0x25, 0x8B, 0xF5, 0x30, // tl1 at 9 to $30
+            0x74, 0x00, 0x25, 0x8B, 0xF5, 0x31, // tl1 at 12 to $31
+        };
+        test.steps = {{NULL, 1000, {{0x30, 0xFE}, {0x31, 0xFF}, {0x188, 0xC0}}}};
+        cases.push_back(test);
+    }
+
+    {
+        // The upper 3 bits of TL0 are left alone
+        TimerCase test;
+        test.name = "mode 0 is a 13-bit counter";
+        test.program = {
+            0x75, 0x89, 0x00, // mov tmod, #$00
+            0x75, 0x8C, 0xFF, // mov th0, #$ff
+            0x75, 0x8A, 0xFC, // mov tl0, #$fc
+            0xD2, 0x8C, // setb tr0 (starts at 7)
+            0x74, 0x00, 0x25, 0x8A, 0xF5, 0x30, // tl0 at 9 to $30
+            0x74, 0x00, 0x25, 0x8C, 0xF5, 0x31, // th0 at 12 to $31
+        };
+        test.steps = {{NULL, 1000, {{0x30, 0xFE}, {0x31, 0x00}, {0x188, 0x30}}}};
+        cases.push_back(test);
+    }
+
+    {
+        // TL0 runs off TR0, and TH0 off TR1, setting TF1
+        TimerCase test;
+        test.name = "mode 3 splits timer 0 in two";
+        test.program = {
+            0x75, 0x89, 0x03, // mov tmod, #$03
+            0x75, 0x8A, 0xFE, // mov tl0, #$fe
+            0x75, 0x8C, 0xFD, // mov th0, #$fd
+            0xD2, 0x8C, // setb tr0 (starts at 7)
+            0xD2, 0x8E, // setb tr1 (starts at 8)
+            0x74, 0x00, 0x25, 0x8A, 0xF5, 0x30, // tl0 at 10 to $30
+            0x74, 0x00, 0x25, 0x8C, 0xF5, 0x31, // th0 at 13 to $31
+        };
+        test.steps = {{NULL, 1000, {{0x30, 0x01}, {0x31, 0x02}, {0x188, 0xF0}}}};
+        cases.push_back(test);
+    }
+
+    {
+        // Counts pulses on T0 and not time
+        TimerCase test;
+        test.name = "counter mode counts T0 pulses";
+        test.program = {
+            0x75, 0x89, 0x05, // mov tmod, #$05
+            0x75, 0x8C, 0xFF, // mov th0, #$ff
+            0x75, 0x8A, 0xFE, // mov tl0, #$fe
+            0xD2, 0x8C, // setb tr0
+        };
+        test.steps = {
+            {NULL, 5000, {{0x188, 0x10}}},
+            {[](Bee8051 &core) { core.pulseTimerInput(0, 3); }, 1000, {{0x18A, 0x01}, {0x18C, 0x00}, {0x188, 0x30}}},
+        };
+        cases.push_back(test);
+    }
+
+    {
+        // With GATE set, timer 0 only runs while INT0 is high; INT0 is
+        // level-triggered, so IE0 follows the pin
+        TimerCase test;
+        test.name = "GATE holds timer 0 while INT0 is low";
+        test.program = {
+            0x75, 0x89, 0x09, // mov tmod, #$09
+            0x75, 0x8C, 0xFF, // mov th0, #$ff
+            0x75, 0x8A, 0xF0, // mov tl0, #$f0
+            0xD2, 0x8C, // setb tr0
+            0x74, 0x00, 0x25, 0x8A, 0xF5, 0x30, // tl0 to $30
+            0x80, 0xF8, // sjmp back
+        };
+        test.steps = {
+            {[](Bee8051 &core) { core.setIntPin(0, false); }, 5000, {{0x30, 0xF0}, {0x188, 0x12}}},
+            {[](Bee8051 &core) { core.setIntPin(0, true); }, 1000, {{0x188, 0x30}}},
+        };
+        cases.push_back(test);
+    }
+
+    {
+        // A timer that is stopped and restarted carries on from where it was
+        TimerCase test;
+        test.name = "TR0 stops and restarts timer 0";
+        test.program = {
+            0x75, 0x89, 0x01, // mov tmod, #$01
+            0xD2, 0x8C, // setb tr0 (starts at 3)
+            0xC2, 0x8C, // clr tr0 (stops at 4)
+            0x74, 0x00, 0x25, 0x8A, 0xF5, 0x30, // tl0 at 6 to $30
+            0xD2, 0x8C, // setb tr0 (starts at 8)
+            0x74, 0x00, 0x25, 0x8A, 0xF5, 0x31, // tl0 at 10 to $31
+        };
+        test.steps = {{NULL, 1000, {{0x30, 0x01}, {0x31, 0x03}, {0x188, 0x10}}}};
+        cases.push_back(test);
+    }
+
+    return cases;
+}
+
+const char *modename(execmode mode)
+{
+    switch (mode)
+    {
+        case execmode::Interpreter: return "interpreter";
+        case execmode::Threaded: return "threaded";
+        case execmode::JIT: return "jit";
+    }
+
+    return "";
+}
+
+bool runcase(const TimerCase &test, execmode mode)
+{
+    TestHost host;
+    copy(test.program.begin(), test.program.end(), host.rom.begin());
+
+    // Programs that do not loop back on their own end in sjmp $
+    if (test.program[test.program.size() - 2] != 0x80)
+    {
+        host.rom[test.program.size()] = 0x80;
+        host.rom[test.program.size() + 1] = 0xFE;
+    }
+
+    Bee8051 core;
+    core.bindHost(&host);
+    core.init();
+
+    if (!core.setExecMode(mode))
+    {
+        return true;
+    }
+
+    bool is_passed = true;
+
+    for (size_t index = 0; index < test.steps.size(); index++)
+    {
+        const TimerStep &step = test.steps[index];
+
+        if (step.action)
+        {
+            step.action(core);
+        }
+
+        core.run(step.cycles);
+
+        for (auto &expected : step.expected)
+        {
+            uint8_t data = core.readMemory(expected.first);
+
+            if (data != expected.second)
+            {
+                printf("%s (%s), step %zu: %02X at %X, expected %02X\n", test.name.c_str(), modename(mode), index, data, expected.first, expected.second);
+                is_passed = false;
+            }
+        }
+    }
+
+    return is_passed;
+}
+
+int main()
+{
+    int num_failures = 0;
+    vector<TimerCase> cases = timercases();
+
+    for (auto &test : cases)
+    {
+        for (execmode mode : {execmode::Interpreter, execmode::Threaded, execmode::JIT})
+        {
+            num_failures += (runcase(test, mode)) ? 0 : 1;
+        }
+    }
+
+    printf("%zu cases, %d failures\n", cases.size(), num_failures);
+    return (num_failures == 0) ? 0 : 1;
+}